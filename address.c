@@ -0,0 +1,432 @@
+/*
+ * Recipients of mail
+ *
+ * The addresses from To, Cc and Bcc are collected to one envelope, so
+ * the message is uploaded only once for all recipients. The lists of
+ * addresses can be passed as comma separated list or as array. The
+ * addresses can be in form "Display Name" <user@domain>, only the
+ * address in angle brackets is used for envelope. The addresses are
+ * deduplicated case insensitively.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_is_valid_address);
+
+/* RFC 5321 limits the path to 256 chars including angle brackets */
+#define MAX_ADDRESS_LEN			254
+#define MAX_LOCAL_PART_LEN		64
+#define MAX_LABEL_LEN			63
+
+/* character classes used by address validator */
+#define AC_ATEXT				0x01	/* atext of RFC 5322 */
+#define AC_LABEL				0x02	/* letter, digit or hyphen */
+#define AC_QTEXT				0x04	/* content of quoted string */
+#define AC_DTEXT				0x08	/* content of domain literal */
+
+/*
+ * The non ASCII chars (UTF8 encoded) are allowed everywhere
+ * (RFC 6531, internationalized addresses).
+ */
+static const unsigned char address_char_class[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x04, 0x0d, 0x08, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0c, 0x0c, 0x0d, 0x0d, 0x0c, 0x0f, 0x0c, 0x0d,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0c, 0x0c, 0x0c, 0x0d, 0x0c, 0x0d,
+	0x0c, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x04, 0x00, 0x04, 0x0d, 0x0d,
+	0x0d, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0d, 0x0d, 0x0d, 0x0d, 0x00,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f
+};
+
+#define IS_CLASS(c, cls)		((address_char_class[(unsigned char) (c)] & (cls)) != 0)
+
+typedef struct
+{
+	char		address[MAX_ADDRESS_LEN + 1];	/* hash key */
+} SeenAddress;
+
+/*
+ * Returns comma separated list of addresses. The argument can
+ * be a string or an array of strings. Returns NULL when the
+ * argument is NULL or empty.
+ */
+char *
+recipients_arg(FunctionCallInfo fcinfo, int argno)
+{
+	Oid			argtype;
+	ArrayType  *arr;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	StringInfoData str;
+	int			i;
+
+	if (PG_ARGISNULL(argno))
+		return NULL;
+
+	argtype = get_fn_expr_argtype(fcinfo->flinfo, argno);
+
+	if (!OidIsValid(argtype) || !type_is_array(argtype))
+		return null_or_empty_arg(fcinfo, argno);
+
+	arr = PG_GETARG_ARRAYTYPE_P(argno);
+
+	if (ARR_ELEMTYPE(arr) != TEXTOID)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("array of recipients should be of type text[]")));
+
+	deconstruct_array(arr, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+
+	initStringInfo(&str);
+
+	for (i = 0; i < nelems; i++)
+	{
+		text	   *txt;
+
+		if (nulls[i])
+			continue;
+
+		txt = DatumGetTextPP(elems[i]);
+
+		if (VARSIZE_ANY_EXHDR(txt) == 0)
+			continue;
+
+		if (str.len > 0)
+			appendStringInfoString(&str, ", ");
+
+		appendBinaryStringInfo(&str, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt));
+	}
+
+	return str.len > 0 ? str.data : NULL;
+}
+
+char *
+not_null_not_empty_recipients_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname)
+{
+	char	   *result;
+
+	(void) not_null_arg(fcinfo, argno, fcname, argname);
+
+	result = recipients_arg(fcinfo, argno);
+
+	if (!result)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("empty list of recipients is not allowed"),
+				 errhint("The value of argument \"%s\" of function \"%s\" is empty.",
+						  argname,
+						  fcname)));
+
+	return result;
+}
+
+/*
+ * Returns true, when the string is valid addr-spec (RFC 5322). The local
+ * part can be dot-atom or quoted string, the domain can be host name or
+ * domain literal. The comments and folding white spaces are not allowed.
+ */
+bool
+is_valid_address(const char *str, size_t len)
+{
+	const char *ptr = str;
+	const char *end = str + len;
+	const char *start;
+
+	if (len == 0 || len > MAX_ADDRESS_LEN)
+		return false;
+
+	/* local part */
+	if (*ptr == '"')
+	{
+		ptr++;
+
+		while (ptr < end && *ptr != '"')
+		{
+			if (*ptr == '\\')
+			{
+				/* quoted pair */
+				if (++ptr >= end || (!IS_CLASS(*ptr, AC_QTEXT) && *ptr != '"' && *ptr != '\\'))
+					return false;
+			}
+			else if (!IS_CLASS(*ptr, AC_QTEXT))
+				return false;
+
+			ptr++;
+		}
+
+		if (ptr >= end)
+			return false;
+
+		ptr++;
+	}
+	else
+	{
+		for (;;)
+		{
+			start = ptr;
+
+			while (ptr < end && IS_CLASS(*ptr, AC_ATEXT))
+				ptr++;
+
+			/* empty atom (leading, trailing or double dot) */
+			if (ptr == start)
+				return false;
+
+			if (ptr < end && *ptr == '.')
+				ptr++;
+			else
+				break;
+		}
+	}
+
+	if (ptr - str > MAX_LOCAL_PART_LEN || ptr >= end || *ptr != '@')
+		return false;
+
+	ptr++;
+
+	/* domain literal */
+	if (ptr < end && *ptr == '[')
+	{
+		start = ++ptr;
+
+		while (ptr < end && IS_CLASS(*ptr, AC_DTEXT))
+			ptr++;
+
+		return ptr > start && ptr == end - 1 && *ptr == ']';
+	}
+
+	/* host name */
+	for (;;)
+	{
+		start = ptr;
+
+		while (ptr < end && IS_CLASS(*ptr, AC_LABEL))
+			ptr++;
+
+		if (ptr == start || ptr - start > MAX_LABEL_LEN ||
+			*start == '-' || ptr[-1] == '-')
+			return false;
+
+		if (ptr == end)
+			return true;
+
+		if (*ptr != '.' || ++ptr == end)
+			return false;
+	}
+}
+
+/*
+ * Returns address used in envelope. The input is one item of
+ * address list ("Name" <addr> or addr). The address is validated.
+ * The result is palloc'ed, and the domain part is in lower case.
+ */
+static char *
+envelope_address(const char *str, size_t len)
+{
+	const char *start = str;
+	const char *end = str + len;
+	const char *ptr;
+	bool		in_quotes = false;
+	char	   *result;
+	char	   *at;
+
+	/* search address in angle brackets */
+	for (ptr = str; ptr < end; ptr++)
+	{
+		if (*ptr == '"' && (ptr == str || ptr[-1] != '\\'))
+			in_quotes = !in_quotes;
+		else if (*ptr == '<' && !in_quotes)
+		{
+			const char *close = memchr(ptr, '>', end - ptr);
+
+			if (!close)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("missing \">\" in mail address \"%.*s\"", (int) len, str)));
+
+			start = ptr + 1;
+			end = close;
+			break;
+		}
+	}
+
+	while (start < end && isspace((unsigned char) *start))
+		start++;
+
+	while (end > start && isspace((unsigned char) end[-1]))
+		end--;
+
+	if (end - start > MAX_ADDRESS_LEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("mail address \"%.*s\" is too long", (int) (end - start), start),
+				 errdetail("The maximum length of mail address is %d characters.",
+						   MAX_ADDRESS_LEN)));
+
+	if (start < end && !is_valid_address(start, end - start))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid mail address \"%.*s\"", (int) (end - start), start)));
+
+	result = pnstrdup(start, end - start);
+
+	at = strrchr(result, '@');
+	if (at)
+	{
+		for (at++; *at; at++)
+			*at = pg_tolower((unsigned char) *at);
+	}
+
+	return result;
+}
+
+char *
+envelope_sender(const char *sender)
+{
+	char	   *address = envelope_address(sender, strlen(sender));
+
+	/* the empty address would be null reverse-path (used by bounces) */
+	if (!*address)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid mail address \"%s\"", sender)));
+
+	return address;
+}
+
+/*
+ * Appends addresses from comma separated list to envelope. The commas
+ * inside quoted strings or inside angle brackets are not separators.
+ */
+static List *
+add_addresses(List *envelope, HTAB *seen, const char *str)
+{
+	const char *ptr = str;
+
+	if (!str)
+		return envelope;
+
+	while (*ptr)
+	{
+		const char *start = ptr;
+		bool		in_quotes = false;
+		bool		in_brackets = false;
+		char	   *address;
+
+		for (; *ptr; ptr++)
+		{
+			if (*ptr == '"' && (ptr == start || ptr[-1] != '\\'))
+				in_quotes = !in_quotes;
+			else if (!in_quotes)
+			{
+				if (*ptr == '<')
+					in_brackets = true;
+				else if (*ptr == '>')
+					in_brackets = false;
+				else if (*ptr == ',' && !in_brackets)
+					break;
+			}
+		}
+
+		address = envelope_address(start, ptr - start);
+
+		if (*address)
+		{
+			char		key[MAX_ADDRESS_LEN + 1];
+			char	   *kptr;
+			bool		found;
+
+			/*
+			 * Local part is case sensitive by RFC 5321, but in reality
+			 * there are not mailboxes that differs only by case.
+			 */
+			strcpy(key, address);
+			for (kptr = key; *kptr; kptr++)
+				*kptr = pg_tolower((unsigned char) *kptr);
+
+			(void) hash_search(seen, key, HASH_ENTER, &found);
+
+			if (!found)
+				envelope = lappend(envelope, address);
+			else
+				pfree(address);
+		}
+		else
+			pfree(address);
+
+		if (*ptr == ',')
+			ptr++;
+	}
+
+	return envelope;
+}
+
+/*
+ * Returns list of unique addresses from To, Cc and Bcc
+ */
+List *
+envelope_recipients(MailMessage *msg)
+{
+	HASHCTL		ctl;
+	HTAB	   *seen;
+	List	   *envelope = NIL;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = MAX_ADDRESS_LEN + 1;
+	ctl.entrysize = sizeof(SeenAddress);
+	ctl.hcxt = CurrentMemoryContext;
+
+	seen = hash_create("orafce_mail recipients",
+					   64,
+					   &ctl,
+#if PG_VERSION_NUM >= 140000
+					   HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+#else
+					   HASH_ELEM | HASH_CONTEXT);
+#endif
+
+	envelope = add_addresses(envelope, seen, msg->recipients);
+	envelope = add_addresses(envelope, seen, msg->cc);
+	envelope = add_addresses(envelope, seen, msg->bcc);
+
+	hash_destroy(seen);
+
+	if (envelope == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("mail has no recipient")));
+
+	return envelope;
+}
+
+/*
+ * FUNCTION utl_mail.is_valid_address(address text)
+ * RETURNS boolean
+ */
+Datum
+orafce_mail_is_valid_address(PG_FUNCTION_ARGS)
+{
+	text	   *address = PG_GETARG_TEXT_PP(0);
+
+	PG_RETURN_BOOL(is_valid_address(VARDATA_ANY(address),
+									VARSIZE_ANY_EXHDR(address)));
+}
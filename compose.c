@@ -0,0 +1,1001 @@
+/*
+ * RFC 5322 message composer
+ *
+ * The message is composed in two passes by same code. The first pass
+ * only counts the size of message (the data are not written), the second
+ * pass writes the message to one buffer of exact size.
+ *
+ * The values of headers cannot contain line breaks (it would allow
+ * to inject headers). The values with non ASCII chars are encoded
+ * as RFC 2047 encoded words (subject and display names) or by RFC 2231
+ * (file name of attachment).
+ */
+#include "postgres.h"
+
+#include <time.h>
+
+#include "mb/pg_wchar.h"
+#include "pgtime.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_compose);
+
+#define BASE64_LINE_INPUT		57		/* 57 bytes are encoded to 76 chars */
+#define BASE64_LINE_OUTPUT		76
+
+/* attachment generated while sending is encoded in parts of this size */
+#define ATTACHMENT_ENCODE_SIZE	(BASE64_LINE_INPUT * 4096)
+
+/* RFC 2047 limits the length of encoded word */
+#define ENCODED_WORD_MAX_LEN	75
+
+/*
+ * Composed message with attachment, that is read from source, encoded,
+ * and inserted on the place of attachment while the message is sent.
+ */
+typedef struct
+{
+	MessageStream stream;		/* must be first */
+	AttachmentSource *source;
+	char	   *raw;			/* data read from source, not encoded yet */
+	size_t		raw_len;
+	char	   *encoded;		/* base64 encoded data */
+	size_t		encoded_len;
+	size_t		encoded_pos;
+	bool		eof;			/* all data were read from source */
+	const char *message;		/* composed message without attachment */
+	size_t		size;
+	size_t		att_offset;
+	size_t		position;		/* position in composed message */
+} AttachmentStream;
+
+typedef struct
+{
+	char	   *data;			/* NULL in counting pass */
+	size_t		used;
+	DkimSigner *dkim;			/* body hash is calculated in writing pass */
+	bool		in_body;
+} ComposeBuffer;
+
+static const char *base64_chars =
+"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+append_data(ComposeBuffer *buf, const char *data, size_t len)
+{
+	if (buf->data)
+	{
+		memcpy(buf->data + buf->used, data, len);
+
+		if (buf->dkim && buf->in_body)
+			dkim_body_update(buf->dkim, data, len);
+	}
+
+	buf->used += len;
+}
+
+static void
+append_str(ComposeBuffer *buf, const char *str)
+{
+	append_data(buf, str, strlen(str));
+}
+
+/*
+ * Raises an error, when the value of header contains line break
+ */
+static void
+check_header_value(const char *fieldname, const char *value)
+{
+	if (strpbrk(value, "\r\n"))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("line break is not allowed in mail header"),
+				 errdetail("The value of header \"%.*s\" contains CR or LF char.",
+						   (int) strcspn(fieldname, ":"), fieldname)));
+}
+
+static void
+append_header(ComposeBuffer *buf, const char *fieldname, const char *value)
+{
+	if (!value)
+		return;
+
+	check_header_value(fieldname, value);
+
+	append_str(buf, fieldname);
+	append_str(buf, value);
+	append_data(buf, "\r\n", 2);
+}
+
+static bool
+is_ascii(const char *str, size_t len)
+{
+	const char *end = str + len;
+
+	for (; str < end; str++)
+	{
+		if (IS_HIGHBIT_SET(*str))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The values are in database encoding
+ */
+static const char *
+header_charset(void)
+{
+	const char *charset = get_encoding_name_for_icu(GetDatabaseEncoding());
+
+	return charset ? charset : "UTF-8";
+}
+
+/*
+ * Encodes data to base64 without line breaks. Returns number of
+ * written chars.
+ */
+static size_t
+encode_base64(const unsigned char *data, size_t size, char *dest)
+{
+	char	   *wptr = dest;
+	size_t		i;
+
+	for (i = 0; i < size; i += 3)
+	{
+		uint32		v = data[i] << 16;
+
+		if (i + 1 < size)
+			v |= data[i + 1] << 8;
+		if (i + 2 < size)
+			v |= data[i + 2];
+
+		*wptr++ = base64_chars[(v >> 18) & 0x3f];
+		*wptr++ = base64_chars[(v >> 12) & 0x3f];
+		*wptr++ = i + 1 < size ? base64_chars[(v >> 6) & 0x3f] : '=';
+		*wptr++ = i + 2 < size ? base64_chars[v & 0x3f] : '=';
+	}
+
+	return wptr - dest;
+}
+
+/*
+ * Appends text as sequence of RFC 2047 encoded words (B encoding). The
+ * words are separated by folding white space, and the multibyte chars
+ * are not splitted between words.
+ */
+static void
+append_encoded_words(ComposeBuffer *buf, const char *str, size_t len)
+{
+	const char *charset = header_charset();
+	size_t		max_bytes;
+	const char *ptr = str;
+	const char *end = str + len;
+
+	/* =?charset?B?encoded?= */
+	max_bytes = (ENCODED_WORD_MAX_LEN - strlen(charset) - 7) / 4 * 3;
+
+	while (ptr < end)
+	{
+		const char *start = ptr;
+		char		encoded[ENCODED_WORD_MAX_LEN];
+
+		while (ptr < end)
+		{
+			int			l = pg_mblen(ptr);
+
+			if (l > end - ptr)
+				l = end - ptr;
+
+			if ((size_t) (ptr + l - start) > max_bytes)
+				break;
+
+			ptr += l;
+		}
+
+		if (start > str)
+			append_data(buf, "\r\n ", 3);
+
+		append_str(buf, "=?");
+		append_str(buf, charset);
+		append_str(buf, "?B?");
+		append_data(buf, encoded,
+					encode_base64((const unsigned char *) start, ptr - start, encoded));
+		append_str(buf, "?=");
+	}
+}
+
+/*
+ * Appends header with unstructured value (Subject)
+ */
+static void
+append_text_header(ComposeBuffer *buf, const char *fieldname, const char *value)
+{
+	if (!value)
+		return;
+
+	check_header_value(fieldname, value);
+
+	append_str(buf, fieldname);
+
+	if (is_ascii(value, strlen(value)))
+		append_str(buf, value);
+	else
+		append_encoded_words(buf, value, strlen(value));
+
+	append_data(buf, "\r\n", 2);
+}
+
+/*
+ * Appends one item of address list. The display name with non ASCII
+ * chars is encoded, the address is not changed (internationalized
+ * addresses are sent in UTF8).
+ */
+static void
+append_address_item(ComposeBuffer *buf, const char *str, size_t len)
+{
+	const char *end = str + len;
+	const char *bracket = NULL;
+	const char *ptr;
+	const char *name;
+	const char *name_end;
+	bool		in_quotes = false;
+
+	for (ptr = str; ptr < end; ptr++)
+	{
+		if (*ptr == '"' && (ptr == str || ptr[-1] != '\\'))
+			in_quotes = !in_quotes;
+		else if (*ptr == '<' && !in_quotes)
+		{
+			bracket = ptr;
+			break;
+		}
+	}
+
+	if (!bracket || is_ascii(str, bracket - str))
+	{
+		append_data(buf, str, len);
+		return;
+	}
+
+	name = str;
+	while (name < bracket && isspace((unsigned char) *name))
+		name++;
+
+	name_end = bracket;
+	while (name_end > name && isspace((unsigned char) name_end[-1]))
+		name_end--;
+
+	/* the leading space (after comma) is kept */
+	append_data(buf, str, name - str);
+
+	if (name_end - name >= 2 && *name == '"' && name_end[-1] == '"')
+	{
+		char	   *unquoted = palloc(name_end - name);
+		char	   *wptr = unquoted;
+
+		for (ptr = name + 1; ptr < name_end - 1; ptr++)
+		{
+			if (*ptr == '\\' && ptr + 1 < name_end - 1)
+				ptr++;
+
+			*wptr++ = *ptr;
+		}
+
+		append_encoded_words(buf, unquoted, wptr - unquoted);
+		pfree(unquoted);
+	}
+	else
+		append_encoded_words(buf, name, name_end - name);
+
+	append_data(buf, " ", 1);
+	append_data(buf, bracket, end - bracket);
+}
+
+/*
+ * Appends header with comma separated list of addresses. The commas
+ * inside quoted strings or inside angle brackets are not separators.
+ */
+static void
+append_address_header(ComposeBuffer *buf, const char *fieldname, const char *value)
+{
+	const char *ptr = value;
+
+	if (!value)
+		return;
+
+	check_header_value(fieldname, value);
+
+	append_str(buf, fieldname);
+
+	while (*ptr)
+	{
+		const char *start = ptr;
+		bool		in_quotes = false;
+		bool		in_brackets = false;
+
+		for (; *ptr; ptr++)
+		{
+			if (*ptr == '"' && (ptr == start || ptr[-1] != '\\'))
+				in_quotes = !in_quotes;
+			else if (!in_quotes)
+			{
+				if (*ptr == '<')
+					in_brackets = true;
+				else if (*ptr == '>')
+					in_brackets = false;
+				else if (*ptr == ',' && !in_brackets)
+					break;
+			}
+		}
+
+		append_address_item(buf, start, ptr - start);
+
+		if (*ptr == ',')
+			append_data(buf, ptr++, 1);
+	}
+
+	append_data(buf, "\r\n", 2);
+}
+
+/*
+ * Appends empty line, that separates headers and body
+ */
+static void
+append_headers_end(ComposeBuffer *buf)
+{
+	append_data(buf, "\r\n", 2);
+	buf->in_body = true;
+}
+
+/*
+ * Appends string in double quotes. The chars '"' and '\' are escaped.
+ */
+static void
+append_quoted(ComposeBuffer *buf, const char *str)
+{
+	append_data(buf, "\"", 1);
+
+	while (*str)
+	{
+		if (*str == '"' || *str == '\\')
+			append_data(buf, "\\", 1);
+
+		append_data(buf, str++, 1);
+	}
+
+	append_data(buf, "\"", 1);
+}
+
+/*
+ * Appends parameter value in RFC 2231 format: *=charset''value, where
+ * the chars other than attribute chars are percent encoded.
+ */
+static void
+append_extended_value(ComposeBuffer *buf, const char *str)
+{
+	static const char *hex = "0123456789ABCDEF";
+
+	append_str(buf, "*=");
+	append_str(buf, header_charset());
+	append_str(buf, "''");
+
+	for (; *str; str++)
+	{
+		unsigned char c = (unsigned char) *str;
+
+		if (isalnum(c) || strchr("!#$&+-.^_`|~", c))
+			append_data(buf, str, 1);
+		else
+		{
+			char		encoded[3];
+
+			encoded[0] = '%';
+			encoded[1] = hex[c >> 4];
+			encoded[2] = hex[c & 0x0f];
+
+			append_data(buf, encoded, 3);
+		}
+	}
+}
+
+/*
+ * Appends text with replaced unix line endings by CRLF
+ */
+static void
+append_unix2dos(ComposeBuffer *buf, const char *data, size_t size)
+{
+	const char *start = data;
+	const char *ptr = data;
+	const char *end = data + size;
+
+	while (ptr < end)
+	{
+		if (*ptr == '\n' && (ptr == data || ptr[-1] != '\r'))
+		{
+			append_data(buf, start, ptr - start);
+			append_data(buf, "\r\n", 2);
+			start = ptr + 1;
+		}
+
+		ptr++;
+	}
+
+	append_data(buf, start, ptr - start);
+}
+
+/*
+ * Appends base64 encoded data splitted to lines. When unix2dos
+ * is true, then source data are converted on the fly.
+ */
+static void
+append_base64(ComposeBuffer *buf, const char *data, size_t size, bool unix2dos)
+{
+	const char *ptr = data;
+	const char *end = data + size;
+	bool		pending_lf = false;
+
+	while (ptr < end || pending_lf)
+	{
+		unsigned char line[BASE64_LINE_INPUT];
+		char		encoded[BASE64_LINE_OUTPUT + 2];
+		char	   *wptr = encoded;
+		int			n = 0;
+		int			i;
+
+		/* read one line of source data */
+		while (n < BASE64_LINE_INPUT && (ptr < end || pending_lf))
+		{
+			if (pending_lf)
+			{
+				line[n++] = '\n';
+				pending_lf = false;
+			}
+			else if (unix2dos && *ptr == '\n' && (ptr == data || ptr[-1] != '\r'))
+			{
+				line[n++] = '\r';
+				pending_lf = true;
+				ptr++;
+			}
+			else
+				line[n++] = *ptr++;
+		}
+
+		for (i = 0; i < n; i += 3)
+		{
+			uint32		v = line[i] << 16;
+
+			if (i + 1 < n)
+				v |= line[i + 1] << 8;
+			if (i + 2 < n)
+				v |= line[i + 2];
+
+			*wptr++ = base64_chars[(v >> 18) & 0x3f];
+			*wptr++ = base64_chars[(v >> 12) & 0x3f];
+			*wptr++ = i + 1 < n ? base64_chars[(v >> 6) & 0x3f] : '=';
+			*wptr++ = i + 2 < n ? base64_chars[v & 0x3f] : '=';
+		}
+
+		*wptr++ = '\r';
+		*wptr++ = '\n';
+
+		append_data(buf, encoded, wptr - encoded);
+	}
+}
+
+static size_t
+unix2dos_size(const char *data, size_t size)
+{
+	const char *ptr;
+	size_t		result = size;
+
+	for (ptr = data; ptr < data + size; ptr++)
+	{
+		if (*ptr == '\n' && (ptr == data || ptr[-1] != '\r'))
+			result += 1;
+	}
+
+	return result;
+}
+
+/*
+ * Encodes data to base64 lines. The buffer should be large enough for
+ * base64_encoded_size(size) bytes. Returns number of written bytes.
+ */
+size_t
+encode_base64_lines(const char *data, size_t size, char *buffer)
+{
+	ComposeBuffer buf;
+
+	buf.data = buffer;
+	buf.used = 0;
+
+	append_base64(&buf, data, size, false);
+
+	return buf.used;
+}
+
+size_t
+base64_encoded_size(size_t size)
+{
+	size_t		encoded = (size + 2) / 3 * 4;
+
+	/* every line is finished by CRLF */
+	return encoded + (encoded + BASE64_LINE_OUTPUT - 1) / BASE64_LINE_OUTPUT * 2;
+}
+
+static bool
+is_text_plain(const char *mime_type)
+{
+	return !mime_type || strncmp(mime_type, "text/plain;", 11) == 0;
+}
+
+/*
+ * Writes message's body. In counting pass, only the size is calculated
+ */
+static void
+append_body(ComposeBuffer *buf, const char *data, size_t size, bool unix2dos)
+{
+	if (!buf->data)
+		buf->used += unix2dos ? unix2dos_size(data, size) : size;
+	else if (unix2dos)
+		append_unix2dos(buf, data, size);
+	else
+		append_data(buf, data, size);
+}
+
+static void
+append_attachment(ComposeBuffer *buf, const char *data, size_t size, bool unix2dos)
+{
+	if (!buf->data)
+		buf->used += base64_encoded_size(unix2dos ? unix2dos_size(data, size) : size);
+	else
+		append_base64(buf, data, size, unix2dos);
+}
+
+static void
+format_date(char *buffer, size_t size)
+{
+	static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+								   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	pg_time_t	now = (pg_time_t) time(NULL);
+	struct pg_tm *tm = pg_gmtime(&now);
+
+	snprintf(buffer, size, "%s, %02d %s %04d %02d:%02d:%02d +0000",
+			 days[tm->tm_wday],
+			 tm->tm_mday,
+			 months[tm->tm_mon],
+			 tm->tm_year + 1900,
+			 tm->tm_hour,
+			 tm->tm_min,
+			 tm->tm_sec);
+}
+
+/*
+ * The boundary cannot be in content, so it should not be predictable
+ */
+static void
+make_boundary(char *buffer, size_t size)
+{
+	uint32		rnd[4];
+
+	if (!pg_strong_random(rnd, sizeof(rnd)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not generate random MIME boundary")));
+
+	snprintf(buffer, size, "----=_orafce_mail_%08x%08x%08x%08x",
+			 rnd[0], rnd[1], rnd[2], rnd[3]);
+}
+
+static void
+write_message(ComposeBuffer *buf,
+			  MailMessage *msg,
+			  const char *date,
+			  const char *boundary,
+			  const char *default_mime_type)
+{
+	const char *message = msg->message ? msg->message : "";
+	const char *mime_type = msg->mime_type ? msg->mime_type : default_mime_type;
+	char		priority[20];
+
+	append_header(buf, "Date: ", date);
+	append_address_header(buf, "From: ", msg->sender);
+	append_address_header(buf, "To: ", msg->recipients);
+	append_address_header(buf, "Cc: ", msg->cc);
+
+	/* Bcc recipients are only in envelope */
+	if (msg->bcc_header)
+		append_address_header(buf, "Bcc: ", msg->bcc);
+
+	append_address_header(buf, "Reply-To: ", msg->replyto);
+
+	if (!msg->priority_is_null)
+	{
+		snprintf(priority, sizeof(priority), "%d", msg->priority);
+		append_header(buf, "X-Priority: ", priority);
+	}
+
+	append_text_header(buf, "Subject: ", msg->subject);
+	append_header(buf, "MIME-Version: ", "1.0");
+
+	if (!msg->attachment_data && !msg->att_source)
+	{
+		append_header(buf, "Content-Type: ", mime_type);
+		append_header(buf, "Content-Transfer-Encoding: ", "8bit");
+		append_headers_end(buf);
+
+		append_body(buf, message, strlen(message), is_text_plain(msg->mime_type));
+
+		return;
+	}
+
+	append_str(buf, "Content-Type: multipart/mixed; boundary=\"");
+	append_str(buf, boundary);
+	append_str(buf, "\"\r\n");
+	append_headers_end(buf);
+
+	if (msg->message)
+	{
+		append_str(buf, "--");
+		append_str(buf, boundary);
+		append_data(buf, "\r\n", 2);
+
+		append_header(buf, "Content-Type: ", mime_type);
+		append_header(buf, "Content-Transfer-Encoding: ", "8bit");
+		append_data(buf, "\r\n", 2);
+
+		append_body(buf, message, strlen(message), is_text_plain(msg->mime_type));
+		append_data(buf, "\r\n", 2);
+	}
+
+	append_str(buf, "--");
+	append_str(buf, boundary);
+	append_data(buf, "\r\n", 2);
+
+	if (msg->att_mime_type)
+		append_header(buf, "Content-Type: ", msg->att_mime_type);
+	else
+		append_header(buf, "Content-Type: ",
+					  msg->att_is_text ? default_mime_type : "application/octet");
+
+	append_header(buf, "Content-Transfer-Encoding: ", "base64");
+
+	append_str(buf, msg->att_inline ?
+			   "Content-Disposition: inline" : "Content-Disposition: attachment");
+
+	if (msg->att_filename)
+	{
+		check_header_value("Content-Disposition", msg->att_filename);
+
+		append_str(buf, "; filename");
+
+		if (is_ascii(msg->att_filename, strlen(msg->att_filename)))
+		{
+			append_data(buf, "=", 1);
+			append_quoted(buf, msg->att_filename);
+		}
+		else
+			append_extended_value(buf, msg->att_filename);
+	}
+
+	append_data(buf, "\r\n", 2);
+
+	append_data(buf, "\r\n", 2);
+
+	/* the data of attachment generated while sending are inserted here later */
+	msg->att_offset = buf->used;
+
+	append_attachment(buf,
+					  msg->attachment_data,
+					  msg->attachment_size,
+					  msg->att_is_text && is_text_plain(msg->att_mime_type));
+
+	append_str(buf, "--");
+	append_str(buf, boundary);
+	append_str(buf, "--\r\n");
+}
+
+/*
+ * Raises an error, when the size of message is over the limit
+ * (0 is unlimited).
+ */
+void
+check_message_size(size_t size, size_t max_size)
+{
+	if (max_size > 0 && size > max_size)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("mail message is too large"),
+				 errdetail("The size of encoded message is at least " UINT64_FORMAT " bytes, the limit is " UINT64_FORMAT " bytes.",
+						   (uint64) size, (uint64) max_size),
+				 errhint("Check orafce_mail.max_message_size and the SIZE limit of mail server.")));
+}
+
+/*
+ * Reads next part of streamed message. The size of message is checked
+ * against the limit.
+ */
+size_t
+read_message_stream(MessageStream *stream, char *buffer, size_t size)
+{
+	size_t		result = stream->read(stream, buffer, size);
+
+	stream->size += result;
+
+	check_message_size(stream->size, stream->max_size);
+
+	send_memory_sample(0);
+
+	return result;
+}
+
+/*
+ * Reads data from source until there are enough data, and encodes them.
+ * The rest of data smaller than base64 line is encoded with next part.
+ */
+static void
+encode_next_part(AttachmentStream *as)
+{
+	size_t		n;
+
+	while (!as->eof && as->raw_len < ATTACHMENT_ENCODE_SIZE)
+	{
+		n = as->source->read(as->source,
+							 as->raw + as->raw_len,
+							 ATTACHMENT_ENCODE_SIZE - as->raw_len);
+		if (n == 0)
+			as->eof = true;
+
+		as->raw_len += n;
+	}
+
+	/* only full lines are encoded before the end */
+	n = as->eof ? as->raw_len : as->raw_len / BASE64_LINE_INPUT * BASE64_LINE_INPUT;
+
+	as->encoded_len = encode_base64_lines(as->raw, n, as->encoded);
+	as->encoded_pos = 0;
+
+	memmove(as->raw, as->raw + n, as->raw_len - n);
+	as->raw_len -= n;
+}
+
+static size_t
+read_attachment_stream(MessageStream *stream, char *buffer, size_t size)
+{
+	AttachmentStream *as = (AttachmentStream *) stream;
+	size_t		result = 0;
+
+	while (result < size)
+	{
+		size_t		len;
+
+		if (as->position < as->att_offset ||
+			(as->eof && as->encoded_pos == as->encoded_len))
+		{
+			/* parts of composed message before and after attachment */
+			size_t		end = as->position < as->att_offset ? as->att_offset : as->size;
+
+			if (as->position == end)
+				break;
+
+			len = Min(end - as->position, size - result);
+			memcpy(buffer + result, as->message + as->position, len);
+			as->position += len;
+		}
+		else if (as->encoded_pos < as->encoded_len)
+		{
+			len = Min(as->encoded_len - as->encoded_pos, size - result);
+			memcpy(buffer + result, as->encoded + as->encoded_pos, len);
+			as->encoded_pos += len;
+		}
+		else
+		{
+			encode_next_part(as);
+			continue;
+		}
+
+		result += len;
+	}
+
+	return result;
+}
+
+/*
+ * Returns the stream of message, that reads the composed message, and
+ * inserts the encoded attachment read from source at position att_offset.
+ * Only one part of attachment is held in memory.
+ */
+MessageStream *
+attachment_stream(AttachmentSource *source,
+				  const char *message,
+				  size_t size,
+				  size_t att_offset)
+{
+	AttachmentStream *as = palloc0(sizeof(AttachmentStream));
+
+	as->source = source;
+	as->raw = palloc(ATTACHMENT_ENCODE_SIZE);
+	as->encoded = palloc(base64_encoded_size(ATTACHMENT_ENCODE_SIZE));
+	as->message = message;
+	as->size = size;
+	as->att_offset = att_offset;
+
+	as->stream.read = read_attachment_stream;
+	as->stream.size = 0;
+	as->stream.max_size = 0;
+
+	return &as->stream;
+}
+
+/*
+ * Reads whole attachment from source to memory. It is necessary, when
+ * whole message should be known before it is sent (DKIM signature).
+ * The size of encoded attachment is checked while the data are read.
+ */
+void
+materialize_attachment(MailMessage *msg, size_t max_size)
+{
+	size_t		alloc = ATTACHMENT_ENCODE_SIZE;
+	size_t		used = 0;
+	char	   *data;
+	size_t		n;
+
+	data = palloc(alloc);
+
+	do
+	{
+		if (alloc - used < ATTACHMENT_ENCODE_SIZE)
+		{
+			alloc *= 2;
+			data = repalloc_huge(data, alloc);
+		}
+
+		n = msg->att_source->read(msg->att_source, data + used, alloc - used);
+		used += n;
+
+		check_message_size(base64_encoded_size(used), max_size);
+	}
+	while (n > 0);
+
+	msg->attachment_data = data;
+	msg->attachment_size = used;
+	msg->att_source = NULL;
+}
+
+/*
+ * Returns composed message. The buffer is allocated with "prefix"
+ * bytes before message (used for varlena header). The size of
+ * message (without prefix) is returned in "size". When the size
+ * is over "max_size" (0 is unlimited), then an error is raised
+ * before any data are encoded. When DKIM signing is configured,
+ * then the message starts by DKIM-Signature header.
+ */
+char *
+compose_message(MailMessage *msg, size_t prefix, size_t max_size, size_t *size)
+{
+	ComposeBuffer buf;
+	char		date[64];
+	char		boundary[64];
+	char		default_mime_type[100];
+	char	   *result;
+	DkimSigner *dkim;
+	size_t		dkim_size = 0;
+
+	dkim = dkim_begin();
+
+	/* the signature requires whole body before sending */
+	if (dkim && msg->att_source)
+		elog(ERROR, "attachment should be materialized before the message is signed");
+
+	if (dkim)
+		dkim_size = dkim_header_size(dkim);
+
+	format_date(date, sizeof(date));
+	make_boundary(boundary, sizeof(boundary));
+
+	snprintf(default_mime_type,
+			 sizeof(default_mime_type),
+			 "text/plain; charset=\"%s\"",
+			 get_encoding_name_for_icu(pg_get_client_encoding()));
+
+	/* counting pass */
+	buf.data = NULL;
+	buf.used = 0;
+	buf.dkim = NULL;
+	buf.in_body = false;
+
+	write_message(&buf, msg, date, boundary, default_mime_type);
+
+	*size = dkim_size + buf.used;
+
+	check_message_size(*size, max_size);
+
+	result = MemoryContextAllocHuge(CurrentMemoryContext, prefix + *size + 1);
+
+	/* writing pass, the space for DKIM-Signature header is reserved */
+	buf.data = result + prefix + dkim_size;
+	buf.used = 0;
+	buf.dkim = dkim;
+	buf.in_body = false;
+
+	write_message(&buf, msg, date, boundary, default_mime_type);
+
+	Assert(dkim_size + buf.used == *size);
+
+	result[prefix + *size] = '\0';
+
+	if (dkim)
+		dkim_sign(dkim, result + prefix, buf.data, buf.used);
+
+	return result;
+}
+
+/*
+ * FUNCTION utl_mail.compose(
+ * 		sender varchar2,
+ * 		recipients varchar2,
+ * 		cc varchar2 DEFAULT NULL,
+ * 		bcc varchar2 DEFAULT NULL,
+ * 		subject varchar2 DEFAULT NULL,
+ * 		message varchar2 DEFAULT NULL,
+ * 		mime_type varchar2 DEFAULT NULL,
+ * 		priority integer DEFAULT NULL,
+ * 		attachment bytea DEFAULT NULL,
+ * 		att_inline boolean DEFAULT true,
+ * 		att_mime_type varchar2 DEFAULT 'application/octet',
+ * 		att_filename varchar2 DEFAULT NULL,
+ * 		replyto varchar2 DEFAULT NULL)
+ * RETURNS bytea
+ *
+ */
+Datum
+orafce_mail_compose(PG_FUNCTION_ARGS)
+{
+	MailMessage msg;
+	char	   *result;
+	size_t		size;
+
+	memset(&msg, 0, sizeof(MailMessage));
+
+	msg.sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.compose", "sender");
+	msg.recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.compose", "recipients");
+	msg.cc = recipients_arg(fcinfo, 2);
+	msg.bcc = recipients_arg(fcinfo, 3);
+	msg.subject = null_or_empty_arg(fcinfo, 4);
+	msg.message = null_or_empty_arg(fcinfo, 5);
+	msg.mime_type = null_or_empty_arg(fcinfo, 6);
+
+	if (!PG_ARGISNULL(7))
+		msg.priority = PG_GETARG_INT32(7);
+	else
+		msg.priority_is_null = true;
+
+	/* the result is bytea, so it is limited by the size of varlena */
+	if (!PG_ARGISNULL(8))
+	{
+		bytea	   *vlena;
+
+		precheck_attachment_size(PG_GETARG_DATUM(8), MaxAllocSize - VARHDRSZ, false);
+
+		vlena = PG_GETARG_BYTEA_PP(8);
+		msg.attachment_data = VARDATA_ANY(vlena);
+		msg.attachment_size = (size_t) VARSIZE_ANY_EXHDR(vlena);
+	}
+
+	msg.att_inline = PG_ARGISNULL(9) ? true : PG_GETARG_BOOL(9);
+	msg.att_mime_type = null_or_empty_arg(fcinfo, 10);
+	msg.att_filename = null_or_empty_arg(fcinfo, 11);
+	msg.replyto = null_or_empty_arg(fcinfo, 12);
+
+	result = compose_message(&msg, VARHDRSZ, MaxAllocSize - VARHDRSZ, &size);
+
+	SET_VARSIZE(result, size + VARHDRSZ);
+
+	PG_RETURN_BYTEA_P(result);
+}
@@ -0,0 +1,397 @@
+/*
+ * Compression of attachments
+ *
+ * The attachment can be compressed to gzip or zip format. The compression
+ * is done while the message is sent: the compressed attachment is a source
+ * of attachment, that is read by composer's stream, so only one chunk of
+ * compressed data is held in memory, and the compressed data are not
+ * copied before they are encoded. The zip archive uses data descriptor
+ * after compressed data, because the crc and sizes are not known when the
+ * local header is written. The state of zlib is allocated in current memory
+ * context, so it is released on error.
+ */
+#include "postgres.h"
+
+#include <time.h>
+#include <zlib.h>
+
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "pgtime.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+/* size of input chunk passed to deflate */
+#define COMPRESS_CHUNK_SIZE		(1024 * 1024)
+
+/* deflate cannot compress data more than 1032 times */
+#define DEFLATE_MAX_RATIO		1032
+
+/* zip flags: sizes are in data descriptor, file name is in UTF8 */
+#define ZIP_FLAG_DATA_DESCRIPTOR	0x0008
+#define ZIP_FLAG_UTF8				0x0800
+
+typedef struct
+{
+	AttachmentSource source;	/* must be first */
+	AttachmentSource *input;	/* source of data, or NULL */
+	const char *data;			/* data, when input is NULL */
+	size_t		size;
+	size_t		offset;
+	char	   *inbuf;			/* chunk read from input */
+	bool		input_eof;
+	z_stream	zs;
+	gz_header	gzheader;
+	bool		zip;
+	bool		finished;		/* deflate stream is finished */
+	uint32		crc;
+	uint64		raw_size;
+	uint64		compressed_size;
+	StringInfoData extra;		/* zip header or trailer, not read yet */
+	int			extra_pos;
+	const char *filename;
+	uint16		flags;
+	uint16		dostime;
+	uint16		dosdate;
+} CompressSource;
+
+static voidpf
+zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+	(void) opaque;
+
+	return MemoryContextAllocHuge(CurrentMemoryContext, (Size) items * size);
+}
+
+static void
+zlib_free(voidpf opaque, voidpf address)
+{
+	(void) opaque;
+
+	pfree(address);
+}
+
+/* zip format uses little endian numbers */
+static void
+append_le16(StringInfo str, uint16 value)
+{
+	char		b[2];
+
+	b[0] = value & 0xff;
+	b[1] = (value >> 8) & 0xff;
+
+	appendBinaryStringInfo(str, b, 2);
+}
+
+static void
+append_le32(StringInfo str, uint32 value)
+{
+	append_le16(str, value & 0xffff);
+	append_le16(str, (value >> 16) & 0xffff);
+}
+
+static void
+check_zip_size(uint64 size)
+{
+	/* zip64 is not supported */
+	if (size > PG_UINT32_MAX)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("attachment is too large for zip format")));
+}
+
+/*
+ * Returns time in MS-DOS format used by zip
+ */
+static void
+dos_datetime(uint16 *dostime, uint16 *dosdate)
+{
+	pg_time_t	now = (pg_time_t) time(NULL);
+	struct pg_tm *tm = pg_gmtime(&now);
+
+	*dostime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+	*dosdate = ((tm->tm_year + 1900 - 1980) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+/*
+ * Local file header. The crc and sizes are in data descriptor.
+ */
+static void
+append_zip_header(CompressSource *cs)
+{
+	size_t		namelen = strlen(cs->filename);
+
+	append_le32(&cs->extra, 0x04034b50);	/* local file header signature */
+	append_le16(&cs->extra, 20);	/* version needed to extract */
+	append_le16(&cs->extra, cs->flags);
+	append_le16(&cs->extra, 8);		/* deflate */
+	append_le16(&cs->extra, cs->dostime);
+	append_le16(&cs->extra, cs->dosdate);
+	append_le32(&cs->extra, 0);		/* crc, in data descriptor */
+	append_le32(&cs->extra, 0);		/* compressed size, in data descriptor */
+	append_le32(&cs->extra, 0);		/* uncompressed size, in data descriptor */
+	append_le16(&cs->extra, (uint16) namelen);
+	append_le16(&cs->extra, 0);		/* extra field length */
+	appendBinaryStringInfo(&cs->extra, cs->filename, (int) namelen);
+}
+
+/*
+ * Data descriptor, central directory and end of central directory
+ */
+static void
+append_zip_trailer(CompressSource *cs)
+{
+	size_t		namelen = strlen(cs->filename);
+	uint32		header_size = 30 + (uint32) namelen;
+	uint32		central_start;
+	uint32		central_size;
+
+	check_zip_size(cs->raw_size);
+	check_zip_size(header_size + cs->compressed_size + 16);
+
+	resetStringInfo(&cs->extra);
+	cs->extra_pos = 0;
+
+	append_le32(&cs->extra, 0x08074b50);	/* data descriptor signature */
+	append_le32(&cs->extra, cs->crc);
+	append_le32(&cs->extra, (uint32) cs->compressed_size);
+	append_le32(&cs->extra, (uint32) cs->raw_size);
+
+	central_start = header_size + (uint32) cs->compressed_size + 16;
+
+	append_le32(&cs->extra, 0x02014b50);	/* central directory header signature */
+	append_le16(&cs->extra, 20);	/* version made by */
+	append_le16(&cs->extra, 20);	/* version needed to extract */
+	append_le16(&cs->extra, cs->flags);
+	append_le16(&cs->extra, 8);		/* deflate */
+	append_le16(&cs->extra, cs->dostime);
+	append_le16(&cs->extra, cs->dosdate);
+	append_le32(&cs->extra, cs->crc);
+	append_le32(&cs->extra, (uint32) cs->compressed_size);
+	append_le32(&cs->extra, (uint32) cs->raw_size);
+	append_le16(&cs->extra, (uint16) namelen);
+	append_le16(&cs->extra, 0);		/* extra field length */
+	append_le16(&cs->extra, 0);		/* file comment length */
+	append_le16(&cs->extra, 0);		/* disk number start */
+	append_le16(&cs->extra, 0);		/* internal file attributes */
+	append_le32(&cs->extra, 0);		/* external file attributes */
+	append_le32(&cs->extra, 0);		/* offset of local header */
+	appendBinaryStringInfo(&cs->extra, cs->filename, (int) namelen);
+
+	central_size = (uint32) cs->extra.len - 16;
+
+	append_le32(&cs->extra, 0x06054b50);	/* end of central directory signature */
+	append_le16(&cs->extra, 0);		/* number of this disk */
+	append_le16(&cs->extra, 0);		/* disk with central directory */
+	append_le16(&cs->extra, 1);		/* entries on this disk */
+	append_le16(&cs->extra, 1);		/* total entries */
+	append_le32(&cs->extra, central_size);
+	append_le32(&cs->extra, central_start);
+	append_le16(&cs->extra, 0);		/* comment length */
+}
+
+/*
+ * Passes next chunk of source data to deflate
+ */
+static void
+next_input(CompressSource *cs)
+{
+	const char *chunk;
+	size_t		n;
+
+	if (cs->input)
+	{
+		n = cs->input->read(cs->input, cs->inbuf, COMPRESS_CHUNK_SIZE);
+		chunk = cs->inbuf;
+	}
+	else
+	{
+		n = Min(cs->size - cs->offset, COMPRESS_CHUNK_SIZE);
+		chunk = cs->data + cs->offset;
+		cs->offset += n;
+	}
+
+	if (n == 0)
+	{
+		cs->input_eof = true;
+		return;
+	}
+
+	cs->zs.next_in = (Bytef *) chunk;
+	cs->zs.avail_in = (uInt) n;
+
+	if (cs->zip)
+	{
+		cs->crc = crc32(cs->crc, (const Bytef *) chunk, (uInt) n);
+		cs->raw_size += n;
+	}
+}
+
+/*
+ * Returns next part of compressed attachment. The deflate writes
+ * directly to the buffer of reader.
+ */
+static size_t
+read_compressed(AttachmentSource *source, char *buffer, size_t size)
+{
+	CompressSource *cs = (CompressSource *) source;
+	size_t		result = 0;
+
+	while (result < size)
+	{
+		size_t		n;
+		int			rc;
+
+		/* zip header and trailer */
+		if (cs->extra_pos < cs->extra.len)
+		{
+			n = Min((size_t) (cs->extra.len - cs->extra_pos), size - result);
+			memcpy(buffer + result, cs->extra.data + cs->extra_pos, n);
+			cs->extra_pos += n;
+			result += n;
+			continue;
+		}
+
+		if (cs->finished)
+			break;
+
+		if (cs->zs.avail_in == 0 && !cs->input_eof)
+			next_input(cs);
+
+		cs->zs.next_out = (Bytef *) (buffer + result);
+		cs->zs.avail_out = (uInt) Min(size - result, UINT_MAX);
+
+		rc = deflate(&cs->zs, cs->input_eof ? Z_FINISH : Z_NO_FLUSH);
+		if (rc == Z_STREAM_ERROR)
+			ereport(ERROR,
+					(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					 errmsg("cannot compress attachment"),
+					 errdetail("deflate() failed: %s", cs->zs.msg ? cs->zs.msg : "unknown error")));
+
+		n = (char *) cs->zs.next_out - (buffer + result);
+		result += n;
+		cs->compressed_size += n;
+
+		if (rc == Z_STREAM_END)
+		{
+			cs->finished = true;
+			deflateEnd(&cs->zs);
+
+			if (cs->zip)
+				append_zip_trailer(cs);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return result;
+}
+
+/*
+ * The compressed attachment is not smaller than this size. It allows
+ * to check the size of message before the attachment is compressed.
+ */
+size_t
+compressed_size_lower_bound(size_t size)
+{
+	return size / DEFLATE_MAX_RATIO;
+}
+
+/*
+ * Replaces the attachment of message by compressed attachment, that is
+ * compressed while the message is sent. The method can be "gzip" or "zip".
+ * The file name and MIME type are changed to match the format.
+ */
+void
+compress_attachment(MailMessage *msg, const char *method)
+{
+	CompressSource *cs;
+	const char *filename;
+	bool		gzip;
+	int			rc;
+
+	if (pg_strcasecmp(method, "gzip") == 0)
+		gzip = true;
+	else if (pg_strcasecmp(method, "zip") == 0)
+		gzip = false;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unsupported compression method \"%s\"", method),
+				 errhint("Use \"gzip\" or \"zip\".")));
+
+	if (!msg->attachment_data && !msg->att_source)
+		return;
+
+	filename = msg->att_filename ? msg->att_filename : "attachment";
+
+	cs = palloc0(sizeof(CompressSource));
+	cs->source.read = read_compressed;
+	cs->zip = !gzip;
+	cs->filename = filename;
+
+	if (msg->att_source)
+	{
+		cs->input = msg->att_source;
+		cs->inbuf = palloc(COMPRESS_CHUNK_SIZE);
+	}
+	else
+	{
+		if (cs->zip)
+			check_zip_size(msg->attachment_size);
+
+		cs->data = msg->attachment_data;
+		cs->size = msg->attachment_size;
+	}
+
+	cs->zs.zalloc = zlib_alloc;
+	cs->zs.zfree = zlib_free;
+
+	rc = deflateInit2(&cs->zs,
+					  Z_DEFAULT_COMPRESSION,
+					  Z_DEFLATED,
+					  gzip ? 15 + 16 : -15,
+					  8,
+					  Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot initialize compression"),
+				 errdetail("deflateInit2() failed: %s", cs->zs.msg ? cs->zs.msg : "unknown error")));
+
+	if (gzip && msg->att_filename)
+	{
+		/* the original file name is stored in gzip header */
+		cs->gzheader.name = (Bytef *) msg->att_filename;
+		cs->gzheader.time = (uLong) time(NULL);
+		cs->gzheader.os = 3;	/* unix */
+
+		deflateSetHeader(&cs->zs, &cs->gzheader);
+	}
+
+	initStringInfo(&cs->extra);
+
+	if (cs->zip)
+	{
+		cs->crc = crc32(0L, Z_NULL, 0);
+
+		/* file name is in UTF8 */
+		cs->flags = ZIP_FLAG_DATA_DESCRIPTOR |
+			(GetDatabaseEncoding() == PG_UTF8 ? ZIP_FLAG_UTF8 : 0);
+
+		dos_datetime(&cs->dostime, &cs->dosdate);
+
+		append_zip_header(cs);
+	}
+
+	msg->attachment_data = NULL;
+	msg->attachment_size = 0;
+	msg->att_source = &cs->source;
+	msg->att_filename = psprintf("%s.%s", filename, gzip ? "gz" : "zip");
+	msg->att_mime_type = gzip ? "application/gzip" : "application/zip";
+
+	/* the compressed data are binary */
+	msg->att_is_text = false;
+}
@@ -0,0 +1,572 @@
+/*
+ * DKIM signing (RFC 6376, RFC 8463)
+ *
+ * The message is signed with relaxed/relaxed canonicalization by
+ * rsa-sha256 or ed25519-sha256 (by type of key). The body hash is
+ * calculated by composer in the writing pass, so the body is not read
+ * again. The size of DKIM-Signature header depends only on the key and
+ * settings, so the space for the header is reserved before the message,
+ * and the header is written there when the message is complete.
+ *
+ * The private key is loaded once, and it is cached in the backend. It is
+ * loaded again, when the path or the modification time of file is changed.
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "lib/stringinfo.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+/* signed headers, the missing headers cannot be added later */
+#define DKIM_SIGNED_HEADERS \
+	"from:to:cc:reply-to:subject:date:mime-version:content-type:content-transfer-encoding:x-priority"
+
+/* sha256 digest encoded by base64 */
+#define DKIM_BODY_HASH_LEN		44
+
+#define DKIM_OUTPUT_BUFFER_SIZE	8192
+
+char	   *orafce_dkim_domain = NULL;
+char	   *orafce_dkim_selector = NULL;
+char	   *orafce_dkim_private_key = NULL;
+
+struct DkimSigner
+{
+	EVP_PKEY   *key;
+	const char *algorithm;
+	long		timestamp;
+	size_t		sig_len;		/* length of base64 encoded signature */
+	size_t		header_size;
+
+	/* state of relaxed body canonicalization */
+	EVP_MD_CTX *body_ctx;
+	bool		cr_pending;		/* CR, that can be part of CRLF */
+	bool		wsp_pending;	/* WSP, that is written before next char */
+	bool		line_nonempty;
+	size_t		empty_lines;	/* are written before next nonempty line */
+	size_t		outlen;
+	char		out[DKIM_OUTPUT_BUFFER_SIZE];
+};
+
+static EVP_PKEY *dkim_key = NULL;
+static char *dkim_key_path = NULL;
+static time_t dkim_key_mtime = 0;
+
+static const char *
+openssl_errmessage(void)
+{
+	unsigned long err = ERR_get_error();
+	const char *errreason;
+
+	if (err == 0)
+		return "no OpenSSL error reported";
+
+	errreason = ERR_reason_error_string(err);
+
+	return errreason ? errreason : "unknown OpenSSL error";
+}
+
+/*
+ * Returns the cached private key. The key is read from file, when it
+ * is not loaded yet, or when the file was changed.
+ */
+static EVP_PKEY *
+get_private_key(const char *path)
+{
+	struct stat st;
+	BIO		   *bio;
+	EVP_PKEY   *key;
+	int			keytype;
+
+	if (stat(path, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat DKIM private key file \"%s\": %m", path)));
+
+	if (dkim_key && strcmp(dkim_key_path, path) == 0 &&
+		dkim_key_mtime == st.st_mtime)
+		return dkim_key;
+
+	ERR_clear_error();
+
+	bio = BIO_new_file(path, "r");
+	if (!bio)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open DKIM private key file \"%s\"", path),
+				 errdetail("%s", openssl_errmessage())));
+
+	key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+
+	if (!key)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIG_FILE_ERROR),
+				 errmsg("could not load DKIM private key from file \"%s\"", path),
+				 errdetail("%s", openssl_errmessage())));
+
+	keytype = EVP_PKEY_base_id(key);
+
+#ifdef EVP_PKEY_ED25519
+	if (keytype != EVP_PKEY_RSA && keytype != EVP_PKEY_ED25519)
+#else
+	if (keytype != EVP_PKEY_RSA)
+#endif
+	{
+		EVP_PKEY_free(key);
+
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIG_FILE_ERROR),
+				 errmsg("unsupported type of DKIM private key in file \"%s\"", path),
+				 errhint("Use RSA or Ed25519 key.")));
+	}
+
+	if (dkim_key)
+		EVP_PKEY_free(dkim_key);
+
+	if (dkim_key_path)
+		pfree(dkim_key_path);
+
+	dkim_key = key;
+	dkim_key_path = MemoryContextStrdup(TopMemoryContext, path);
+	dkim_key_mtime = st.st_mtime;
+
+	return dkim_key;
+}
+
+/*
+ * Returns DKIM-Signature header. The values bh and b can be dummy values
+ * of same size (for calculation of size of header).
+ */
+static char *
+format_header(DkimSigner *signer, const char *bh, const char *b)
+{
+	return psprintf("DKIM-Signature: v=1; a=%s; c=relaxed/relaxed; d=%s; s=%s;\r\n"
+					"\tt=%ld; h=%s;\r\n"
+					"\tbh=%s;\r\n"
+					"\tb=%s\r\n",
+					signer->algorithm,
+					orafce_dkim_domain,
+					orafce_dkim_selector,
+					signer->timestamp,
+					DKIM_SIGNED_HEADERS,
+					bh,
+					b);
+}
+
+static char *
+dummy_value(size_t len)
+{
+	char	   *result = palloc(len + 1);
+
+	memset(result, 'x', len);
+	result[len] = '\0';
+
+	return result;
+}
+
+static void
+free_body_ctx(void *arg)
+{
+	DkimSigner *signer = (DkimSigner *) arg;
+
+	if (signer->body_ctx)
+	{
+		EVP_MD_CTX_free(signer->body_ctx);
+		signer->body_ctx = NULL;
+	}
+}
+
+bool
+dkim_configured(void)
+{
+	return orafce_dkim_domain && orafce_dkim_selector && orafce_dkim_private_key;
+}
+
+/*
+ * Returns signer, when DKIM signing is configured, else returns NULL.
+ */
+DkimSigner *
+dkim_begin(void)
+{
+	DkimSigner *signer;
+	MemoryContextCallback *cb;
+
+	if (!dkim_configured())
+		return NULL;
+
+	signer = palloc0(sizeof(DkimSigner));
+
+	signer->key = get_private_key(orafce_dkim_private_key);
+
+#ifdef EVP_PKEY_ED25519
+	signer->algorithm = EVP_PKEY_base_id(signer->key) == EVP_PKEY_ED25519 ?
+		"ed25519-sha256" : "rsa-sha256";
+#else
+	signer->algorithm = "rsa-sha256";
+#endif
+
+	signer->timestamp = (long) time(NULL);
+	signer->sig_len = (EVP_PKEY_size(signer->key) + 2) / 3 * 4;
+	signer->header_size = strlen(format_header(signer,
+											   dummy_value(DKIM_BODY_HASH_LEN),
+											   dummy_value(signer->sig_len)));
+
+	/* the context of OpenSSL is released with the signer */
+	cb = palloc(sizeof(MemoryContextCallback));
+	cb->func = free_body_ctx;
+	cb->arg = signer;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, cb);
+
+	signer->body_ctx = EVP_MD_CTX_new();
+	if (!signer->body_ctx ||
+		!EVP_DigestInit_ex(signer->body_ctx, EVP_sha256(), NULL))
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot initialize DKIM body hash"),
+				 errdetail("%s", openssl_errmessage())));
+
+	return signer;
+}
+
+size_t
+dkim_header_size(DkimSigner *signer)
+{
+	return signer->header_size;
+}
+
+static void
+flush_output(DkimSigner *signer)
+{
+	if (signer->outlen > 0)
+	{
+		EVP_DigestUpdate(signer->body_ctx, signer->out, signer->outlen);
+		signer->outlen = 0;
+	}
+}
+
+static void
+emit(DkimSigner *signer, const char *data, size_t len)
+{
+	if (signer->outlen + len > DKIM_OUTPUT_BUFFER_SIZE)
+	{
+		flush_output(signer);
+
+		if (len > DKIM_OUTPUT_BUFFER_SIZE)
+		{
+			EVP_DigestUpdate(signer->body_ctx, data, len);
+			return;
+		}
+	}
+
+	memcpy(signer->out + signer->outlen, data, len);
+	signer->outlen += len;
+}
+
+/*
+ * Emits nonempty content of line. The pending empty lines and the
+ * pending whitespace (reduced to one space) are emitted before.
+ */
+static void
+emit_content(DkimSigner *signer, const char *data, size_t len)
+{
+	if (!signer->line_nonempty)
+	{
+		while (signer->empty_lines > 0)
+		{
+			emit(signer, "\r\n", 2);
+			signer->empty_lines--;
+		}
+
+		signer->line_nonempty = true;
+	}
+
+	if (signer->wsp_pending)
+	{
+		emit(signer, " ", 1);
+		signer->wsp_pending = false;
+	}
+
+	emit(signer, data, len);
+}
+
+/*
+ * Relaxed body canonicalization. The whitespaces are reduced to one space,
+ * the whitespaces at end of lines are removed, and the empty lines at
+ * end of body are ignored.
+ */
+void
+dkim_body_update(DkimSigner *signer, const char *data, size_t len)
+{
+	const char *ptr = data;
+	const char *end = data + len;
+
+	while (ptr < end)
+	{
+		const char *start = ptr;
+
+		if (signer->cr_pending)
+		{
+			signer->cr_pending = false;
+
+			if (*ptr == '\n')
+			{
+				/* end of line, the trailing whitespaces are removed */
+				signer->wsp_pending = false;
+
+				if (signer->line_nonempty)
+					emit(signer, "\r\n", 2);
+				else
+					signer->empty_lines++;
+
+				signer->line_nonempty = false;
+				ptr++;
+				continue;
+			}
+
+			/* alone CR is not line end */
+			emit_content(signer, "\r", 1);
+		}
+
+		while (ptr < end && *ptr != ' ' && *ptr != '\t' && *ptr != '\r')
+			ptr++;
+
+		if (ptr > start)
+			emit_content(signer, start, ptr - start);
+
+		if (ptr < end)
+		{
+			if (*ptr == '\r')
+				signer->cr_pending = true;
+			else
+				signer->wsp_pending = true;
+
+			ptr++;
+		}
+	}
+}
+
+/*
+ * Relaxed header canonicalization. The name is lowercased, the value
+ * is unfolded, the whitespaces are reduced to one space, and the
+ * whitespaces around the value are removed.
+ */
+static void
+append_header_relaxed(StringInfo str, const char *field, size_t len, bool crlf)
+{
+	const char *ptr = field;
+	const char *end = field + len;
+	bool		wsp_pending = false;
+
+	while (ptr < end && *ptr != ':')
+	{
+		if (*ptr != ' ' && *ptr != '\t')
+			appendStringInfoChar(str, pg_ascii_tolower((unsigned char) *ptr));
+
+		ptr++;
+	}
+
+	appendStringInfoChar(str, ':');
+
+	/* skip colon and leading whitespaces */
+	if (ptr < end)
+		ptr++;
+
+	while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n'))
+		ptr++;
+
+	for (; ptr < end; ptr++)
+	{
+		if (*ptr == '\r' || *ptr == '\n')
+			continue;
+
+		if (*ptr == ' ' || *ptr == '\t')
+		{
+			wsp_pending = true;
+			continue;
+		}
+
+		if (wsp_pending)
+		{
+			appendStringInfoChar(str, ' ');
+			wsp_pending = false;
+		}
+
+		appendStringInfoChar(str, *ptr);
+	}
+
+	if (crlf)
+		appendStringInfoString(str, "\r\n");
+}
+
+/*
+ * Appends canonicalized header of message with given name. The headers
+ * can be folded (continuation lines starts by whitespace).
+ */
+static void
+append_signed_header(StringInfo str,
+					 const char *headers,
+					 size_t headers_size,
+					 const char *name,
+					 size_t namelen)
+{
+	const char *ptr = headers;
+	const char *end = headers + headers_size;
+	const char *found = NULL;
+	size_t		found_len = 0;
+
+	while (ptr < end)
+	{
+		const char *line = ptr;
+
+		/* find end of field (including continuation lines) */
+		while (ptr < end)
+		{
+			ptr = memchr(ptr, '\n', end - ptr);
+			ptr = ptr ? ptr + 1 : end;
+
+			if (ptr == end || (*ptr != ' ' && *ptr != '\t'))
+				break;
+		}
+
+		/* the last instance of header is signed */
+		if ((size_t) (ptr - line) > namelen &&
+			line[namelen] == ':' &&
+			pg_strncasecmp(line, name, namelen) == 0)
+		{
+			found = line;
+			found_len = ptr - line;
+		}
+	}
+
+	if (found)
+		append_header_relaxed(str, found, found_len, true);
+}
+
+static char *
+base64_encode(const unsigned char *data, size_t len)
+{
+	char	   *result = palloc((len + 2) / 3 * 4 + 1);
+
+	EVP_EncodeBlock((unsigned char *) result, data, (int) len);
+
+	return result;
+}
+
+/*
+ * Calculates the signature of message, and writes DKIM-Signature
+ * header to reserved space of size dkim_header_size() before message.
+ */
+void
+dkim_sign(DkimSigner *signer, char *header, const char *message, size_t size)
+{
+	unsigned char body_hash[EVP_MAX_MD_SIZE];
+	unsigned int body_hash_len;
+	unsigned char *sig;
+	size_t		siglen;
+	const char *headers_end;
+	size_t		headers_size;
+	StringInfoData str;
+	const char *name;
+	char	   *bh;
+	char	   *result;
+	EVP_MD_CTX *ctx;
+	bool		ok;
+
+	/* the body without CRLF at end is finished by CRLF */
+	if (signer->cr_pending)
+	{
+		signer->cr_pending = false;
+		emit_content(signer, "\r", 1);
+	}
+
+	if (signer->line_nonempty)
+		emit(signer, "\r\n", 2);
+
+	flush_output(signer);
+
+	if (!EVP_DigestFinal_ex(signer->body_ctx, body_hash, &body_hash_len))
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot calculate DKIM body hash"),
+				 errdetail("%s", openssl_errmessage())));
+
+	bh = base64_encode(body_hash, body_hash_len);
+
+	/* the headers are separated from body by empty line */
+	headers_end = strstr(message, "\r\n\r\n");
+	headers_size = headers_end ? (size_t) (headers_end - message) + 2 : size;
+
+	initStringInfo(&str);
+
+	name = DKIM_SIGNED_HEADERS;
+	while (*name)
+	{
+		size_t		namelen = strcspn(name, ":");
+
+		append_signed_header(&str, message, headers_size, name, namelen);
+
+		name += namelen;
+		if (*name == ':')
+			name++;
+	}
+
+	/* the signature header with empty b= is signed without CRLF */
+	result = format_header(signer, bh, "");
+	append_header_relaxed(&str, result, strlen(result), false);
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	siglen = EVP_PKEY_size(signer->key);
+	sig = palloc(siglen);
+
+#ifdef EVP_PKEY_ED25519
+	if (EVP_PKEY_base_id(signer->key) == EVP_PKEY_ED25519)
+	{
+		unsigned char header_hash[EVP_MAX_MD_SIZE];
+		unsigned int header_hash_len;
+
+		/* ed25519-sha256 signs sha256 digest of headers by PureEdDSA */
+		ok = EVP_Digest(str.data, str.len, header_hash, &header_hash_len, EVP_sha256(), NULL) &&
+			EVP_DigestSignInit(ctx, NULL, NULL, NULL, signer->key) &&
+			EVP_DigestSign(ctx, sig, &siglen, header_hash, header_hash_len);
+	}
+	else
+#endif
+	{
+		ok = EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, signer->key) &&
+			EVP_DigestSignUpdate(ctx, str.data, str.len) &&
+			EVP_DigestSignFinal(ctx, sig, &siglen);
+	}
+
+	EVP_MD_CTX_free(ctx);
+
+	if (!ok)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot create DKIM signature"),
+				 errdetail("%s", openssl_errmessage())));
+
+	result = format_header(signer, bh, base64_encode(sig, siglen));
+
+	/* RSA signature has always the size of modulus */
+	if (strlen(result) != signer->header_size)
+		elog(ERROR, "unexpected size of DKIM-Signature header");
+
+	memcpy(header, result, signer->header_size);
+
+	pfree(str.data);
+	pfree(sig);
+}
@@ -0,0 +1,235 @@
+/*
+ * Attachments read from server files
+ *
+ * The file is read by chunks while the message is sent, and the chunks
+ * are encoded directly to the sent data, so only one chunk of file is
+ * held in memory. The content of file is not copied to bytea value, and
+ * it is not detoasted. Only the data, that were in the file when it was
+ * opened, are sent, and an error is raised when the file is truncated
+ * while it is read.
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog/pg_authid.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_send_attach_file);
+
+typedef struct
+{
+	AttachmentSource source;	/* must be first */
+	const char *path;
+	int			fd;
+	size_t		size;			/* size of file when it was opened */
+	size_t		offset;
+} FileAttachment;
+
+static size_t
+read_file_attachment(AttachmentSource *source, char *buffer, size_t size)
+{
+	FileAttachment *fa = (FileAttachment *) source;
+	ssize_t		n;
+
+	size = Min(size, fa->size - fa->offset);
+	if (size == 0)
+		return 0;
+
+	CHECK_FOR_INTERRUPTS();
+
+	n = pread(fa->fd, buffer, size, (off_t) fa->offset);
+	if (n < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", fa->path)));
+
+	if (n == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("file \"%s\" was truncated while it was read", fa->path),
+				 errdetail("Only %zu of %zu bytes could be read.",
+						   fa->offset, fa->size)));
+
+	fa->offset += n;
+
+	return (size_t) n;
+}
+
+/*
+ * Opens the file, and returns the source of attachment, that reads it.
+ * The size of attachment is checked before sending.
+ */
+static FileAttachment *
+open_file_attachment(const char *path, bool compressed)
+{
+	FileAttachment *fa;
+	struct stat st;
+	int			fd;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	if (!S_ISREG(st.st_mode))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a regular file", path)));
+
+	/* the size of compressed attachment is not known yet */
+	check_message_size(base64_encoded_size(compressed ?
+										   compressed_size_lower_bound((size_t) st.st_size) :
+										   (size_t) st.st_size),
+					   message_size_limit());
+
+#ifdef USE_POSIX_FADVISE
+	/* the data are read only once from start to end */
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	fa = palloc0(sizeof(FileAttachment));
+
+	fa->source.read = read_file_attachment;
+	fa->path = path;
+	fa->fd = fd;
+	fa->size = (size_t) st.st_size;
+
+	return fa;
+}
+
+/*
+ * PROCEDURE utl_mail.send_attach_file(
+ * 		sender varchar2,
+ * 		recipients varchar2,
+ * 		cc varchar2 DEFAULT NULL,
+ * 		bcc varchar2 DEFAULT NULL,
+ * 		subject varchar2 DEFAULT NULL,
+ * 		message varchar2 DEFAULT NULL,
+ * 		mime_type varchar2 DEFAULT NULL,
+ * 		priority integer DEFAULT NULL,
+ * 		path text DEFAULT NULL,
+ * 		att_inline boolean DEFAULT true,
+ * 		att_mime_type varchar2 DEFAULT 'application/octet',
+ * 		att_filename varchar2 DEFAULT NULL,
+ * 		replyto varchar2 DEFAULT NULL,
+ * 		idempotency_key varchar2 DEFAULT NULL,
+ * 		att_compress varchar2 DEFAULT NULL)
+ *
+ * The attachment is read from file on server. Only members of the role
+ * pg_read_server_files can use it. The default file name of attachment
+ * is the name of the file without directory.
+ */
+static Datum
+mail_send_attach_file(PG_FUNCTION_ARGS)
+{
+	char	   *sender;
+	char	   *recipients;
+	char	   *cc;
+	char	   *bcc;
+	char	   *subject;
+	char	   *message;
+	char	   *mime_type;
+	int			priority = 0;
+	bool		priority_is_null = false;
+	char	   *path;
+	bool		att_inline;
+	char	   *att_mime_type;
+	char	   *att_filename;
+	char	   *replyto;
+	char	   *idempotency_key;
+	char	   *att_compress;
+	MailMessage msg;
+	FileAttachment *volatile fa;
+
+	sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_attach_file", "sender");
+	recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.send_attach_file", "recipients");
+	cc = recipients_arg(fcinfo, 2);
+	bcc = recipients_arg(fcinfo, 3);
+	subject = null_or_empty_arg(fcinfo, 4);
+	message = null_or_empty_arg(fcinfo, 5);
+	mime_type = null_or_empty_arg(fcinfo, 6);
+
+	if (!PG_ARGISNULL(7))
+		priority = PG_GETARG_INT32(7);
+	else
+		priority_is_null = true;
+
+	path = not_null_not_empty_arg(fcinfo, 8, "utl_mail.send_attach_file", "path");
+
+	att_inline = PG_ARGISNULL(9) ? true : PG_GETARG_BOOL(9);
+	att_mime_type = null_or_empty_arg(fcinfo, 10);
+	att_filename = null_or_empty_arg(fcinfo, 11);
+	replyto = null_or_empty_arg(fcinfo, 12);
+	idempotency_key = null_or_empty_arg(fcinfo, 13);
+	att_compress = null_or_empty_arg(fcinfo, 14);
+
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to attach server file"),
+				 errdetail("Only roles with privileges of the \"%s\" role may attach server files.",
+						   "pg_read_server_files")));
+
+	if (!att_filename)
+	{
+		char	   *sep = last_dir_separator(path);
+
+		att_filename = sep ? sep + 1 : path;
+	}
+
+	fa = open_file_attachment(path, att_compress != NULL);
+
+	memset(&msg, 0, sizeof(MailMessage));
+
+	msg.sender = sender;
+	msg.recipients = recipients;
+	msg.cc = cc;
+	msg.bcc = bcc;
+	msg.subject = subject;
+	msg.replyto = replyto;
+	msg.priority = priority;
+	msg.priority_is_null = priority_is_null;
+	msg.message = message;
+	msg.mime_type = mime_type;
+	msg.att_mime_type = att_mime_type;
+	msg.att_filename = att_filename;
+	msg.att_is_text = false;
+	msg.att_inline = att_inline;
+	msg.att_source = &fa->source;
+
+	PG_TRY();
+	{
+		send_mail_message(&msg, att_compress, idempotency_key);
+	}
+	PG_CATCH();
+	{
+		CloseTransientFile(fa->fd);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	CloseTransientFile(fa->fd);
+
+	return (Datum) 0;
+}
+
+Datum
+orafce_mail_send_attach_file(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send_attach_file, fcinfo);
+}
@@ -0,0 +1,666 @@
+/*
+ * HTTP transport
+ *
+ * When orafce_mail.smtp_server_url is http:// or https:// url, then the
+ * composed message is sent by POST request. The payload is the raw message
+ * (RFC 5322), or JSON object with envelope and base64 encoded message
+ * (orafce_mail.http_payload_format).
+ *
+ * Every mail is sent by one request. The transfer is executed by curl's
+ * multi handle, so the interrupts can be checked while it waits for socket,
+ * and the multi handle holds the cache of connections, so the connection
+ * is reused by next mails sent by the session. The mail sent by procedure
+ * waits for its response. The mails of batch (utl_mail.send_merge) are
+ * sent by concurrent requests, that are multiplexed over one connection,
+ * when HTTP/2 is negotiated by TLS (ALPN). Without HTTP/2 (plain http://)
+ * the requests are sent by parallel HTTP/1.1 connections.
+ */
+#include "postgres.h"
+
+#include <curl/curl.h>
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+/* the size of part of streamed message read at once */
+#define HTTP_STREAM_BUFFER_SIZE		(256 * 1024)
+
+/* only start of response is reported on error */
+#define HTTP_MAX_RESPONSE_SIZE		1024
+
+/* limit of parallel connections, when the requests cannot be multiplexed */
+#define HTTP_MAX_HOST_CONNECTIONS	8
+
+typedef struct
+{
+	const char *data;			/* composed message */
+	size_t		size;
+	size_t		position;
+	MessageStream *stream;		/* not NULL for streamed message */
+	bool		base64;
+	StringInfoData head;		/* JSON before message */
+	const char *tail;			/* JSON after message */
+	size_t		head_pos;
+	size_t		tail_pos;
+	char	   *buffer;			/* part of streamed message */
+	size_t		buffer_len;
+	size_t		buffer_pos;
+	bool		eof;
+	unsigned char rest[3];		/* bytes, that are not encoded yet */
+	int			rest_len;
+	char		encoded[4];		/* encoded group, that is not sent yet */
+	int			encoded_len;
+	int			encoded_pos;
+	MemoryContext mcxt;
+	ErrorData  *edata;			/* error raised inside read callback */
+} HttpReader;
+
+typedef struct
+{
+	CURL	   *curl;
+	HttpReader	reader;
+	StringInfoData response;
+	struct curl_slist *headers;
+	CURLcode	result;
+} HttpRequest;
+
+int			orafce_http_payload_format = HTTP_PAYLOAD_RAW;
+
+static CURLM *http_multi = NULL;
+static CURL *http_handle = NULL;
+
+static const char *base64_chars =
+"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Encodes group of 1-3 bytes to 4 chars (base64 without line breaks)
+ */
+static void
+encode_group(const unsigned char *b, int n, char *dest)
+{
+	uint32		v = b[0] << 16;
+
+	if (n > 1)
+		v |= b[1] << 8;
+	if (n > 2)
+		v |= b[2];
+
+	dest[0] = base64_chars[(v >> 18) & 0x3f];
+	dest[1] = base64_chars[(v >> 12) & 0x3f];
+	dest[2] = n > 1 ? base64_chars[(v >> 6) & 0x3f] : '=';
+	dest[3] = n > 2 ? base64_chars[v & 0x3f] : '=';
+}
+
+static void
+encode_rest(HttpReader *reader)
+{
+	encode_group(reader->rest, reader->rest_len, reader->encoded);
+
+	reader->encoded_len = 4;
+	reader->encoded_pos = 0;
+	reader->rest_len = 0;
+}
+
+/*
+ * Returns next part of message (not encoded). Returns false at end
+ * of message.
+ */
+static bool
+next_message_part(HttpReader *reader, const char **data, size_t *len)
+{
+	if (reader->stream)
+	{
+		if (reader->buffer_pos == reader->buffer_len && !reader->eof)
+		{
+			reader->buffer_len = read_message_stream(reader->stream,
+													 reader->buffer,
+													 HTTP_STREAM_BUFFER_SIZE);
+			reader->buffer_pos = 0;
+			reader->eof = reader->buffer_len == 0;
+		}
+
+		*data = reader->buffer + reader->buffer_pos;
+		*len = reader->buffer_len - reader->buffer_pos;
+	}
+	else
+	{
+		*data = reader->data + reader->position;
+		*len = reader->size - reader->position;
+	}
+
+	return *len > 0;
+}
+
+static void
+message_part_used(HttpReader *reader, size_t len)
+{
+	if (reader->stream)
+		reader->buffer_pos += len;
+	else
+		reader->position += len;
+}
+
+/*
+ * Fills the buffer by next part of payload. Returns the number of bytes
+ * (0 at end of payload).
+ */
+static size_t
+read_payload(HttpReader *reader, char *buffer, size_t size)
+{
+	size_t		result = 0;
+
+	while (result < size)
+	{
+		const char *data;
+		size_t		len;
+
+		if (reader->head_pos < (size_t) reader->head.len)
+		{
+			len = Min(reader->head.len - reader->head_pos, size - result);
+			memcpy(buffer + result, reader->head.data + reader->head_pos, len);
+			reader->head_pos += len;
+		}
+		else if (reader->encoded_pos < reader->encoded_len)
+		{
+			len = Min((size_t) (reader->encoded_len - reader->encoded_pos), size - result);
+			memcpy(buffer + result, reader->encoded + reader->encoded_pos, len);
+			reader->encoded_pos += len;
+		}
+		else if (next_message_part(reader, &data, &len))
+		{
+			if (reader->base64)
+			{
+				size_t		groups = Min(len / 3, (size - result) / 4);
+				size_t		i;
+
+				/* whole groups are encoded directly to the buffer */
+				if (reader->rest_len == 0 && groups > 0)
+				{
+					for (i = 0; i < groups; i++)
+						encode_group((const unsigned char *) data + i * 3, 3,
+									 buffer + result + i * 4);
+
+					message_part_used(reader, groups * 3);
+					result += groups * 4;
+				}
+				else
+				{
+					/* the group is split between parts, or buffer is almost full */
+					size_t		n = Min(len, (size_t) (3 - reader->rest_len));
+
+					memcpy(reader->rest + reader->rest_len, data, n);
+					reader->rest_len += n;
+					message_part_used(reader, n);
+
+					if (reader->rest_len == 3)
+						encode_rest(reader);
+				}
+
+				continue;
+			}
+
+			len = Min(len, size - result);
+			memcpy(buffer + result, data, len);
+			message_part_used(reader, len);
+		}
+		else if (reader->rest_len > 0)
+		{
+			encode_rest(reader);
+			continue;
+		}
+		else if (reader->tail && reader->tail[reader->tail_pos])
+		{
+			len = Min(strlen(reader->tail + reader->tail_pos), size - result);
+			memcpy(buffer + result, reader->tail + reader->tail_pos, len);
+			reader->tail_pos += len;
+		}
+		else
+			break;
+
+		result += len;
+	}
+
+	return result;
+}
+
+static size_t
+read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	HttpReader *reader = (HttpReader *) userdata;
+	volatile size_t result = 0;
+
+	/*
+	 * An error cannot be thrown through libcurl. It is saved, and it
+	 * is raised again after transfer.
+	 */
+	PG_TRY();
+	{
+		result = read_payload(reader, ptr, size * nmemb);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(reader->mcxt);
+		reader->edata = CopyErrorData();
+		FlushErrorState();
+
+		result = CURL_READFUNC_ABORT;
+	}
+	PG_END_TRY();
+
+	return result;
+}
+
+static size_t
+write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	StringInfo	response = (StringInfo) userdata;
+	size_t		len = size * nmemb;
+
+	if ((size_t) response->len < HTTP_MAX_RESPONSE_SIZE)
+		appendBinaryStringInfo(response, ptr,
+							   Min(len, (size_t) (HTTP_MAX_RESPONSE_SIZE - response->len)));
+
+	return len;
+}
+
+/*
+ * Prepares JSON object with envelope. The message is inserted
+ * (base64 encoded) between head and tail.
+ */
+static void
+init_json_payload(HttpReader *reader, const char *sender, List *envelope)
+{
+	ListCell   *lc;
+	bool		first = true;
+
+	appendStringInfoString(&reader->head, "{\"from\":");
+	escape_json(&reader->head, sender);
+	appendStringInfoString(&reader->head, ",\"to\":[");
+
+	foreach(lc, envelope)
+	{
+		if (!first)
+			appendStringInfoChar(&reader->head, ',');
+
+		escape_json(&reader->head, (char *) lfirst(lc));
+		first = false;
+	}
+
+	appendStringInfoString(&reader->head, "],\"raw\":\"");
+
+	reader->tail = "\"}";
+	reader->base64 = true;
+}
+
+static void
+check_multi(CURLMcode res)
+{
+	if (res != CURLM_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot send mail"),
+				 errdetail("curl_multi failed: %s", curl_multi_strerror(res))));
+}
+
+static void
+check_setopt(CURLcode res)
+{
+	if (res != CURLE_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("curl_easy_setopt fails"),
+				 errdetail("%s", curl_easy_strerror(res))));
+}
+
+/*
+ * Returns multi handle. The multi handle holds the cache of connections,
+ * so the connections are reused by next mails of session. The requests
+ * of batch are multiplexed over one HTTP/2 connection, when the server
+ * supports it, else they are sent by more connections in parallel.
+ */
+static CURLM *
+get_multi(void)
+{
+	if (!http_multi)
+	{
+		http_multi = curl_multi_init();
+		if (!http_multi)
+			elog(ERROR, "cannot to start libcurl");
+
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+
+		check_multi(curl_multi_setopt(http_multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX));
+
+#endif
+
+		check_multi(curl_multi_setopt(http_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+									  (long) HTTP_MAX_HOST_CONNECTIONS));
+	}
+
+	return http_multi;
+}
+
+/*
+ * Prepares the payload of request
+ */
+static HttpRequest *
+init_request(const char *sender,
+			 List *envelope,
+			 const char *data,
+			 size_t size,
+			 MessageStream *stream)
+{
+	HttpRequest *req = palloc0(sizeof(HttpRequest));
+
+	req->reader.data = data;
+	req->reader.size = size;
+	req->reader.stream = stream;
+	req->reader.mcxt = CurrentMemoryContext;
+
+	initStringInfo(&req->reader.head);
+	initStringInfo(&req->response);
+
+	if (stream)
+		req->reader.buffer = palloc(HTTP_STREAM_BUFFER_SIZE);
+
+	if (orafce_http_payload_format == HTTP_PAYLOAD_JSON)
+		init_json_payload(&req->reader, sender, envelope);
+
+	return req;
+}
+
+/*
+ * Sets the options of easy handle of request
+ */
+static void
+setup_request(HttpRequest *req)
+{
+	CURL	   *curl = req->curl;
+	bool		json = orafce_http_payload_format == HTTP_PAYLOAD_JSON;
+
+	check_setopt(curl_easy_setopt(curl, CURLOPT_URL, orafce_smtp_url));
+
+	if (orafce_smtp_userpwd)
+		check_setopt(curl_easy_setopt(curl, CURLOPT_USERPWD, orafce_smtp_userpwd));
+
+	if (orafce_smtp_unix_socket)
+	{
+#if LIBCURL_VERSION_NUM >= 0x072800 /* 7.40.0 */
+
+		check_setopt(curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, orafce_smtp_unix_socket));
+
+#else
+
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unix domain sockets are not supported by this version of libcurl")));
+
+#endif
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+
+	/* HTTP/2 is negotiated by TLS, plain http:// uses HTTP/1.1 */
+	check_setopt(curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS));
+
+#endif
+
+	req->headers = curl_slist_append(NULL,
+									 json ? "Content-Type: application/json" :
+									 "Content-Type: message/rfc822");
+	if (!req->headers)
+		elog(ERROR, "out of memory");
+
+	/* don't wait for 100-continue */
+	if (!curl_slist_append(req->headers, "Expect:"))
+		elog(ERROR, "out of memory");
+
+	check_setopt(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers));
+	check_setopt(curl_easy_setopt(curl, CURLOPT_POST, 1L));
+
+	check_setopt(curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback));
+	check_setopt(curl_easy_setopt(curl, CURLOPT_READDATA, &req->reader));
+	check_setopt(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback));
+	check_setopt(curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response));
+
+	/* the size of streamed message is not known (chunked encoding is used) */
+	if (!req->reader.stream)
+	{
+		curl_off_t	payload_size = json ?
+			req->reader.head.len + (req->reader.size + 2) / 3 * 4 + strlen(req->reader.tail) :
+			req->reader.size;
+
+		check_setopt(curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, payload_size));
+	}
+}
+
+/*
+ * Returns the description of error of finished request, or NULL,
+ * when the mail was accepted by server.
+ */
+static char *
+request_error(HttpRequest *req)
+{
+	long		status = 0;
+
+	if (req->result != CURLE_OK)
+		return psprintf("HTTP request failed: %s", curl_easy_strerror(req->result));
+
+	(void) curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+
+	if (status < 200 || status > 299)
+		return psprintf("HTTP server returned status %ld: %s", status, req->response.data);
+
+	return NULL;
+}
+
+/*
+ * Executes the transfer. The interrupts are checked while it waits
+ * for socket.
+ */
+static void
+perform_transfer(HttpRequest *req)
+{
+	CURLMsg    *msg;
+	int			running;
+	int			nmsgs;
+
+	check_multi(curl_multi_add_handle(http_multi, req->curl));
+
+	for (;;)
+	{
+		check_multi(curl_multi_perform(http_multi, &running));
+
+		if (running == 0 || req->reader.edata)
+			break;
+
+		check_multi(curl_multi_wait(http_multi, NULL, 0, 1000, NULL));
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	while ((msg = curl_multi_info_read(http_multi, &nmsgs)) != NULL)
+	{
+		if (msg->msg == CURLMSG_DONE && msg->easy_handle == req->curl)
+			req->result = msg->data.result;
+	}
+
+	curl_multi_remove_handle(http_multi, req->curl);
+}
+
+void
+http_send_mail(const char *sender,
+			   List *envelope,
+			   const char *data,
+			   size_t size,
+			   MessageStream *stream)
+{
+	HttpRequest *req;
+
+	req = init_request(sender, envelope, data, size, stream);
+
+	get_multi();
+
+	if (http_handle)
+		curl_easy_reset(http_handle);
+	else
+	{
+		http_handle = curl_easy_init();
+		if (!http_handle)
+			elog(ERROR, "cannot to start libcurl");
+	}
+
+	req->curl = http_handle;
+
+	PG_TRY();
+	{
+		char	   *error;
+
+		setup_request(req);
+		perform_transfer(req);
+
+		if (req->reader.edata)
+			ReThrowError(req->reader.edata);
+
+		error = request_error(req);
+		if (error)
+			ereport(ERROR,
+					(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					 errmsg("cannot send mail"),
+					 errdetail("%s", error)));
+
+		curl_slist_free_all(req->headers);
+	}
+	PG_CATCH();
+	{
+		curl_slist_free_all(req->headers);
+
+		/* don't reuse the handle after an error */
+		curl_multi_remove_handle(http_multi, http_handle);
+		curl_easy_cleanup(http_handle);
+		http_handle = NULL;
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Releases the easy handles of batch
+ */
+static void
+cleanup_batch(HttpRequest **requests, int nrequests)
+{
+	int			i;
+
+	for (i = 0; i < nrequests; i++)
+	{
+		if (!requests[i])
+			continue;
+
+		if (requests[i]->curl)
+		{
+			curl_multi_remove_handle(http_multi, requests[i]->curl);
+			curl_easy_cleanup(requests[i]->curl);
+		}
+
+		curl_slist_free_all(requests[i]->headers);
+	}
+}
+
+/*
+ * Executes the transfers of batch concurrently. The interrupts are
+ * checked while it waits for sockets.
+ */
+static void
+perform_batch(HttpRequest **requests, int nrequests)
+{
+	CURLMsg    *msg;
+	int			running;
+	int			nmsgs;
+	int			i;
+
+	for (i = 0; i < nrequests; i++)
+		check_multi(curl_multi_add_handle(http_multi, requests[i]->curl));
+
+	for (;;)
+	{
+		check_multi(curl_multi_perform(http_multi, &running));
+
+		if (running == 0)
+			break;
+
+		check_multi(curl_multi_wait(http_multi, NULL, 0, 1000, NULL));
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	while ((msg = curl_multi_info_read(http_multi, &nmsgs)) != NULL)
+	{
+		HttpRequest *req;
+
+		if (msg->msg == CURLMSG_DONE &&
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &req) == CURLE_OK)
+			req->result = msg->data.result;
+	}
+}
+
+/*
+ * Sends the mails of batch by concurrent requests. The result of every
+ * mail is stored in its item (the mails are not streamed, so the read
+ * callback cannot fail).
+ */
+void
+http_send_batch(MailBatchItem **items, int nitems)
+{
+	HttpRequest **requests;
+	int			i;
+
+	requests = palloc0(nitems * sizeof(HttpRequest *));
+
+	get_multi();
+
+	PG_TRY();
+	{
+		for (i = 0; i < nitems; i++)
+		{
+			HttpRequest *req;
+
+			req = init_request(items[i]->sender, items[i]->envelope,
+							   items[i]->data, items[i]->size, NULL);
+			requests[i] = req;
+
+			req->curl = curl_easy_init();
+			if (!req->curl)
+				elog(ERROR, "cannot to start libcurl");
+
+			setup_request(req);
+			check_setopt(curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (char *) req));
+
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+
+			/* wait for multiplexed connection instead of opening new one */
+			check_setopt(curl_easy_setopt(req->curl, CURLOPT_PIPEWAIT, 1L));
+
+#endif
+		}
+
+		perform_batch(requests, nitems);
+
+		for (i = 0; i < nitems; i++)
+			items[i]->error = request_error(requests[i]);
+	}
+	PG_CATCH();
+	{
+		cleanup_batch(requests, nitems);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	cleanup_batch(requests, nitems);
+}
@@ -0,0 +1,492 @@
+/*
+ * Deduplication of sent mails based on idempotency keys
+ *
+ * When the extension is loaded by shared_preload_libraries, the keys
+ * are stored only in shared memory hash table (the keys longer than
+ * the size of hash key are replaced by their sha256 digest, and the keys
+ * of different databases are different, like in table). Else the keys
+ * are stored only in table utl_mail.idempotency_key. Only one store is
+ * used, so a duplicate cannot be missed. The keys expire after time
+ * specified by orafce_mail.idempotency_window.
+ *
+ * The key claimed by a transaction, that is aborted, is released, so
+ * the mail can be sent (or enqueued) again. This is done by rollback for
+ * table, and by transaction callbacks for shared memory. The key of mail,
+ * that was sent directly (not by spool), is kept, because the mail cannot
+ * be returned. The table cannot hold such key after rollback, so these
+ * keys require shared memory.
+ */
+#include "postgres.h"
+
+#include <openssl/evp.h>
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_claim_idempotency_key);
+
+#define IDEMPOTENCY_KEY_SIZE		64
+
+/*
+ * The keys are separated by databases (like keys stored in table)
+ */
+typedef struct
+{
+	Oid			dbid;
+	char		key[IDEMPOTENCY_KEY_SIZE];
+} IdempotencyHashKey;
+
+typedef struct
+{
+	IdempotencyHashKey key;
+	TimestampTz	expires;
+} IdempotencyEntry;
+
+typedef struct
+{
+	LWLock	   *lock;
+} IdempotencyState;
+
+/*
+ * Key claimed by current transaction, that is released on abort
+ */
+typedef struct
+{
+	IdempotencyHashKey key;
+	TimestampTz	expires;
+	SubTransactionId subid;
+} PendingClaim;
+
+static IdempotencyState *idempotency_state = NULL;
+static HTAB *idempotency_hash = NULL;
+
+static PendingClaim *pending_claims = NULL;
+static int	npending_claims = 0;
+static int	maxpending_claims = 0;
+
+static void idempotency_xact_callback(XactEvent event, void *arg);
+static void idempotency_subxact_callback(SubXactEvent event,
+										 SubTransactionId mySubid,
+										 SubTransactionId parentSubid,
+										 void *arg);
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+
+#endif
+
+static Size
+idempotency_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(IdempotencyState)),
+					hash_estimate_size(orafce_idempotency_max_keys,
+									   sizeof(IdempotencyEntry)));
+}
+
+static void
+idempotency_shmem_request(void)
+{
+
+#if PG_VERSION_NUM >= 150000
+
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+#endif
+
+	RequestAddinShmemSpace(idempotency_shmem_size());
+	RequestNamedLWLockTranche("orafce_mail", 1);
+}
+
+static void
+idempotency_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	idempotency_state = ShmemInitStruct("orafce_mail idempotency",
+										sizeof(IdempotencyState),
+										&found);
+	if (!found)
+		idempotency_state->lock = &(GetNamedLWLockTranche("orafce_mail"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(IdempotencyHashKey);
+	info.entrysize = sizeof(IdempotencyEntry);
+
+	idempotency_hash = ShmemInitHash("orafce_mail idempotency keys",
+									 orafce_idempotency_max_keys,
+									 orafce_idempotency_max_keys,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Shared memory can be used only when extension is loaded by
+ * shared_preload_libraries.
+ */
+void
+idempotency_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = idempotency_shmem_request;
+
+#else
+
+	idempotency_shmem_request();
+
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = idempotency_shmem_startup;
+
+	RegisterXactCallback(idempotency_xact_callback, NULL);
+	RegisterSubXactCallback(idempotency_subxact_callback, NULL);
+}
+
+/*
+ * Should be called under exclusive lock
+ */
+static void
+remove_expired_keys(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	IdempotencyEntry *entry;
+
+	hash_seq_init(&status, idempotency_hash);
+
+	while ((entry = (IdempotencyEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->expires <= now)
+			(void) hash_search(idempotency_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Fills hash key of current database. The last byte is zero for keys
+ * stored directly, so it can be used to mark the digest of long key.
+ */
+static void
+make_hash_key(const char *key, IdempotencyHashKey *hkey)
+{
+	size_t		len = strlen(key);
+
+	memset(hkey, 0, sizeof(IdempotencyHashKey));
+
+	hkey->dbid = MyDatabaseId;
+
+	if (len < IDEMPOTENCY_KEY_SIZE)
+		memcpy(hkey->key, key, len);
+	else
+	{
+		unsigned int digest_len;
+
+		if (!EVP_Digest(key, len, (unsigned char *) hkey->key, &digest_len, EVP_sha256(), NULL))
+			elog(ERROR, "cannot to calculate digest of idempotency key");
+
+		hkey->key[IDEMPOTENCY_KEY_SIZE - 1] = 1;
+	}
+}
+
+/*
+ * Returns false for duplicate. The expiration time of new key
+ * is returned by argument expires.
+ */
+static bool
+shmem_claim(const IdempotencyHashKey *hkey, TimestampTz *expires)
+{
+	IdempotencyEntry *entry;
+	TimestampTz now = GetCurrentTimestamp();
+
+	LWLockAcquire(idempotency_state->lock, LW_EXCLUSIVE);
+
+	entry = (IdempotencyEntry *) hash_search(idempotency_hash, hkey, HASH_FIND, NULL);
+	if (entry)
+	{
+		if (entry->expires > now)
+		{
+			LWLockRelease(idempotency_state->lock);
+			return false;
+		}
+	}
+	else
+	{
+		if (hash_get_num_entries(idempotency_hash) >= orafce_idempotency_max_keys)
+			remove_expired_keys(now);
+
+		if (hash_get_num_entries(idempotency_hash) < orafce_idempotency_max_keys)
+			entry = (IdempotencyEntry *) hash_search(idempotency_hash, hkey, HASH_ENTER_NULL, NULL);
+
+		if (!entry)
+		{
+			LWLockRelease(idempotency_state->lock);
+
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("too many idempotency keys"),
+					 errdetail("All %d keys in shared memory are used inside idempotency window.",
+							   orafce_idempotency_max_keys),
+					 errhint("Increase orafce_mail.idempotency_max_keys or decrease orafce_mail.idempotency_window.")));
+		}
+	}
+
+	entry->expires = TimestampTzPlusMilliseconds(now,
+												 (int64) orafce_idempotency_window * 1000);
+	*expires = entry->expires;
+
+	LWLockRelease(idempotency_state->lock);
+
+	return true;
+}
+
+/*
+ * Removes the key from shared memory. The entry is removed only when it
+ * is still owned by the claim (it was not expired and claimed again).
+ */
+static void
+shmem_release(const IdempotencyHashKey *hkey, TimestampTz expires)
+{
+	IdempotencyEntry *entry;
+
+	LWLockAcquire(idempotency_state->lock, LW_EXCLUSIVE);
+
+	entry = (IdempotencyEntry *) hash_search(idempotency_hash, hkey, HASH_FIND, NULL);
+	if (entry && entry->expires == expires)
+		(void) hash_search(idempotency_hash, hkey, HASH_REMOVE, NULL);
+
+	LWLockRelease(idempotency_state->lock);
+}
+
+/*
+ * Forgets the pending claim (and releases it, when release is true).
+ * The claims of subtransaction or all claims (when subid is
+ * InvalidSubTransactionId), or the claim of key (when hkey is not NULL)
+ * are processed. It can be called in abort, so it should not fail.
+ */
+static void
+forget_pending_claims(SubTransactionId subid, const IdempotencyHashKey *hkey, bool release)
+{
+	int			i;
+	int			n = 0;
+
+	for (i = 0; i < npending_claims; i++)
+	{
+		PendingClaim *claim = &pending_claims[i];
+
+		if (hkey ? memcmp(&claim->key, hkey, sizeof(IdempotencyHashKey)) == 0 :
+			(subid == InvalidSubTransactionId || claim->subid == subid))
+		{
+			if (release)
+				shmem_release(&claim->key, claim->expires);
+		}
+		else
+			pending_claims[n++] = *claim;
+	}
+
+	npending_claims = n;
+}
+
+static void
+idempotency_xact_callback(XactEvent event, void *arg)
+{
+	(void) arg;
+
+	if (npending_claims == 0)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			forget_pending_claims(InvalidSubTransactionId, NULL, true);
+			break;
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PREPARE:
+			forget_pending_claims(InvalidSubTransactionId, NULL, false);
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void
+idempotency_subxact_callback(SubXactEvent event,
+							 SubTransactionId mySubid,
+							 SubTransactionId parentSubid,
+							 void *arg)
+{
+	int			i;
+
+	(void) arg;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		forget_pending_claims(mySubid, NULL, true);
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		for (i = 0; i < npending_claims; i++)
+		{
+			if (pending_claims[i].subid == mySubid)
+				pending_claims[i].subid = parentSubid;
+		}
+	}
+}
+
+/*
+ * The row is inserted inside current transaction, so when the sending
+ * fails, the key is released by rollback.
+ */
+static bool
+table_claim(const char *key)
+{
+	Oid			argtypes[2] = {TEXTOID, INT4OID};
+	Datum		values[2];
+	bool		result;
+
+	values[0] = CStringGetTextDatum(key);
+	values[1] = Int32GetDatum(orafce_idempotency_window);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	if (SPI_execute_with_args("INSERT INTO utl_mail.idempotency_key AS k(key, expires)"
+							  " VALUES($1, now() + $2 * interval '1 sec')"
+							  " ON CONFLICT (key) DO UPDATE SET expires = EXCLUDED.expires"
+							  " WHERE k.expires <= now()"
+							  " RETURNING 1",
+							  2, argtypes, values, NULL,
+							  false, 0) != SPI_OK_INSERT_RETURNING)
+		elog(ERROR, "cannot to register idempotency key");
+
+	result = SPI_processed == 1;
+
+	SPI_finish();
+
+	return result;
+}
+
+/*
+ * Returns true, when the key was not used inside idempotency window
+ * (and registers it). Returns false for duplicate.
+ *
+ * The key is released, when the current (sub)transaction is aborted. The
+ * key of mail sent directly should be confirmed by idempotency_confirm
+ * after successful send, and then it is kept. Only transactional keys
+ * (not confirmed later) can be stored in table.
+ */
+bool
+idempotency_claim(const char *key, bool transactional)
+{
+	PendingClaim *claim;
+
+	if (!idempotency_hash)
+	{
+		if (!transactional)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("idempotency key of directly sent mail requires shared memory"),
+					 errdetail("The key stored in table would be released by rollback of already sent mail."),
+					 errhint("Load orafce_mail by shared_preload_libraries, or use utl_mail.enqueue or spool directory.")));
+
+		return table_claim(key);
+	}
+
+	if (npending_claims >= maxpending_claims)
+	{
+		if (!pending_claims)
+		{
+			maxpending_claims = 16;
+			pending_claims = MemoryContextAlloc(TopMemoryContext,
+												maxpending_claims * sizeof(PendingClaim));
+		}
+		else
+		{
+			maxpending_claims *= 2;
+			pending_claims = repalloc(pending_claims,
+									  maxpending_claims * sizeof(PendingClaim));
+		}
+	}
+
+	claim = &pending_claims[npending_claims];
+
+	make_hash_key(key, &claim->key);
+	claim->subid = GetCurrentSubTransactionId();
+
+	if (!shmem_claim(&claim->key, &claim->expires))
+		return false;
+
+	/* from now, the key is released on abort */
+	npending_claims += 1;
+
+	return true;
+}
+
+/*
+ * The mail was sent, so the key is kept, although the transaction
+ * can be aborted.
+ */
+void
+idempotency_confirm(const char *key)
+{
+	IdempotencyHashKey hkey;
+
+	if (!idempotency_hash)
+		return;
+
+	make_hash_key(key, &hkey);
+	forget_pending_claims(InvalidSubTransactionId, &hkey, false);
+}
+
+/*
+ * Releases the key after failed send, so the mail can be sent again.
+ * The keys stored in table are released by rollback.
+ */
+void
+idempotency_release(const char *key)
+{
+	IdempotencyHashKey hkey;
+
+	if (!idempotency_hash)
+		return;
+
+	make_hash_key(key, &hkey);
+	forget_pending_claims(InvalidSubTransactionId, &hkey, true);
+}
+
+/*
+ * FUNCTION utl_mail.claim_idempotency_key(key text)
+ * RETURNS boolean
+ */
+Datum
+orafce_mail_claim_idempotency_key(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(idempotency_claim(text_to_cstring(PG_GETARG_TEXT_PP(0)), true));
+}
@@ -0,0 +1,302 @@
+/*
+ * Memory accounting
+ *
+ * Every send uses own memory context, that is deleted after send, so
+ * the memory used by bulk procedures is not growing. The memory allocated
+ * by libcurl (it can live longer than one send, for example the cache
+ * of connections) is allocated by malloc, but it is counted by callbacks
+ * registered by curl_global_init_mem. The libcurl can allocate memory
+ * in resolver's thread, so the counters are atomic.
+ *
+ * The memory of send context is released inside send (large chunks are
+ * freed immediately), so the size at end of send is not the peak. The
+ * size is sampled when a chunk of message is sent, and at end of send.
+ * The peak of send is the sum of maximal sample and peak of libcurl
+ * memory, so it is an upper estimate (these peaks can be in different
+ * time).
+ */
+#include "postgres.h"
+
+#include <curl/curl.h>
+
+#include "access/htup_details.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "port/atomics.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_memory_stats);
+
+/* the size of allocated block is stored before the block */
+#define CURL_MEMORY_HEADER_SIZE		16
+
+static pg_atomic_uint64 curl_memory;
+static pg_atomic_uint64 curl_memory_peak;
+static pg_atomic_uint64 curl_memory_send_peak;
+
+static uint64 curl_memory_send_start = 0;
+
+static MemoryContext current_send_cxt = NULL;
+static uint64 current_send_peak = 0;
+
+static int64 sends = 0;
+static uint64 last_send_bytes = 0;
+static uint64 peak_send_bytes = 0;
+static uint64 total_send_bytes = 0;
+
+static void
+update_peak(pg_atomic_uint64 *peak, uint64 value)
+{
+	uint64		old = pg_atomic_read_u64(peak);
+
+	while (value > old && !pg_atomic_compare_exchange_u64(peak, &old, value))
+		;
+}
+
+static void
+count_alloc(size_t size)
+{
+	uint64		current = pg_atomic_add_fetch_u64(&curl_memory, size);
+
+	update_peak(&curl_memory_peak, current);
+	update_peak(&curl_memory_send_peak, current);
+}
+
+static void *
+counting_malloc(size_t size)
+{
+	char	   *ptr = malloc(size + CURL_MEMORY_HEADER_SIZE);
+
+	if (!ptr)
+		return NULL;
+
+	*((size_t *) ptr) = size;
+	count_alloc(size);
+
+	return ptr + CURL_MEMORY_HEADER_SIZE;
+}
+
+static void
+counting_free(void *ptr)
+{
+	char	   *block;
+
+	if (!ptr)
+		return;
+
+	block = (char *) ptr - CURL_MEMORY_HEADER_SIZE;
+
+	pg_atomic_sub_fetch_u64(&curl_memory, *((size_t *) block));
+
+	free(block);
+}
+
+static void *
+counting_realloc(void *ptr, size_t size)
+{
+	char	   *block;
+	size_t		oldsize;
+
+	if (!ptr)
+		return counting_malloc(size);
+
+	block = (char *) ptr - CURL_MEMORY_HEADER_SIZE;
+	oldsize = *((size_t *) block);
+
+	block = realloc(block, size + CURL_MEMORY_HEADER_SIZE);
+	if (!block)
+		return NULL;
+
+	*((size_t *) block) = size;
+
+	pg_atomic_sub_fetch_u64(&curl_memory, oldsize);
+	count_alloc(size);
+
+	return block + CURL_MEMORY_HEADER_SIZE;
+}
+
+static char *
+counting_strdup(const char *str)
+{
+	size_t		size = strlen(str) + 1;
+	char	   *result = counting_malloc(size);
+
+	if (result)
+		memcpy(result, str, size);
+
+	return result;
+}
+
+static void *
+counting_calloc(size_t nmemb, size_t size)
+{
+	void	   *result;
+
+	if (size > 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	result = counting_malloc(nmemb * size);
+	if (result)
+		memset(result, 0, nmemb * size);
+
+	return result;
+}
+
+/*
+ * Initializes libcurl with counting memory callbacks. It should be
+ * called before any other function of libcurl.
+ */
+void
+init_curl_memory(void)
+{
+	pg_atomic_init_u64(&curl_memory, 0);
+	pg_atomic_init_u64(&curl_memory_peak, 0);
+	pg_atomic_init_u64(&curl_memory_send_peak, 0);
+
+	curl_global_init_mem(CURL_GLOBAL_ALL,
+						 counting_malloc,
+						 counting_free,
+						 counting_realloc,
+						 counting_strdup,
+						 counting_calloc);
+}
+
+/*
+ * Returns the size of memory allocated by context and its children
+ */
+size_t
+context_allocated(MemoryContext context)
+{
+#if PG_VERSION_NUM >= 130000
+
+	return MemoryContextMemAllocated(context, true);
+
+#else
+
+	MemoryContextCounters counters;
+	MemoryContext child;
+	size_t		result;
+
+	memset(&counters, 0, sizeof(counters));
+	context->methods->stats(context, NULL, NULL, &counters);
+
+	result = counters.totalspace;
+
+	for (child = context->firstchild; child; child = child->nextchild)
+		result += context_allocated(child);
+
+	return result;
+
+#endif
+}
+
+/*
+ * Returns new memory context for one send
+ */
+MemoryContext
+send_memory_begin(void)
+{
+	curl_memory_send_start = pg_atomic_read_u64(&curl_memory);
+	pg_atomic_write_u64(&curl_memory_send_peak, curl_memory_send_start);
+
+	current_send_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											 "orafce_mail send",
+											 ALLOCSET_DEFAULT_SIZES);
+	current_send_peak = 0;
+
+	return current_send_cxt;
+}
+
+/*
+ * Samples the memory used by send. The memory allocated outside of send
+ * context for this send (for example the memory of query executor) can
+ * be passed by "extra_bytes".
+ */
+void
+send_memory_sample(size_t extra_bytes)
+{
+	uint64		bytes;
+
+	if (!current_send_cxt)
+		return;
+
+	bytes = context_allocated(current_send_cxt) + extra_bytes;
+
+	if (bytes > current_send_peak)
+		current_send_peak = bytes;
+}
+
+/*
+ * Updates statistics and deletes the memory context of send. The memory
+ * allocated by libcurl is added to sampled peak of send context.
+ */
+void
+send_memory_end(MemoryContext send_cxt)
+{
+	uint64		curl_peak = pg_atomic_read_u64(&curl_memory_send_peak);
+	uint64		bytes;
+
+	send_memory_sample(0);
+
+	bytes = current_send_peak;
+	if (curl_peak > curl_memory_send_start)
+		bytes += curl_peak - curl_memory_send_start;
+
+	current_send_cxt = NULL;
+	MemoryContextDelete(send_cxt);
+
+	sends += 1;
+	last_send_bytes = bytes;
+	total_send_bytes += bytes;
+
+	if (bytes > peak_send_bytes)
+		peak_send_bytes = bytes;
+}
+
+/*
+ * Deletes the memory context of failed send. The statistics are not
+ * updated.
+ */
+void
+send_memory_abort(MemoryContext send_cxt)
+{
+	current_send_cxt = NULL;
+	MemoryContextDelete(send_cxt);
+}
+
+/*
+ * FUNCTION utl_mail.memory_stats(
+ * 		OUT sends bigint,
+ * 		OUT last_send_bytes bigint,
+ * 		OUT peak_send_bytes bigint,
+ * 		OUT total_send_bytes bigint,
+ * 		OUT curl_bytes bigint,
+ * 		OUT curl_peak_bytes bigint)
+ *
+ * Returns memory statistics of sends in current session. The bytes of
+ * send are the sampled peak of send context plus the peak of libcurl
+ * memory during send, so it is an upper estimate of memory used by send.
+ */
+Datum
+orafce_mail_memory_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum(sends);
+	values[1] = Int64GetDatum((int64) last_send_bytes);
+	values[2] = Int64GetDatum((int64) peak_send_bytes);
+	values[3] = Int64GetDatum((int64) total_send_bytes);
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&curl_memory));
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&curl_memory_peak));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
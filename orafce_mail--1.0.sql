@@ -17,7 +17,8 @@ CREATE PROCEDURE utl_mail.send(
 	message varchar2 DEFAULT NULL,
 	mime_type varchar2 DEFAULT NULL,
 	priority integer DEFAULT NULL,
-	replyto varchar2 DEFAULT NULL)
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
 AS 'MODULE_PATHNAME','orafce_mail_send'
 LANGUAGE C;
 
@@ -34,7 +35,9 @@ CREATE PROCEDURE utl_mail.send_attach_raw(
 	att_inline boolean DEFAULT true,
 	att_mime_type varchar2 DEFAULT 'application/octet',
 	att_filename varchar2 DEFAULT NULL,
-	replyto varchar2 DEFAULT NULL)
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
 AS 'MODULE_PATHNAME','orafce_mail_send_attach_raw'
 LANGUAGE C;
 
@@ -51,10 +54,215 @@ CREATE PROCEDURE utl_mail.send_attach_varchar2(
 	att_inline boolean DEFAULT true,
 	att_mime_type varchar2 DEFAULT 'application/octet',
 	att_filename varchar2 DEFAULT NULL,
-	replyto varchar2 DEFAULT NULL)
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
 AS 'MODULE_PATHNAME','orafce_mail_send_attach_raw'
 LANGUAGE C;
 
+-- variants with lists of recipients passed as arrays
+CREATE PROCEDURE utl_mail.send(
+	sender varchar2,
+	recipients text[],
+	cc text[] DEFAULT NULL,
+	bcc text[] DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_raw(
+	sender varchar2,
+	recipients text[],
+	cc text[] DEFAULT NULL,
+	bcc text[] DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	attachment bytea DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_raw'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_varchar2(
+	sender varchar2,
+	recipients text[],
+	cc text[] DEFAULT NULL,
+	bcc text[] DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	attachment varchar2 DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_raw'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_query(
+	sender varchar2,
+	recipients varchar2,
+	cc varchar2 DEFAULT NULL,
+	bcc varchar2 DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	query text DEFAULT NULL,
+	format varchar2 DEFAULT 'csv',
+	header boolean DEFAULT true,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT NULL,
+	att_filename varchar2 DEFAULT 'query.csv',
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_query'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_query(
+	sender varchar2,
+	recipients text[],
+	cc text[] DEFAULT NULL,
+	bcc text[] DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	query text DEFAULT NULL,
+	format varchar2 DEFAULT 'csv',
+	header boolean DEFAULT true,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT NULL,
+	att_filename varchar2 DEFAULT 'query.csv',
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_query'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_file(
+	sender varchar2,
+	recipients varchar2,
+	cc varchar2 DEFAULT NULL,
+	bcc varchar2 DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	path text DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_file'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_attach_file(
+	sender varchar2,
+	recipients text[],
+	cc text[] DEFAULT NULL,
+	bcc text[] DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	path text DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL,
+	att_compress varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_attach_file'
+LANGUAGE C;
+
+CREATE FUNCTION utl_mail.memory_stats(
+	OUT sends bigint,
+	OUT last_send_bytes bigint,
+	OUT peak_send_bytes bigint,
+	OUT total_send_bytes bigint,
+	OUT curl_bytes bigint,
+	OUT curl_peak_bytes bigint)
+AS 'MODULE_PATHNAME','orafce_mail_memory_stats'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION utl_mail.is_valid_address(address text)
+RETURNS boolean
+AS 'MODULE_PATHNAME','orafce_mail_is_valid_address'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION utl_mail.compose(
+	sender varchar2,
+	recipients varchar2,
+	cc varchar2 DEFAULT NULL,
+	bcc varchar2 DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	attachment bytea DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL)
+RETURNS bytea
+AS 'MODULE_PATHNAME','orafce_mail_compose'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.prepare_template(
+	name varchar2,
+	subject varchar2,
+	message varchar2,
+	mime_type varchar2 DEFAULT NULL,
+	sender varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_prepare_template'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.drop_template(name varchar2)
+AS 'MODULE_PATHNAME','orafce_mail_drop_template'
+LANGUAGE C;
+
+CREATE PROCEDURE utl_mail.send_template(
+	name varchar2,
+	recipients varchar2,
+	params jsonb DEFAULT NULL,
+	cc varchar2 DEFAULT NULL,
+	bcc varchar2 DEFAULT NULL,
+	sender varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
+AS 'MODULE_PATHNAME','orafce_mail_send_template'
+LANGUAGE C;
+
+CREATE FUNCTION utl_mail.send_merge(
+	template varchar2,
+	query text,
+	batch_size integer DEFAULT 1000)
+RETURNS bigint
+AS 'MODULE_PATHNAME','orafce_mail_send_merge'
+LANGUAGE C;
+
+CREATE FUNCTION utl_mail.claim_idempotency_key(key text)
+RETURNS boolean
+AS 'MODULE_PATHNAME','orafce_mail_claim_idempotency_key'
+LANGUAGE C STRICT VOLATILE;
+
 CREATE PROCEDURE dbms_mail.send(
 	from_str varchar2,
 	to_str varchar2,
@@ -82,3 +290,286 @@ BEGIN
   END IF;
 END;
 $$;
+
+/*
+ * Mail queue
+ *
+ * Messages are stored append-only into daily (UTC) range partitions of
+ * utl_mail.mail_queue. The delivery state is held in the narrow table
+ * utl_mail.mail_queue_state partitioned by same bounds. Retries touch only
+ * not indexed columns (HOT updates), but the final transition from pending
+ * state updates indexed column status, so it leaves dead entries in partial
+ * index. These entries are removed by autovacuum, that is configured to be
+ * aggressive on state partitions. Processed partitions older than retention
+ * time are dropped (see utl_mail.queue_maintenance).
+ */
+CREATE SEQUENCE utl_mail.mail_queue_id_seq;
+
+CREATE TABLE utl_mail.mail_queue(
+	id bigint NOT NULL DEFAULT nextval('utl_mail.mail_queue_id_seq'),
+	created timestamptz NOT NULL DEFAULT now(),
+	sender varchar2 NOT NULL,
+	recipients varchar2 NOT NULL,
+	cc varchar2,
+	bcc varchar2,
+	subject varchar2,
+	message varchar2,
+	mime_type varchar2,
+	priority integer,
+	attachment bytea,
+	att_inline boolean,
+	att_mime_type varchar2,
+	att_filename varchar2,
+	replyto varchar2,
+	PRIMARY KEY (created, id))
+PARTITION BY RANGE (created);
+
+/*
+ * status: 'p' pending, 's' sent, 'f' failed (after max_attempts)
+ */
+CREATE TABLE utl_mail.mail_queue_state(
+	id bigint NOT NULL,
+	created timestamptz NOT NULL,
+	status "char" NOT NULL DEFAULT 'p',
+	attempts integer NOT NULL DEFAULT 0,
+	last_attempt timestamptz,
+	last_error text,
+	PRIMARY KEY (created, id))
+PARTITION BY RANGE (created);
+
+CREATE INDEX mail_queue_state_pending
+  ON utl_mail.mail_queue_state (created, id) WHERE status = 'p';
+
+SELECT pg_catalog.pg_extension_config_dump('utl_mail.mail_queue_id_seq', '');
+
+/*
+ * Fallback storage of idempotency keys (when the extension is not
+ * loaded by shared_preload_libraries). Expired keys are removed by
+ * utl_mail.queue_maintenance.
+ */
+CREATE TABLE utl_mail.idempotency_key(
+	key text PRIMARY KEY,
+	expires timestamptz NOT NULL);
+
+/*
+ * Creates partitions of utl_mail.mail_queue and utl_mail.mail_queue_state
+ * for specified day (UTC). The partitions are created outside the extension
+ * script, so they are not members of extension and they can be dropped by
+ * utl_mail.queue_maintenance.
+ */
+CREATE FUNCTION utl_mail.queue_create_partition(day date)
+RETURNS void AS $$
+DECLARE
+  suffix text = to_char(day, 'YYYYMMDD');
+  lower_bound timestamptz = day::timestamp AT TIME ZONE 'UTC';
+  upper_bound timestamptz = (day + 1)::timestamp AT TIME ZONE 'UTC';
+BEGIN
+  PERFORM pg_advisory_xact_lock('utl_mail.mail_queue'::regclass::oid::bigint);
+
+  EXECUTE format('CREATE TABLE IF NOT EXISTS utl_mail.%I'
+                 ' PARTITION OF utl_mail.mail_queue FOR VALUES FROM (%L) TO (%L)',
+                 'mail_queue_' || suffix, lower_bound, upper_bound);
+
+  EXECUTE format('CREATE TABLE IF NOT EXISTS utl_mail.%I'
+                 ' PARTITION OF utl_mail.mail_queue_state FOR VALUES FROM (%L) TO (%L)'
+                 ' WITH (fillfactor = 70,'
+                 ' autovacuum_vacuum_scale_factor = 0, autovacuum_vacuum_threshold = 1000)',
+                 'mail_queue_state_' || suffix, lower_bound, upper_bound);
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog;
+
+/*
+ * Creates partitions for today and next "premake" days, and drops
+ * partitions older than retention time without pending messages.
+ * Returns number of dropped partitions. It should be called regularly
+ * (by cron or some scheduler application).
+ */
+CREATE FUNCTION utl_mail.queue_maintenance(retention interval DEFAULT '7 days',
+                                           premake integer DEFAULT 2)
+RETURNS integer AS $$
+DECLARE
+  today date = (now() AT TIME ZONE 'UTC')::date;
+  suffix text;
+  upper_bound timestamptz;
+  has_pending boolean;
+  dropped integer = 0;
+BEGIN
+  FOR i IN 0 .. premake
+  LOOP
+    PERFORM utl_mail.queue_create_partition(today + i);
+  END LOOP;
+
+  FOR suffix IN
+    SELECT substr(c.relname, 12)
+      FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid
+     WHERE i.inhparent = 'utl_mail.mail_queue'::regclass
+       AND c.relname ~ '^mail_queue_\d{8}$'
+     ORDER BY 1
+  LOOP
+    upper_bound := (to_date(suffix, 'YYYYMMDD') + 1)::timestamp AT TIME ZONE 'UTC';
+
+    EXIT WHEN upper_bound >= now() - retention;
+
+    EXECUTE format('SELECT EXISTS(SELECT * FROM utl_mail.%I WHERE status = ''p'')',
+                   'mail_queue_state_' || suffix)
+       INTO has_pending;
+
+    IF NOT has_pending THEN
+      EXECUTE format('DROP TABLE utl_mail.%I', 'mail_queue_state_' || suffix);
+      EXECUTE format('DROP TABLE utl_mail.%I', 'mail_queue_' || suffix);
+      dropped := dropped + 1;
+    END IF;
+  END LOOP;
+
+  DELETE FROM utl_mail.idempotency_key WHERE expires <= now();
+
+  RETURN dropped;
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog;
+
+CREATE FUNCTION utl_mail.enqueue(
+	sender varchar2,
+	recipients varchar2,
+	cc varchar2 DEFAULT NULL,
+	bcc varchar2 DEFAULT NULL,
+	subject varchar2 DEFAULT NULL,
+	message varchar2 DEFAULT NULL,
+	mime_type varchar2 DEFAULT NULL,
+	priority integer DEFAULT NULL,
+	attachment bytea DEFAULT NULL,
+	att_inline boolean DEFAULT true,
+	att_mime_type varchar2 DEFAULT 'application/octet',
+	att_filename varchar2 DEFAULT NULL,
+	replyto varchar2 DEFAULT NULL,
+	idempotency_key varchar2 DEFAULT NULL)
+RETURNS bigint AS $$
+DECLARE
+  _id bigint = nextval('utl_mail.mail_queue_id_seq');
+  _created timestamptz = now();
+  _day date = (_created AT TIME ZONE 'UTC')::date;
+BEGIN
+  IF coalesce(sender::text, '') = '' OR coalesce(recipients::text, '') = '' THEN
+    RAISE EXCEPTION 'NULL or empty string is not allowed'
+      USING ERRCODE = 'null_value_not_allowed',
+            HINT = 'The arguments "sender" and "recipients" of function "utl_mail.enqueue" are required.';
+  END IF;
+
+  /* returns NULL, when the message is duplicate */
+  IF coalesce(idempotency_key::text, '') <> ''
+     AND NOT utl_mail.claim_idempotency_key(idempotency_key) THEN
+    RETURN NULL;
+  END IF;
+
+  IF to_regclass('utl_mail.mail_queue_' || to_char(_day, 'YYYYMMDD')) IS NULL THEN
+    PERFORM utl_mail.queue_create_partition(_day);
+  END IF;
+
+  INSERT INTO utl_mail.mail_queue(id, created, sender, recipients, cc, bcc,
+                                  subject, message, mime_type, priority,
+                                  attachment, att_inline, att_mime_type,
+                                  att_filename, replyto)
+    VALUES(_id, _created, sender, recipients, cc, bcc,
+           subject, message, mime_type, priority,
+           attachment, att_inline, att_mime_type,
+           att_filename, replyto);
+
+  INSERT INTO utl_mail.mail_queue_state(id, created) VALUES(_id, _created);
+
+  RETURN _id;
+END;
+$$ LANGUAGE plpgsql;
+
+/*
+ * Sends pending messages from queue. Every message is sent in own
+ * transaction, so this procedure should not be called inside an
+ * explicit transaction block. Concurrent calls are possible (the
+ * messages are locked with SKIP LOCKED).
+ */
+CREATE PROCEDURE utl_mail.process_queue(max_messages integer DEFAULT NULL,
+                                        max_attempts integer DEFAULT 5)
+AS $$
+DECLARE
+  run_start timestamptz = clock_timestamp();
+  processed integer = 0;
+  s record;
+  q record;
+BEGIN
+  LOOP
+    EXIT WHEN processed >= max_messages;
+
+    SELECT id, created, attempts INTO s
+      FROM utl_mail.mail_queue_state
+     WHERE status = 'p'
+       AND (last_attempt IS NULL OR last_attempt < run_start)
+     ORDER BY created, id
+     LIMIT 1
+       FOR UPDATE SKIP LOCKED;
+
+    EXIT WHEN NOT FOUND;
+
+    SELECT * INTO q
+      FROM utl_mail.mail_queue
+     WHERE created = s.created AND id = s.id;
+
+    BEGIN
+      IF q.attachment IS NULL THEN
+        CALL utl_mail.send(sender => q.sender,
+                           recipients => q.recipients,
+                           cc => q.cc,
+                           bcc => q.bcc,
+                           subject => q.subject,
+                           message => q.message,
+                           mime_type => q.mime_type,
+                           priority => q.priority,
+                           replyto => q.replyto);
+      ELSE
+        CALL utl_mail.send_attach_raw(sender => q.sender,
+                                      recipients => q.recipients,
+                                      cc => q.cc,
+                                      bcc => q.bcc,
+                                      subject => q.subject,
+                                      message => q.message,
+                                      mime_type => q.mime_type,
+                                      priority => q.priority,
+                                      attachment => q.attachment,
+                                      att_inline => q.att_inline,
+                                      att_mime_type => q.att_mime_type,
+                                      att_filename => q.att_filename,
+                                      replyto => q.replyto);
+      END IF;
+
+      UPDATE utl_mail.mail_queue_state
+         SET status = 's', attempts = attempts + 1, last_attempt = clock_timestamp()
+       WHERE created = s.created AND id = s.id;
+
+    EXCEPTION WHEN OTHERS THEN
+      UPDATE utl_mail.mail_queue_state
+         SET status = CASE WHEN s.attempts + 1 >= max_attempts THEN 'f' ELSE 'p' END,
+             attempts = attempts + 1,
+             last_attempt = clock_timestamp(),
+             last_error = SQLERRM
+       WHERE created = s.created AND id = s.id;
+    END;
+
+    COMMIT;
+
+    processed := processed + 1;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+REVOKE ALL ON FUNCTION utl_mail.queue_create_partition(date) FROM PUBLIC;
+REVOKE ALL ON FUNCTION utl_mail.queue_maintenance(interval, integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION utl_mail.enqueue(varchar2, varchar2, varchar2, varchar2, varchar2, varchar2, varchar2, integer, bytea, boolean, varchar2, varchar2, varchar2, varchar2) FROM PUBLIC;
+REVOKE ALL ON FUNCTION utl_mail.claim_idempotency_key(text) FROM PUBLIC;
+REVOKE ALL ON PROCEDURE utl_mail.process_queue(integer, integer) FROM PUBLIC;
+
+GRANT EXECUTE ON FUNCTION utl_mail.queue_create_partition(date) TO orafce_mail;
+GRANT EXECUTE ON FUNCTION utl_mail.enqueue(varchar2, varchar2, varchar2, varchar2, varchar2, varchar2, varchar2, integer, bytea, boolean, varchar2, varchar2, varchar2, varchar2) TO orafce_mail;
+GRANT EXECUTE ON FUNCTION utl_mail.claim_idempotency_key(text) TO orafce_mail;
+GRANT EXECUTE ON PROCEDURE utl_mail.process_queue(integer, integer) TO orafce_mail;
+
+GRANT USAGE ON SEQUENCE utl_mail.mail_queue_id_seq TO orafce_mail;
+GRANT SELECT, INSERT ON utl_mail.mail_queue TO orafce_mail;
+GRANT SELECT, INSERT, UPDATE ON utl_mail.mail_queue_state TO orafce_mail;
+GRANT SELECT, INSERT, UPDATE ON utl_mail.idempotency_key TO orafce_mail;
@@ -5,14 +5,23 @@
 
 #include "postgres.h"
 
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+
+#include "catalog/pg_authid.h"
 #include "fmgr.h"
 #include "funcapi.h"
-#include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "utils/acl.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/guc.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
 
 PG_MODULE_MAGIC;
 
@@ -30,30 +39,45 @@ Oid		ORAFCE_MAIL_ROLE_CONFIG_USERPWD = InvalidOid;
 
 typedef struct
 {
-	char	   *header_data;
-	size_t		header_size;
-	size_t		header_position;
-
 	char	   *data;
 	size_t		size;
 	size_t		position;
-
-	bool		unix2dos_nl;
-
-} BinaryReader;
-
-typedef struct
-{
-	char	   *data;
-	size_t		size;
-	size_t		used;
-} DynamicBuffer;
+	MessageStream *stream;		/* not NULL for streamed message */
+	MemoryContext mcxt;
+	ErrorData  *edata;			/* error raised inside read callback */
+} MessageReader;
 
 /*
  * Invisible super user settings
  */
 char	   *orafce_smtp_url = NULL;
 char	   *orafce_smtp_userpwd = NULL;
+char	   *orafce_smtp_unix_socket = NULL;
+int			orafce_smtp_engine = SMTP_ENGINE_CURL;
+
+static const struct config_enum_entry smtp_engine_options[] = {
+	{"curl", SMTP_ENGINE_CURL, false},
+	{"native", SMTP_ENGINE_NATIVE, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry http_payload_format_options[] = {
+	{"raw", HTTP_PAYLOAD_RAW, false},
+	{"json", HTTP_PAYLOAD_JSON, false},
+	{NULL, 0, false}
+};
+
+/*
+ * The curl handle is reused by all sends in the backend. It holds
+ * the connection cache, so the connection to smtp server can be
+ * reused by next mail.
+ */
+static CURL *curl_handle = NULL;
+
+int			orafce_max_message_size = 0;
+
+int			orafce_idempotency_window = 86400;
+int			orafce_idempotency_max_keys = 10000;
 
 /*
 * Interrupt support is dependent on CURLOPT_XFERINFOFUNCTION which is
@@ -74,32 +98,6 @@ check_priv_of_role(Oid *oidptr, char *rolname)
 }
 
 
-static void
-add_line(DynamicBuffer *dbuf, char *str)
-{
-	size_t		len = strlen(str);
-	char	   *write_ptr;
-
-	if (dbuf->used + len + 3 > dbuf->size)
-	{
-		size_t	new_size = ((dbuf->used + len + 1024) / 1024 + 1) * 1024;
-
-		if (dbuf->size == 0)
-			dbuf->data = palloc(new_size);
-		else
-			dbuf->data = repalloc(dbuf->data, new_size);
-
-		dbuf->size = new_size;
-	}
-
-	write_ptr = dbuf->data + dbuf->used;
-
-	memcpy(write_ptr, str, len);
-	memcpy(write_ptr + len, "\r\n\0", 3);
-
-	dbuf->used += len + 2;
-}
-
 /*
 * To support request interruption, we have libcurl run the progress meter
 * callback frequently, and here we watch to see if PgSQL has flipped our
@@ -150,7 +148,7 @@ http_interrupt_handler(int sig)
 /*
  * Input argument checks
  */
-static Datum
+Datum
 not_null_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname)
 {
 	if (PG_ARGISNULL(argno))
@@ -164,7 +162,7 @@ not_null_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char
 	return PG_GETARG_DATUM(argno);
 }
 
-static char *
+char *
 null_or_empty_arg(FunctionCallInfo fcinfo, int argno)
 {
 	text	   *txt;
@@ -193,7 +191,7 @@ not_empty_darg(Datum d, const char *fcname, const char *argname)
 	return text_to_cstring(txt);
 }
 
-static char *
+char *
 not_null_not_empty_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname)
 {
 	return
@@ -207,196 +205,93 @@ not_null_not_empty_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, c
 }
 
 /*
- * CURL list is linked list of duplicated strings. This routine
- * does formatting of one row of header and add this row to list.
- *
+ * Returns the maximal size of message in bytes (0 is unlimited). It is
+ * smaller of orafce_mail.max_message_size and the SIZE limit advertised
+ * by the server of reused native connection.
  */
-static struct curl_slist *
-add_header_item(struct curl_slist *sl, DynamicBuffer *dbuf, const char *fieldname, const char *arg)
-{
-	char	   *buf, *ptr;
-
-	if (!arg)
-		return sl;
-
-	buf = malloc(strlen(fieldname) + strlen(arg) + 2);
-	if (!buf)
-		elog(ERROR, "out of memory");
-
-	ptr = buf;
-	while (*fieldname)
-		*ptr++ = *fieldname++;
-
-	while (*arg)
-		*ptr++ = *arg++;
-
-	*ptr = '\0';
-
-	if (dbuf)
-	{
-		add_line(dbuf, buf);
-	}
-	else
-	{
-		sl = curl_slist_append(sl, buf);
-		if (!sl)
-			elog(ERROR, "out of memory");
-	}
-
-	free(buf);
-
-	return sl;
-}
-
-static struct curl_slist *
-add_header_priority_item(struct curl_slist *sl, DynamicBuffer *dbuf, int priority, bool isnull)
+size_t
+message_size_limit(void)
 {
-	char	buffer[100];
+	size_t		result = (size_t) orafce_max_message_size * 1024;
+	size_t		server_max_size = 0;
 
-	if (isnull)
-		return sl;
+	if (orafce_smtp_url &&
+		(strncmp(orafce_smtp_url, "lmtp://", 7) == 0 ||
+		 orafce_smtp_engine == SMTP_ENGINE_NATIVE))
+		server_max_size = smtp_server_max_size();
 
-	snprintf(buffer, sizeof(buffer), "%d", priority);
+	if (server_max_size > 0 && (result == 0 || server_max_size < result))
+		result = server_max_size;
 
-	return add_header_item(sl, dbuf, "X-Priority: ", buffer);
+	return result;
 }
 
 /*
- * Parse string as comma delimited list.
- *
- * Attention, this function modifies input string.
+ * The encoded attachment is only part of message, so when it is
+ * over the limit, then the message is over the limit too. This check
+ * is done before the attachment is detoasted. The attachment, that will
+ * be compressed, is checked by lower bound of compressed size.
  */
-static struct curl_slist *
-add_fields(struct curl_slist *sl, char *str)
+void
+precheck_attachment_size(Datum attachment, size_t max_size, bool compressed)
 {
-	char	   *tok;
+	size_t		raw_size = toast_raw_datum_size(attachment) - VARHDRSZ;
 
-	if (!str)
-		return sl;
-
-	tok = strtok(str, ",");
-	while (tok)
-	{
-		sl = curl_slist_append(sl, tok);
-		if (!sl)
-			elog(ERROR, "out of memory");
+	if (compressed)
+		raw_size = compressed_size_lower_bound(raw_size);
 
-		tok = strtok(NULL, ",");
-	}
-
-	return sl;
+	check_message_size(base64_encoded_size(raw_size), max_size);
 }
 
 static size_t
 read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-	BinaryReader *reader = (BinaryReader *) userdata;
-	size_t not_processed_yet;
-	size_t write_buffer_size = size * nmemb;
-
-	if ((size == 0) ||
-		(nmemb == 0) ||
-		((size * nmemb) < 1))
-		return 0;
-
-	/*
-	 * When we have to send header's lines first
-	 */
-	not_processed_yet = reader->header_size - reader->header_position;
-	if (reader->header_size > reader->header_position)
-	{
-		char	   *read_buffer = reader->header_data + reader->header_position;
-
-		if (write_buffer_size > not_processed_yet)
-			write_buffer_size = not_processed_yet;
-
-		memcpy(ptr, read_buffer, write_buffer_size);
-		reader->header_position += write_buffer_size;
+	MessageReader *reader = (MessageReader *) userdata;
+	size_t		not_processed_yet = reader->size - reader->position;
+	size_t		write_buffer_size = size * nmemb;
 
-		return write_buffer_size;
-	}
-
-	/*
-	 * Header was processed, now print empty line as separator
-	 */
-	if (reader->header_size > 0)
+	if (reader->stream)
 	{
-		memcpy(ptr, "\r\n", 2);
-		reader->header_size = 0;
-		reader->header_position = 0;
+		volatile size_t result = 0;
 
-		return 2;
-	}
-
-	/*
-	 * Now, send data.
-	 */
-	not_processed_yet = reader->size - reader->position;
-	if (not_processed_yet > 0)
-	{
-		char	   *write_buffer = ptr;
-		char	   *read_buffer = reader->data + reader->position;
-		char	   *rptr = read_buffer;
-
-		if (!reader->unix2dos_nl)
+		/*
+		 * An error cannot be thrown through libcurl. It is saved, and it
+		 * is raised again after curl_easy_perform.
+		 */
+		PG_TRY();
 		{
-			if (write_buffer_size > not_processed_yet)
-				write_buffer_size = not_processed_yet;
-
-			memcpy(write_buffer, read_buffer, write_buffer_size);
-			reader->position += write_buffer_size;
-
-			return write_buffer_size;
+			result = read_message_stream(reader->stream, ptr, write_buffer_size);
 		}
-
-		while (not_processed_yet > 0 && write_buffer_size > 0)
+		PG_CATCH();
 		{
-			if ((not_processed_yet > 1) &&
-				(rptr[0] == '\r' && rptr[1] == '\n'))
-			{
-				if (write_buffer_size >= 2)
-				{
-					*ptr++ = *rptr++;
-					*ptr++ = *rptr++;
-					write_buffer_size -= 2;
-					not_processed_yet -= 2;
-				}
-				else
-					break;
-			}
+			MemoryContextSwitchTo(reader->mcxt);
+			reader->edata = CopyErrorData();
+			FlushErrorState();
 
-			if (rptr[0] == '\n')
-			{
-				if (write_buffer_size >= 2)
-				{
-					*ptr++ = '\r';
-					*ptr++ = *rptr++;
-					write_buffer_size -= 2;
-					not_processed_yet -= 1;
-				}
-				else
-					break;
-			}
-			else
-			{
-				*ptr++ = *rptr++;
-				write_buffer_size -= 1;
-				not_processed_yet -= 1;
-			}
+			result = CURL_READFUNC_ABORT;
 		}
+		PG_END_TRY();
 
-		reader->position += rptr - read_buffer;
-
-		return ptr - write_buffer;
+		return result;
 	}
 
-	return 0;
+	if (write_buffer_size > not_processed_yet)
+		write_buffer_size = not_processed_yet;
+
+	memcpy(ptr, reader->data + reader->position, write_buffer_size);
+	reader->position += write_buffer_size;
+
+	return write_buffer_size;
 }
 
 static int
 seek_callback(void *arg, curl_off_t offset, int origin)
 {
-	BinaryReader *p = (BinaryReader *) arg;
+	MessageReader *p = (MessageReader *) arg;
+
+	/* streamed message cannot be sent again */
+	if (p->stream)
+		return CURL_SEEKFUNC_CANTSEEK;
 
 	switch(origin)
 	{
@@ -409,7 +304,7 @@ seek_callback(void *arg, curl_off_t offset, int origin)
 			break;
 	}
 
-	if(offset < 0)
+	if(offset < 0 || (size_t) offset > p->size)
 		return CURL_SEEKFUNC_FAIL;
 
 	p->position = offset;
@@ -417,6 +312,17 @@ seek_callback(void *arg, curl_off_t offset, int origin)
 	return CURL_SEEKFUNC_OK;
 }
 
+static CURL *
+get_curl_handle(void)
+{
+	if (curl_handle)
+		curl_easy_reset(curl_handle);
+	else
+		curl_handle = curl_easy_init();
+
+	return curl_handle;
+}
+
 static void
 OOM_CHECK(CURLcode res)
 {
@@ -435,50 +341,24 @@ CHECK_OK(CURLcode res)
 }
 
 static void
-orafce_send_mail(char *sender,
-				 char *recipients,
-				 char *cc,
-				 char *bcc,
-				 char *subject,
-				 char *replyto,
-				 int priority,
-				 bool priority_is_null,
-				 char *message,
-				 char *mime_type,
-				 char *attachment_data,
-				 size_t attachment_size,
-				 char *att_mime_type,
-				 char *att_filename,
-				 bool att_is_text)
+curl_send_mail(char *sender, List *envelope, char *data, size_t size,
+			   MessageStream *stream)
 {
 	CURL	   *curl;
-	char		charbuffer[1024];
+	MessageReader reader;
 
-	if (!check_priv_of_role(&ORAFCE_MAIL_ROLE_USE, "orafce_mail"))
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("must be a member of the role \"orafce_mail\"")));
+	memset(&reader, 0, sizeof(MessageReader));
+	reader.data = data;
+	reader.size = size;
+	reader.stream = stream;
+	reader.mcxt = CurrentMemoryContext;
 
-	if (!orafce_smtp_url)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("orafce.smtp_url is not specified"),
-				 errdetail("The address (url) of smtp service is not known.")));
-
-	curl = curl_easy_init();
+	curl = get_curl_handle();
 	if (curl)
 	{
 		CURLcode	res;
-		struct curl_slist *recip = NULL;
-		struct curl_slist *headers = NULL;
-		curl_mime *mime = NULL;
-		curl_mimepart *part;
-		BinaryReader reader;
-		BinaryReader message_reader;
-		DynamicBuffer dbuf, *_dbuf;
-
-		memset(&message_reader, 0, sizeof(BinaryReader));
-		memset(&reader, 0, sizeof(BinaryReader));
+		struct curl_slist *volatile recip = NULL;
+		ListCell   *lc;
 
 		PG_TRY();
 		{
@@ -487,6 +367,21 @@ orafce_send_mail(char *sender,
 			if (orafce_smtp_userpwd)
 				OOM_CHECK(curl_easy_setopt(curl, CURLOPT_USERPWD, orafce_smtp_userpwd));
 
+			if (orafce_smtp_unix_socket)
+			{
+#if LIBCURL_VERSION_NUM >= 0x072800 /* 7.40.0 */
+
+				OOM_CHECK(curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, orafce_smtp_unix_socket));
+
+#else
+
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("unix domain sockets are not supported by this version of libcurl")));
+
+#endif
+			}
+
 			if (strncmp(orafce_smtp_url, "smtps://", 8) == 0)
 				(void) curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
 
@@ -496,167 +391,24 @@ orafce_send_mail(char *sender,
 
 			OOM_CHECK(curl_easy_setopt(curl, CURLOPT_MAIL_FROM, sender));
 
-			recip = add_fields(recip, recipients);
-
-			(void) curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recip);
-
-			/*
-			 * curl http header is working only when MIME is used. Without
-			 * MIME I have to collect headers in dynamic string.
-			 */
-			if (!attachment_data)
-			{
-				dbuf.data = NULL;
-				dbuf.size = 0;
-				dbuf.used = 0;
-				_dbuf = &dbuf;
-			}
-			else
-				_dbuf = NULL;
-
-			headers = add_header_item(headers, _dbuf, "From: ", sender);
-			headers = add_header_item(headers, _dbuf, "To: " , recipients);
-			headers = add_header_item(headers, _dbuf, "Cc: ", cc);
-			headers = add_header_item(headers, _dbuf, "Bcc: ", bcc);
-			headers = add_header_item(headers, _dbuf, "Reply-To: ", replyto);
-			headers = add_header_priority_item(headers, _dbuf, priority, priority_is_null);
-			headers = add_header_item(headers, _dbuf, "Subject: ", subject);
-
-			/*
-			 * When there are an attachment, then we make multipart mime
-			 */
-			if (attachment_data)
+			foreach(lc, envelope)
 			{
-				mime = curl_mime_init(curl);
-				if (!mime)
+				recip = curl_slist_append(recip, (char *) lfirst(lc));
+				if (!recip)
 					elog(ERROR, "out of memory");
-
-				if (message)
-				{
-					part = curl_mime_addpart(mime);
-					if (!part)
-						elog(ERROR, "out of memory");
-
-					if (!mime_type)
-					{
-						snprintf(charbuffer,
-								 sizeof(charbuffer),
-								 "text/plain; charset=\"%s\"",
-								 get_encoding_name_for_icu(pg_get_client_encoding()));
-
-						CHECK_OK(curl_mime_type(part, charbuffer));
-					}
-					else
-						CHECK_OK(curl_mime_type(part, mime_type));
-
-					message_reader.data = message;
-					message_reader.size = strlen(message);
-					message_reader.position = 0;
-
-					if (!mime_type || strncmp(mime_type, "text/plain;", 11) == 0)
-						message_reader.unix2dos_nl = true;
-					else
-						message_reader.unix2dos_nl = false;
-
-					(void) curl_mime_data_cb(part,
-											  -1,
-											  read_callback,
-											  NULL,
-											  NULL,
-											  &message_reader);
-
-					CHECK_OK(curl_mime_encoder(part, "8bit"));
-				}
-
-				part = curl_mime_addpart(mime);
-				if (!part)
-					elog(ERROR, "out of memory");
-
-				if (att_mime_type)
-					CHECK_OK(curl_mime_type(part, att_mime_type));
-				else
-				{
-					if (att_is_text)
-					{
-						snprintf(charbuffer,
-								 sizeof(charbuffer),
-								 "text/plain; charset=\"%s\"",
-								 get_encoding_name_for_icu(pg_get_client_encoding()));
-
-						CHECK_OK(curl_mime_type(part, charbuffer));
-					}
-					else
-						CHECK_OK(curl_mime_type(part, "application/octet"));
-				}
-
-				(void) curl_mime_encoder(part, "base64");
-
-				if (att_filename)
-				{
-					CHECK_OK(curl_mime_filename(part, att_filename));
-					CHECK_OK(curl_mime_name(part, att_filename));
-				}
-
-				reader.data = attachment_data;
-				reader.size = attachment_size;
-				reader.position = 0;
-
-				if (att_is_text &&
-					(!att_mime_type || strncmp(att_mime_type, "text/plain;", 11) == 0))
-					reader.unix2dos_nl = true;
-				else
-					reader.unix2dos_nl = false;
-
-				(void) curl_mime_data_cb(part,
-								  reader.unix2dos_nl ? (size_t) -1 : reader.size,
-								  read_callback,
-								  reader.unix2dos_nl ? NULL : seek_callback,
-								  NULL,
-								  &reader);
-
-				(void) curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
-			}
-			else
-			{
-				if (!mime_type)
-				{
-					snprintf(charbuffer,
-							 sizeof(charbuffer),
-							 "text/plain; charset=\"%s\"",
-							 get_encoding_name_for_icu(pg_get_client_encoding()));
-
-					headers = add_header_item(headers, _dbuf, "Content-Type: ", charbuffer);
-				}
-				else
-					headers = add_header_item(headers, _dbuf, "Content-Type: ", mime_type);
-
-				headers = add_header_item(headers, _dbuf, "Content-Transfer-Encoding: ", "8bit");
-
-				message_reader.data = message;
-				message_reader.size = strlen(message);
-				message_reader.position = 0;
-
-				if (!mime_type || strncmp(mime_type, "text/plain;", 11) == 0)
-					message_reader.unix2dos_nl = true;
-				else
-					message_reader.unix2dos_nl = false;
-
-				CHECK_OK(curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback));
-				CHECK_OK(curl_easy_setopt(curl, CURLOPT_READDATA, &message_reader));
-				CHECK_OK(curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L));
 			}
 
-			if (headers)
-				CHECK_OK(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
-			else
-			{
-				if (!_dbuf)
-					elog(ERROR, "dynamic buffer is NULL");
+			(void) curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recip);
 
-				message_reader.header_data = _dbuf->data;
-				message_reader.header_size = _dbuf->used;
-				message_reader.header_position = 0;
-			}
+			CHECK_OK(curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback));
+			CHECK_OK(curl_easy_setopt(curl, CURLOPT_READDATA, &reader));
+			CHECK_OK(curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_callback));
+			CHECK_OK(curl_easy_setopt(curl, CURLOPT_SEEKDATA, &reader));
+			/* the size of streamed message is not known */
+			if (!stream)
+				CHECK_OK(curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) reader.size));
+
+			CHECK_OK(curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L));
 
 #if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
 
@@ -668,29 +420,24 @@ orafce_send_mail(char *sender,
 
 			res = curl_easy_perform(curl);
 
+			if (reader.edata)
+				ReThrowError(reader.edata);
+
 			if (res != CURLE_OK)
 				ereport(ERROR,
 						(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
 						 errmsg("cannot send mail"),
 						 errdetail("curl_easy_perform() failed: %s", curl_easy_strerror(res))));
 
-			if (_dbuf)
-				pfree(_dbuf->data);
-
 			curl_slist_free_all(recip);
-			curl_slist_free_all(headers);
-			curl_easy_cleanup(curl);
-			curl_mime_free(mime);
 		}
 		PG_CATCH();
 		{
-			if (_dbuf)
-				pfree(_dbuf->data);
-
 			curl_slist_free_all(recip);
-			curl_slist_free_all(headers);
+
+			/* don't reuse the handle (and connection) after an error */
 			curl_easy_cleanup(curl);
-			curl_mime_free(mime);
+			curl_handle = NULL;
 
 			PG_RE_THROW();
 		}
@@ -700,6 +447,420 @@ orafce_send_mail(char *sender,
 		elog(ERROR, "cannot to start libcurl");
 }
 
+/*
+ * Transport of mail. The transport is selected by prefix of
+ * orafce_mail.smtp_server_url, the last transport (without prefix)
+ * is used for other urls.
+ */
+typedef struct
+{
+	const char *prefix;
+	void		(*send) (const char *url, char *sender, List *envelope,
+						 char *data, size_t size, MessageStream *stream);
+	bool		transactional;	/* mail is delivered by commit */
+	bool		(*bcc_header) (void);	/* NULL when Bcc is not written */
+
+	/* sends mails concurrently, NULL when mails are sent one by one */
+	void		(*send_batch) (MailBatchItem **items, int nitems);
+} MailTransport;
+
+/* the mails of active batch are collected there */
+static MemoryContext batch_cxt = NULL;
+static List *batch_items = NIL;
+static char *batch_url = NULL;
+
+static void
+spool_transport_send(const char *url, char *sender, List *envelope,
+					 char *data, size_t size, MessageStream *stream)
+{
+	spool_send_mail(url + strlen("file://"), data, size, stream);
+}
+
+/*
+ * The spool file is processed by MTA, that reads recipients from headers,
+ * so Bcc header is necessary there.
+ */
+static bool
+spool_bcc_header(void)
+{
+	return true;
+}
+
+static void
+http_transport_send(const char *url, char *sender, List *envelope,
+					char *data, size_t size, MessageStream *stream)
+{
+	http_send_mail(sender, envelope, data, size, stream);
+}
+
+/* the envelope is not sent with raw message */
+static bool
+http_bcc_header(void)
+{
+	return orafce_http_payload_format == HTTP_PAYLOAD_RAW;
+}
+
+/* LMTP is supported only by native engine */
+static void
+lmtp_transport_send(const char *url, char *sender, List *envelope,
+					char *data, size_t size, MessageStream *stream)
+{
+	smtp_send_mail(sender, envelope, data, size, stream);
+}
+
+static void
+smtp_transport_send(const char *url, char *sender, List *envelope,
+					char *data, size_t size, MessageStream *stream)
+{
+	if (orafce_smtp_engine == SMTP_ENGINE_NATIVE)
+		smtp_send_mail(sender, envelope, data, size, stream);
+	else
+		curl_send_mail(sender, envelope, data, size, stream);
+}
+
+static const MailTransport transports[] = {
+	{"file://", spool_transport_send, true, spool_bcc_header, NULL},
+	{"http://", http_transport_send, false, http_bcc_header, http_send_batch},
+	{"https://", http_transport_send, false, http_bcc_header, http_send_batch},
+	{"lmtp://", lmtp_transport_send, false, NULL, NULL},
+	{NULL, smtp_transport_send, false, NULL, NULL}
+};
+
+static const MailTransport *
+get_transport(const char *url)
+{
+	const MailTransport *transport = transports;
+
+	while (transport->prefix &&
+		   strncmp(url, transport->prefix, strlen(transport->prefix)) != 0)
+		transport++;
+
+	return transport;
+}
+
+/*
+ * Copies the composed message to the active batch. The key stays
+ * claimed, and it is confirmed or released, when the batch is sent.
+ */
+static void
+mail_batch_add(char *sender, List *envelope, char *data, size_t size,
+			   char *idempotency_key)
+{
+	MemoryContext oldcxt;
+	MailBatchItem *item;
+	ListCell   *lc;
+
+	/* all mails of batch are sent to same server */
+	if (batch_url && strcmp(batch_url, orafce_smtp_url) != 0)
+		mail_batch_flush();
+
+	oldcxt = MemoryContextSwitchTo(batch_cxt);
+
+	if (!batch_url)
+		batch_url = pstrdup(orafce_smtp_url);
+
+	item = palloc0(sizeof(MailBatchItem));
+	item->sender = pstrdup(sender);
+
+	foreach(lc, envelope)
+		item->envelope = lappend(item->envelope, pstrdup((char *) lfirst(lc)));
+
+	item->data = MemoryContextAllocHuge(batch_cxt, size);
+	memcpy(item->data, data, size);
+	item->size = size;
+
+	if (idempotency_key)
+		item->idempotency_key = pstrdup(idempotency_key);
+
+	batch_items = lappend(batch_items, item);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Starts the batch of mails. When the batch is active, then the mails
+ * of transport, that can send more mails concurrently (HTTP), are not
+ * sent immediately, but they are sent together by mail_batch_flush.
+ * Returns false, when the batch is active already (the mails are sent
+ * by the outer batch).
+ */
+bool
+mail_batch_begin(void)
+{
+	if (batch_cxt)
+		return false;
+
+	batch_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "orafce_mail batch",
+									  ALLOCSET_DEFAULT_SIZES);
+	batch_items = NIL;
+	batch_url = NULL;
+
+	return true;
+}
+
+/*
+ * Sends collected mails. The mails are sent all, and then an error
+ * is raised, when some mail was not sent.
+ */
+void
+mail_batch_flush(void)
+{
+	MemoryContext oldcxt;
+	MailBatchItem **items;
+	ListCell   *lc;
+	char	   *error = NULL;
+	int			nitems;
+	int			failed = 0;
+	int			i = 0;
+
+	if (!batch_cxt || batch_items == NIL)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(batch_cxt);
+
+	nitems = list_length(batch_items);
+	items = palloc(nitems * sizeof(MailBatchItem *));
+
+	foreach(lc, batch_items)
+		items[i++] = (MailBatchItem *) lfirst(lc);
+
+	get_transport(batch_url)->send_batch(items, nitems);
+
+	for (i = 0; i < nitems; i++)
+	{
+		if (items[i]->error)
+		{
+			if (items[i]->idempotency_key)
+				idempotency_release(items[i]->idempotency_key);
+
+			if (failed++ == 0)
+				error = MemoryContextStrdup(oldcxt, items[i]->error);
+		}
+		else if (items[i]->idempotency_key)
+			idempotency_confirm(items[i]->idempotency_key);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	MemoryContextReset(batch_cxt);
+	batch_items = NIL;
+	batch_url = NULL;
+
+	if (failed > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot send %d of %d mails of batch", failed, nitems),
+				 errdetail("%s", error)));
+}
+
+/*
+ * Finishes the batch. The mails, that were not sent by mail_batch_flush,
+ * are discarded (their keys are released by abort of transaction).
+ */
+void
+mail_batch_end(void)
+{
+	if (batch_cxt)
+	{
+		MemoryContextDelete(batch_cxt);
+		batch_cxt = NULL;
+		batch_items = NIL;
+		batch_url = NULL;
+	}
+}
+
+/*
+ * Sends the message. The attachment can be compressed (when att_compress
+ * is not NULL), or it can be generated by query or read from file (when
+ * msg->att_source is not NULL) while the message is sent.
+ *
+ * The caller should run in memory context of send (see call_in_send_context),
+ * so all memory of send is released after send.
+ */
+void
+send_mail_message(MailMessage *msg, char *att_compress, char *idempotency_key)
+{
+	char	   *envelope_from;
+	List	   *envelope;
+	char	   *data;
+	size_t		size;
+	const MailTransport *transport;
+
+	if (!check_priv_of_role(&ORAFCE_MAIL_ROLE_USE, "orafce_mail"))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be a member of the role \"orafce_mail\"")));
+
+	if (!orafce_smtp_url)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("orafce.smtp_url is not specified"),
+				 errdetail("The address (url) of smtp service is not known.")));
+
+	/*
+	 * The addresses are validated before any network work. All recipients
+	 * (To, Cc and Bcc) are in one envelope, so the message is uploaded only
+	 * once.
+	 */
+	envelope_from = envelope_sender(msg->sender);
+	envelope = envelope_recipients(msg);
+
+	transport = get_transport(orafce_smtp_url);
+
+	/*
+	 * Duplicates are dropped before any network work. The spool file
+	 * is delivered only when the transaction is committed, so its key
+	 * is released by abort. The key of mail sent directly is kept after
+	 * successful send.
+	 */
+	if (idempotency_key && !idempotency_claim(idempotency_key, transport->transactional))
+	{
+		ereport(DEBUG1,
+				(errmsg("mail with idempotency key \"%s\" was already sent",
+						idempotency_key)));
+		return;
+	}
+
+	PG_TRY();
+	{
+		MessageStream *stream = NULL;
+
+		/* the recipients are read from headers, when envelope is not sent */
+		msg->bcc_header = transport->bcc_header && transport->bcc_header();
+
+		/* the attachment is compressed while the message is sent */
+		if (att_compress)
+			compress_attachment(msg, att_compress);
+
+		/*
+		 * The DKIM signature requires whole body before the message is sent,
+		 * so then the attachment generated while sending is read to memory.
+		 */
+		if (msg->att_source && dkim_configured())
+			materialize_attachment(msg, message_size_limit());
+
+		/*
+		 * The message (without attachment generated while sending) is
+		 * composed before transport is started, so the size of sent data
+		 * is known, and the upload is seekable. The size is checked before
+		 * the content is encoded.
+		 */
+		data = compose_message(msg, 0, message_size_limit(), &size);
+
+		/*
+		 * The attachment generated by query, read from file or compressed
+		 * attachment is inserted to composed message while the message is
+		 * sent, so the data are read only when the transport asks for more
+		 * data.
+		 */
+		if (msg->att_source)
+		{
+			stream = attachment_stream(msg->att_source, data, size, msg->att_offset);
+			stream->max_size = message_size_limit();
+		}
+
+		/* the mail of batch is sent later, together with other mails */
+		if (batch_cxt && transport->send_batch && !stream)
+		{
+			mail_batch_add(envelope_from, envelope, data, size, idempotency_key);
+		}
+		else
+		{
+			transport->send(orafce_smtp_url, envelope_from, envelope, data, size, stream);
+
+			if (idempotency_key && !transport->transactional)
+				idempotency_confirm(idempotency_key);
+		}
+	}
+	PG_CATCH();
+	{
+		if (idempotency_key)
+			idempotency_release(idempotency_key);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Calls the procedure, that sends mail, in own memory context of send.
+ * The copies of arguments (detoasted attachment), the composed message
+ * and buffers of transport are allocated there, so they are released
+ * after send, and they are counted by memory statistics.
+ */
+Datum
+call_in_send_context(PGFunction func, FunctionCallInfo fcinfo)
+{
+	MemoryContext send_cxt;
+	MemoryContext oldcxt;
+
+	send_cxt = send_memory_begin();
+	oldcxt = MemoryContextSwitchTo(send_cxt);
+
+	PG_TRY();
+	{
+		(void) func(fcinfo);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcxt);
+		send_memory_abort(send_cxt);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	send_memory_end(send_cxt);
+
+	return (Datum) 0;
+}
+
+void
+orafce_send_mail(char *sender,
+				 char *recipients,
+				 char *cc,
+				 char *bcc,
+				 char *subject,
+				 char *replyto,
+				 int priority,
+				 bool priority_is_null,
+				 char *message,
+				 char *mime_type,
+				 char *attachment_data,
+				 size_t attachment_size,
+				 char *att_mime_type,
+				 char *att_filename,
+				 bool att_is_text,
+				 bool att_inline,
+				 char *att_compress,
+				 char *idempotency_key)
+{
+	MailMessage msg;
+
+	memset(&msg, 0, sizeof(MailMessage));
+
+	msg.sender = sender;
+	msg.recipients = recipients;
+	msg.cc = cc;
+	msg.bcc = bcc;
+	msg.subject = subject;
+	msg.replyto = replyto;
+	msg.priority = priority;
+	msg.priority_is_null = priority_is_null;
+	msg.message = message;
+	msg.mime_type = mime_type;
+	msg.attachment_data = attachment_data;
+	msg.attachment_size = attachment_size;
+	msg.att_mime_type = att_mime_type;
+	msg.att_filename = att_filename;
+	msg.att_is_text = att_is_text;
+	msg.att_inline = att_inline;
+
+	send_mail_message(&msg, att_compress, idempotency_key);
+}
+
 /*
  *
  * PROCEDURE utl_mail.send(
@@ -713,8 +874,8 @@ orafce_send_mail(char *sender,
  * 		priority integer DEFAULT NULL)
  *
  */
-Datum
-orafce_mail_send(PG_FUNCTION_ARGS)
+static Datum
+mail_send(PG_FUNCTION_ARGS)
 {
 	char	   *sender;
 	char	   *recipients;
@@ -726,11 +887,12 @@ orafce_mail_send(PG_FUNCTION_ARGS)
 	volatile int priority = 0;
 	volatile bool priority_is_null = false;
 	char	   *replyto;
+	char	   *idempotency_key;
 
 	sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_attach_raw", "sender");
-	recipients = not_null_not_empty_arg(fcinfo, 1, "utl_mail.send_attach_raw", "recipients");
-	cc = null_or_empty_arg(fcinfo, 2);
-	bcc = null_or_empty_arg(fcinfo, 3);
+	recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.send_attach_raw", "recipients");
+	cc = recipients_arg(fcinfo, 2);
+	bcc = recipients_arg(fcinfo, 3);
 	subject = null_or_empty_arg(fcinfo, 4);
 	message = null_or_empty_arg(fcinfo, 5);
 	mime_type = null_or_empty_arg(fcinfo, 6);
@@ -741,6 +903,7 @@ orafce_mail_send(PG_FUNCTION_ARGS)
 		priority_is_null = true;
 
 	replyto = null_or_empty_arg(fcinfo, 8);
+	idempotency_key = null_or_empty_arg(fcinfo, 9);
 
 	orafce_send_mail(sender,
 					 recipients,
@@ -756,11 +919,20 @@ orafce_mail_send(PG_FUNCTION_ARGS)
 					 0,
 					 NULL,
 					 NULL,
-					 false);
+					 false,
+					 false,
+					 NULL,
+					 idempotency_key);
 
 	return (Datum) 0;
 }
 
+Datum
+orafce_mail_send(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send, fcinfo);
+}
+
 /*
  * PROCEDURE utl_mail.send_attach_raw(
  * 		sender varchar2,
@@ -777,8 +949,8 @@ orafce_mail_send(PG_FUNCTION_ARGS)
  * 		att_filename varchar2 DEFAULT NULL)
  *
  */
-Datum
-orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
+static Datum
+mail_send_attach_raw(PG_FUNCTION_ARGS)
 {
 	char	   *sender;
 	char	   *recipients;
@@ -790,16 +962,20 @@ orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
 	volatile int priority = 0;
 	char	   *att_mime_type;
 	char	   *att_filename;
+	bool		att_inline;
 	volatile bool priority_is_null = false;
+	Datum		attachment;
 	bytea	   *vlena;
 	char	   *attachment_data;
 	size_t		attachment_size;
 	char	   *replyto;
+	char	   *att_compress;
+	char	   *idempotency_key;
 
 	sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_attach_raw", "sender");
-	recipients = not_null_not_empty_arg(fcinfo, 1, "utl_mail.send_attach_raw", "recipients");
-	cc = null_or_empty_arg(fcinfo, 2);
-	bcc = null_or_empty_arg(fcinfo, 3);
+	recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.send_attach_raw", "recipients");
+	cc = recipients_arg(fcinfo, 2);
+	bcc = recipients_arg(fcinfo, 3);
 	subject = null_or_empty_arg(fcinfo, 4);
 	message = null_or_empty_arg(fcinfo, 5);
 	mime_type = null_or_empty_arg(fcinfo, 6);
@@ -809,14 +985,21 @@ orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
 	else
 		priority_is_null = true;
 
-	vlena = DatumGetByteaPP(not_null_arg(fcinfo, 8, "utl_mail.send_attach_raw", "attachment"));
+	att_compress = null_or_empty_arg(fcinfo, 14);
+
+	attachment = not_null_arg(fcinfo, 8, "utl_mail.send_attach_raw", "attachment");
+	precheck_attachment_size(attachment, message_size_limit(), att_compress != NULL);
+
+	vlena = DatumGetByteaPP(attachment);
 	attachment_data = VARDATA_ANY(vlena);
 	attachment_size = (size_t) VARSIZE_ANY_EXHDR(vlena);
 
+	att_inline = PG_ARGISNULL(9) ? true : PG_GETARG_BOOL(9);
 	att_mime_type = null_or_empty_arg(fcinfo, 10);
 	att_filename = null_or_empty_arg(fcinfo, 11);
 
 	replyto = null_or_empty_arg(fcinfo, 12);
+	idempotency_key = null_or_empty_arg(fcinfo, 13);
 
 	orafce_send_mail(sender,
 					 recipients,
@@ -832,11 +1015,20 @@ orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
 					 attachment_size,
 					 att_mime_type,
 					 att_filename,
-					 false);
+					 false,
+					 att_inline,
+					 att_compress,
+					 idempotency_key);
 
 	return (Datum) 0;
 }
 
+Datum
+orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send_attach_raw, fcinfo);
+}
+
 /*
  * PROCEDURE utl_mail.send_attach_varchar2(
  * 		sender varchar2,
@@ -853,8 +1045,8 @@ orafce_mail_send_attach_raw(PG_FUNCTION_ARGS)
  * 		att_filename varchar2 DEFAULT NULL)
  *
  */
-Datum
-orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
+static Datum
+mail_send_attach_varchar2(PG_FUNCTION_ARGS)
 {
 	char	   *sender;
 	char	   *recipients;
@@ -866,16 +1058,20 @@ orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
 	volatile int priority = 0;
 	char	   *att_mime_type;
 	char	   *att_filename;
+	bool		att_inline;
 	volatile bool priority_is_null = false;
+	Datum		attachment;
 	bytea	   *vlena;
 	char	   *attachment_data;
 	size_t		attachment_size;
 	char	   *replyto;
+	char	   *att_compress;
+	char	   *idempotency_key;
 
 	sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_attach_varchar2", "sender");
-	recipients = not_null_not_empty_arg(fcinfo, 1, "utl_mail.send_attach_varchar2", "recipients");
-	cc = null_or_empty_arg(fcinfo, 2);
-	bcc = null_or_empty_arg(fcinfo, 3);
+	recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.send_attach_varchar2", "recipients");
+	cc = recipients_arg(fcinfo, 2);
+	bcc = recipients_arg(fcinfo, 3);
 	subject = null_or_empty_arg(fcinfo, 4);
 	message = null_or_empty_arg(fcinfo, 5);
 	mime_type = null_or_empty_arg(fcinfo, 6);
@@ -885,14 +1081,21 @@ orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
 	else
 		priority_is_null = true;
 
-	vlena = DatumGetByteaPP(not_null_arg(fcinfo, 8, "utl_mail.send_attach_varchar2", "attachment"));
+	att_compress = null_or_empty_arg(fcinfo, 14);
+
+	attachment = not_null_arg(fcinfo, 8, "utl_mail.send_attach_varchar2", "attachment");
+	precheck_attachment_size(attachment, message_size_limit(), att_compress != NULL);
+
+	vlena = DatumGetByteaPP(attachment);
 	attachment_data = VARDATA_ANY(vlena);
 	attachment_size = (size_t) VARSIZE_ANY_EXHDR(vlena);
 
+	att_inline = PG_ARGISNULL(9) ? true : PG_GETARG_BOOL(9);
 	att_mime_type = null_or_empty_arg(fcinfo, 10);
 	att_filename = null_or_empty_arg(fcinfo, 11);
 
 	replyto = null_or_empty_arg(fcinfo, 12);
+	idempotency_key = null_or_empty_arg(fcinfo, 13);
 
 	orafce_send_mail(sender,
 					 recipients,
@@ -908,11 +1111,20 @@ orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
 					 attachment_size,
 					 att_mime_type,
 					 att_filename,
-					 true);
+					 true,
+					 att_inline,
+					 att_compress,
+					 idempotency_key);
 
 	return (Datum) 0;
 }
 
+Datum
+orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send_attach_varchar2, fcinfo);
+}
+
 /*
  * PROCEDURE dbms_mail.send(
  * 		from_str varchar2,
@@ -924,8 +1136,8 @@ orafce_mail_send_attach_varchar2(PG_FUNCTION_ARGS)
  * 		body varchar2)
  *
  */
-Datum
-orafce_mail_dbms_mail_send(PG_FUNCTION_ARGS)
+static Datum
+dbms_mail_send(PG_FUNCTION_ARGS)
 {
 	char	   *sender;
 	char	   *recipients;
@@ -957,13 +1169,53 @@ orafce_mail_dbms_mail_send(PG_FUNCTION_ARGS)
 					 0,
 					 NULL,
 					 NULL,
-					 false);
+					 false,
+					 false,
+					 NULL,
+					 NULL);
 
 	return (Datum) 0;
 }
 
+Datum
+orafce_mail_dbms_mail_send(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(dbms_mail_send, fcinfo);
+}
+
 static bool
 smtp_server_url_acl_check(char **newval, void **extra, GucSource source)
+{
+	(void) extra;
+	(void) source;
+
+	if (!check_priv_of_role(&ORAFCE_MAIL_ROLE_CONFIG_URL,
+							"orafce_mail_config_url"))
+	{
+		GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+		GUC_check_errmsg("must be a member of the role \"orafce_mail_config_url\"");
+
+		return false;
+	}
+
+	/*
+	 * The spool directory is written by postgres process, so it
+	 * requires same rights like writing to server files.
+	 */
+	if (*newval && strncmp(*newval, "file://", 7) == 0 &&
+		!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+	{
+		GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+		GUC_check_errmsg("must be a member of the role \"pg_write_server_files\" to use spool directory");
+
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+smtp_server_unix_socket_acl_check(char **newval, void **extra, GucSource source)
 {
 	(void) newval;
 	(void) extra;
@@ -1000,6 +1252,25 @@ smtp_server_userpwd_acl_check(char **newval, void **extra, GucSource source)
 	return true;
 }
 
+static bool
+dkim_acl_check(char **newval, void **extra, GucSource source)
+{
+	(void) newval;
+	(void) extra;
+	(void) source;
+
+	if (!check_priv_of_role(&ORAFCE_MAIL_ROLE_CONFIG_URL,
+							"orafce_mail_config_url"))
+	{
+		GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+		GUC_check_errmsg("must be a member of the role \"orafce_mail_config_url\"");
+
+		return false;
+	}
+
+	return true;
+}
+
 void
 _PG_init(void)
 {
@@ -1024,9 +1295,101 @@ _PG_init(void)
 									smtp_server_userpwd_acl_check,
 									NULL, NULL);
 
+	DefineCustomStringVariable("orafce_mail.smtp_server_unix_socket",
+									"path of unix domain socket of local smtp or lmtp server.",
+									NULL,
+									&orafce_smtp_unix_socket,
+									NULL,
+									PGC_USERSET,
+									0,
+									smtp_server_unix_socket_acl_check,
+									NULL, NULL);
+
+	DefineCustomEnumVariable("orafce_mail.smtp_engine",
+							 "implementation of smtp client used for sending mails.",
+							 NULL,
+							 &orafce_smtp_engine,
+							 SMTP_ENGINE_CURL,
+							 smtp_engine_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("orafce_mail.idempotency_window",
+							"time for which the idempotency key of sent mail is remembered.",
+							NULL,
+							&orafce_idempotency_window,
+							86400,
+							1, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("orafce_mail.idempotency_max_keys",
+							"maximum number of idempotency keys stored in shared memory.",
+							NULL,
+							&orafce_idempotency_max_keys,
+							10000,
+							100, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("orafce_mail.max_message_size",
+							"maximal size of composed message (0 is unlimited).",
+							NULL,
+							&orafce_max_message_size,
+							0,
+							0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("orafce_mail.http_payload_format",
+							 "format of message sent to http server (raw message or json with envelope).",
+							 NULL,
+							 &orafce_http_payload_format,
+							 HTTP_PAYLOAD_RAW,
+							 http_payload_format_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomStringVariable("orafce_mail.dkim_domain",
+							   "domain used for DKIM signing (signing is disabled when it is not set).",
+							   NULL,
+							   &orafce_dkim_domain,
+							   NULL,
+							   PGC_USERSET,
+							   0,
+							   dkim_acl_check,
+							   NULL, NULL);
+
+	DefineCustomStringVariable("orafce_mail.dkim_selector",
+							   "selector of DKIM key.",
+							   NULL,
+							   &orafce_dkim_selector,
+							   NULL,
+							   PGC_USERSET,
+							   0,
+							   dkim_acl_check,
+							   NULL, NULL);
+
+	DefineCustomStringVariable("orafce_mail.dkim_private_key",
+							   "path of file with private key (PEM format) used for DKIM signing.",
+							   NULL,
+							   &orafce_dkim_private_key,
+							   NULL,
+							   PGC_SUSET,
+							   0,
+							   NULL, NULL, NULL);
+
 	EmitWarningsOnPlaceholders("orafce_mail");
 
-	curl_global_init(CURL_GLOBAL_ALL);
+	idempotency_init();
+	spool_init();
+
+	init_curl_memory();
 
 #if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
 
@@ -1052,5 +1415,8 @@ _PG_fini(void)
 
 #endif
 
+	if (curl_handle)
+		curl_easy_cleanup(curl_handle);
+
 	curl_global_cleanup();
 }
@@ -0,0 +1,262 @@
+#ifndef __ORAFCE_MAIL__
+#define __ORAFCE_MAIL__
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "nodes/pg_list.h"
+
+/*
+ * Compiled template
+ */
+typedef struct
+{
+	bool		is_param;
+	const char *str;			/* literal or placeholder's name */
+	size_t		len;
+} TemplateSegment;
+
+typedef struct
+{
+	bool		is_null;
+	int			nsegments;
+	TemplateSegment *segments;
+	size_t		literal_size;	/* total size of literal segments */
+} CompiledText;
+
+typedef struct
+{
+	char		name[NAMEDATALEN];	/* hash key */
+	MemoryContext mcxt;
+	char	   *sender;
+	char	   *mime_type;
+	char	   *replyto;
+	int			priority;
+	bool		priority_is_null;
+	CompiledText subject;
+	CompiledText message;
+} MailTemplate;
+
+/*
+ * Attachment, that is generated while the message is sent, so the size
+ * is not known in advance. The function read fills the buffer by next
+ * part of attachment (not encoded), and returns the number of bytes
+ * (0 at end of attachment). The data are sent base64 encoded.
+ */
+typedef struct AttachmentSource
+{
+	size_t		(*read) (struct AttachmentSource *source, char *buffer, size_t size);
+} AttachmentSource;
+
+/*
+ * Content of mail
+ */
+typedef struct
+{
+	char	   *sender;
+	char	   *recipients;
+	char	   *cc;
+	char	   *bcc;
+	char	   *subject;
+	char	   *replyto;
+	int			priority;
+	bool		priority_is_null;
+	char	   *message;
+	char	   *mime_type;
+	char	   *attachment_data;
+	size_t		attachment_size;
+	char	   *att_mime_type;
+	char	   *att_filename;
+	bool		att_is_text;
+	bool		att_inline;		/* Content-Disposition is inline */
+	bool		bcc_header;		/* write Bcc header (for spool) */
+	AttachmentSource *att_source;	/* attachment generated while sending */
+	size_t		att_offset;		/* position of attachment in composed message */
+} MailMessage;
+
+/*
+ * Message, that is generated while it is sent, so the size is not known
+ * in advance. The function read fills the buffer by next part of message,
+ * and returns the number of bytes (0 at end of message).
+ */
+typedef struct MessageStream
+{
+	size_t		(*read) (struct MessageStream *stream, char *buffer, size_t size);
+	size_t		size;			/* already read bytes */
+	size_t		max_size;		/* 0 is unlimited */
+} MessageStream;
+
+/*
+ * The mail of batch, that is sent together with other mails of batch
+ * (concurrently). The error is NULL, when the mail was sent.
+ */
+typedef struct MailBatchItem
+{
+	char	   *sender;
+	List	   *envelope;
+	char	   *data;
+	size_t		size;
+	char	   *idempotency_key;
+	char	   *error;
+} MailBatchItem;
+
+/*
+ * State of DKIM signing of one message
+ */
+typedef struct DkimSigner DkimSigner;
+
+typedef enum
+{
+	SMTP_ENGINE_CURL,
+	SMTP_ENGINE_NATIVE
+} SmtpEngine;
+
+typedef enum
+{
+	HTTP_PAYLOAD_RAW,
+	HTTP_PAYLOAD_JSON
+} HttpPayloadFormat;
+
+/*
+ * Returns value of placeholder. Raises an error, when the value
+ * is not available.
+ */
+typedef const char *(*TemplateParamGetter) (void *arg, const char *name, size_t *len);
+
+/*
+ * GUC variables
+ */
+extern char *orafce_smtp_url;
+extern char *orafce_smtp_userpwd;
+extern char *orafce_smtp_unix_socket;
+extern int	orafce_smtp_engine;
+extern int	orafce_max_message_size;
+extern int	orafce_idempotency_window;
+extern int	orafce_idempotency_max_keys;
+extern char *orafce_dkim_domain;
+extern char *orafce_dkim_selector;
+extern char *orafce_dkim_private_key;
+extern int	orafce_http_payload_format;
+
+/*
+ * orafce_mail.c
+ */
+extern Datum not_null_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname);
+extern char *null_or_empty_arg(FunctionCallInfo fcinfo, int argno);
+extern char *not_null_not_empty_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname);
+extern size_t message_size_limit(void);
+extern void precheck_attachment_size(Datum attachment, size_t max_size, bool compressed);
+
+extern Datum call_in_send_context(PGFunction func, FunctionCallInfo fcinfo);
+extern void send_mail_message(MailMessage *msg, char *att_compress, char *idempotency_key);
+extern bool mail_batch_begin(void);
+extern void mail_batch_flush(void);
+extern void mail_batch_end(void);
+extern void orafce_send_mail(char *sender,
+							 char *recipients,
+							 char *cc,
+							 char *bcc,
+							 char *subject,
+							 char *replyto,
+							 int priority,
+							 bool priority_is_null,
+							 char *message,
+							 char *mime_type,
+							 char *attachment_data,
+							 size_t attachment_size,
+							 char *att_mime_type,
+							 char *att_filename,
+							 bool att_is_text,
+							 bool att_inline,
+							 char *att_compress,
+							 char *idempotency_key);
+
+/*
+ * address.c
+ */
+extern char *recipients_arg(FunctionCallInfo fcinfo, int argno);
+extern char *not_null_not_empty_recipients_arg(FunctionCallInfo fcinfo, int argno, const char *fcname, const char *argname);
+extern bool is_valid_address(const char *str, size_t len);
+extern char *envelope_sender(const char *sender);
+extern List *envelope_recipients(MailMessage *msg);
+
+/*
+ * compress.c
+ */
+extern void compress_attachment(MailMessage *msg, const char *method);
+extern size_t compressed_size_lower_bound(size_t size);
+
+/*
+ * compose.c
+ */
+extern char *compose_message(MailMessage *msg, size_t prefix, size_t max_size, size_t *size);
+extern void check_message_size(size_t size, size_t max_size);
+extern size_t read_message_stream(MessageStream *stream, char *buffer, size_t size);
+extern MessageStream *attachment_stream(AttachmentSource *source,
+										const char *message,
+										size_t size,
+										size_t att_offset);
+extern void materialize_attachment(MailMessage *msg, size_t max_size);
+extern size_t encode_base64_lines(const char *data, size_t size, char *buffer);
+extern size_t base64_encoded_size(size_t size);
+
+/*
+ * dkim.c
+ */
+extern bool dkim_configured(void);
+extern DkimSigner *dkim_begin(void);
+extern size_t dkim_header_size(DkimSigner *signer);
+extern void dkim_body_update(DkimSigner *signer, const char *data, size_t len);
+extern void dkim_sign(DkimSigner *signer, char *header, const char *message, size_t size);
+
+/*
+ * http.c
+ */
+extern void http_send_mail(const char *sender, List *envelope, const char *data, size_t size, MessageStream *stream);
+extern void http_send_batch(MailBatchItem **items, int nitems);
+
+/*
+ * idempotency.c
+ */
+extern void idempotency_init(void);
+extern bool idempotency_claim(const char *key, bool transactional);
+extern void idempotency_confirm(const char *key);
+extern void idempotency_release(const char *key);
+
+/*
+ * smtp.c
+ */
+extern void smtp_send_mail(const char *sender, List *envelope, const char *data, size_t size, MessageStream *stream);
+extern size_t smtp_server_max_size(void);
+
+/*
+ * spool.c
+ */
+extern void spool_init(void);
+extern void spool_send_mail(const char *dir, const char *data, size_t size, MessageStream *stream);
+
+/*
+ * memory.c
+ */
+extern void init_curl_memory(void);
+extern MemoryContext send_memory_begin(void);
+extern void send_memory_sample(size_t extra_bytes);
+extern void send_memory_end(MemoryContext send_cxt);
+extern void send_memory_abort(MemoryContext send_cxt);
+extern size_t context_allocated(MemoryContext context);
+
+/*
+ * template.c
+ */
+extern MailTemplate *get_template(const char *name);
+extern char *render_compiled_text(CompiledText *ct, TemplateParamGetter getter, void *arg);
+extern void send_template(MailTemplate *template,
+						  char *sender,
+						  char *recipients,
+						  char *cc,
+						  char *bcc,
+						  TemplateParamGetter getter,
+						  void *arg,
+						  char *idempotency_key);
+
+#endif
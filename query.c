@@ -0,0 +1,332 @@
+/*
+ * Attachments generated by query
+ *
+ * The result of query is sent as CSV attachment. The result is not
+ * materialized. The rows are fetched from portal only when the transport
+ * asks for more data, they are formatted to CSV, and the composer's stream
+ * encodes these data and inserts them to the composed message on the place
+ * of the attachment.
+ */
+#include "postgres.h"
+
+#include "access/tupdesc.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/portal.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_send_attach_query);
+
+/* number of rows fetched from portal by one fetch */
+#define QUERY_FETCH_ROWS		1000
+
+typedef struct QueryAttachment
+{
+	AttachmentSource source;	/* must be first */
+	Portal		portal;
+	int			natts;
+	FmgrInfo   *outfuncs;
+	MemoryContext batch_cxt;
+	StringInfoData csv;			/* CSV data not read yet */
+	int			csv_pos;
+	bool		eof;			/* all rows were fetched */
+} QueryAttachment;
+
+/*
+ * Appends value in CSV format. The value is quoted when it contains
+ * separator, quote or line end, or when it is empty string (so it can
+ * be distinguished from NULL).
+ */
+static void
+append_csv_value(StringInfo str, const char *value)
+{
+	const char *ptr;
+	bool		need_quotes = *value == '\0';
+
+	for (ptr = value; *ptr && !need_quotes; ptr++)
+	{
+		if (*ptr == ',' || *ptr == '"' || *ptr == '\r' || *ptr == '\n')
+			need_quotes = true;
+	}
+
+	if (!need_quotes)
+	{
+		appendStringInfoString(str, value);
+		return;
+	}
+
+	appendStringInfoChar(str, '"');
+
+	for (ptr = value; *ptr; ptr++)
+	{
+		if (*ptr == '"')
+			appendStringInfoChar(str, '"');
+
+		appendStringInfoChar(str, *ptr);
+	}
+
+	appendStringInfoChar(str, '"');
+}
+
+static void
+append_csv_header(QueryAttachment *qa, TupleDesc tupdesc)
+{
+	int			i;
+	bool		first = true;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+		if (attr->attisdropped)
+			continue;
+
+		if (!first)
+			appendStringInfoChar(&qa->csv, ',');
+
+		append_csv_value(&qa->csv, NameStr(attr->attname));
+		first = false;
+	}
+
+	appendStringInfoString(&qa->csv, "\r\n");
+}
+
+static void
+append_csv_row(QueryAttachment *qa, HeapTuple tuple, TupleDesc tupdesc)
+{
+	int			i;
+	bool		first = true;
+
+	for (i = 0; i < qa->natts; i++)
+	{
+		Datum		value;
+		bool		isnull;
+
+		if (TupleDescAttr(tupdesc, i)->attisdropped)
+			continue;
+
+		if (!first)
+			appendStringInfoChar(&qa->csv, ',');
+
+		value = SPI_getbinval(tuple, tupdesc, i + 1, &isnull);
+
+		/* NULL is empty not quoted value */
+		if (!isnull)
+			append_csv_value(&qa->csv, OutputFunctionCall(&qa->outfuncs[i], value));
+
+		first = false;
+	}
+
+	appendStringInfoString(&qa->csv, "\r\n");
+}
+
+/*
+ * Fetches next batch of rows, and formats them to CSV
+ */
+static void
+fetch_rows(QueryAttachment *qa)
+{
+	MemoryContext oldcxt;
+	uint64		i;
+
+	resetStringInfo(&qa->csv);
+	qa->csv_pos = 0;
+
+	SPI_cursor_fetch(qa->portal, true, QUERY_FETCH_ROWS);
+
+	if (SPI_processed == 0)
+		qa->eof = true;
+
+	/* the fetched rows and executor are not in memory context of send */
+	send_memory_sample(context_allocated(SPI_tuptable->tuptabcxt) +
+					   context_allocated(qa->portal->portalContext));
+
+	oldcxt = MemoryContextSwitchTo(qa->batch_cxt);
+
+	for (i = 0; i < SPI_processed; i++)
+		append_csv_row(qa, SPI_tuptable->vals[i], SPI_tuptable->tupdesc);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(qa->batch_cxt);
+
+	SPI_freetuptable(SPI_tuptable);
+
+	CHECK_FOR_INTERRUPTS();
+}
+
+static size_t
+read_query_attachment(AttachmentSource *source, char *buffer, size_t size)
+{
+	QueryAttachment *qa = (QueryAttachment *) source;
+	size_t		result = 0;
+
+	while (result < size)
+	{
+		size_t		len;
+
+		if (qa->csv_pos == qa->csv.len)
+		{
+			if (qa->eof)
+				break;
+
+			fetch_rows(qa);
+			continue;
+		}
+
+		len = Min((size_t) (qa->csv.len - qa->csv_pos), size - result);
+		memcpy(buffer + result, qa->csv.data + qa->csv_pos, len);
+		qa->csv_pos += len;
+		result += len;
+	}
+
+	return result;
+}
+
+static QueryAttachment *
+create_query_attachment(Portal portal, bool header)
+{
+	QueryAttachment *qa = palloc0(sizeof(QueryAttachment));
+	TupleDesc	tupdesc = portal->tupDesc;
+	int			i;
+
+	qa->portal = portal;
+	qa->natts = tupdesc->natts;
+	qa->outfuncs = palloc(sizeof(FmgrInfo) * qa->natts);
+
+	for (i = 0; i < qa->natts; i++)
+	{
+		Oid			typoutput;
+		bool		typisvarlena;
+
+		getTypeOutputInfo(TupleDescAttr(tupdesc, i)->atttypid,
+						  &typoutput, &typisvarlena);
+		fmgr_info(typoutput, &qa->outfuncs[i]);
+	}
+
+	qa->batch_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										  "orafce_mail query attachment",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	initStringInfo(&qa->csv);
+	qa->csv_pos = 0;
+
+	qa->source.read = read_query_attachment;
+
+	if (header)
+		append_csv_header(qa, tupdesc);
+
+	return qa;
+}
+
+/*
+ * PROCEDURE utl_mail.send_attach_query(
+ * 		sender varchar2,
+ * 		recipients varchar2,
+ * 		cc varchar2 DEFAULT NULL,
+ * 		bcc varchar2 DEFAULT NULL,
+ * 		subject varchar2 DEFAULT NULL,
+ * 		message varchar2 DEFAULT NULL,
+ * 		mime_type varchar2 DEFAULT NULL,
+ * 		priority integer DEFAULT NULL,
+ * 		query text DEFAULT NULL,
+ * 		format varchar2 DEFAULT 'csv',
+ * 		header boolean DEFAULT true,
+ * 		att_inline boolean DEFAULT true,
+ * 		att_mime_type varchar2 DEFAULT NULL,
+ * 		att_filename varchar2 DEFAULT 'query.csv',
+ * 		replyto varchar2 DEFAULT NULL,
+ * 		idempotency_key varchar2 DEFAULT NULL)
+ *
+ * The result of query is sent as CSV attachment. The rows are fetched
+ * by cursor while the message is sent.
+ */
+static Datum
+mail_send_attach_query(PG_FUNCTION_ARGS)
+{
+	MailMessage msg;
+	char	   *query;
+	char	   *format;
+	bool		header;
+	char	   *idempotency_key;
+	SPIPlanPtr	plan;
+	Portal		portal;
+	MemoryContext send_cxt = CurrentMemoryContext;
+
+	memset(&msg, 0, sizeof(MailMessage));
+
+	msg.sender = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_attach_query", "sender");
+	msg.recipients = not_null_not_empty_recipients_arg(fcinfo, 1, "utl_mail.send_attach_query", "recipients");
+	msg.cc = recipients_arg(fcinfo, 2);
+	msg.bcc = recipients_arg(fcinfo, 3);
+	msg.subject = null_or_empty_arg(fcinfo, 4);
+	msg.message = null_or_empty_arg(fcinfo, 5);
+	msg.mime_type = null_or_empty_arg(fcinfo, 6);
+
+	if (!PG_ARGISNULL(7))
+		msg.priority = PG_GETARG_INT32(7);
+	else
+		msg.priority_is_null = true;
+
+	query = not_null_not_empty_arg(fcinfo, 8, "utl_mail.send_attach_query", "query");
+	format = not_null_not_empty_arg(fcinfo, 9, "utl_mail.send_attach_query", "format");
+	header = DatumGetBool(not_null_arg(fcinfo, 10, "utl_mail.send_attach_query", "header"));
+
+	msg.att_inline = PG_ARGISNULL(11) ? true : PG_GETARG_BOOL(11);
+	msg.att_mime_type = null_or_empty_arg(fcinfo, 12);
+	msg.att_filename = null_or_empty_arg(fcinfo, 13);
+	msg.replyto = null_or_empty_arg(fcinfo, 14);
+	idempotency_key = null_or_empty_arg(fcinfo, 15);
+
+	if (pg_strcasecmp(format, "csv") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unsupported format \"%s\"", format),
+				 errhint("Only format \"csv\" is supported.")));
+
+	/* the values are in database encoding */
+	if (!msg.att_mime_type)
+	{
+		const char *charset = get_encoding_name_for_icu(GetDatabaseEncoding());
+
+		msg.att_mime_type = psprintf("text/csv; charset=\"%s\"",
+									 charset ? charset : GetDatabaseEncodingName());
+	}
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* the message is allocated in memory context of send, not in SPI's */
+	MemoryContextSwitchTo(send_cxt);
+
+	plan = SPI_prepare(query, 0, NULL);
+	if (!plan)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+	if (!SPI_is_cursor_plan(plan))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("query does not return rows")));
+
+	portal = SPI_cursor_open(NULL, plan, NULL, NULL, false);
+
+	msg.att_source = &create_query_attachment(portal, header)->source;
+
+	send_mail_message(&msg, NULL, idempotency_key);
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	return (Datum) 0;
+}
+
+Datum
+orafce_mail_send_attach_query(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send_attach_query, fcinfo);
+}
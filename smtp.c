@@ -0,0 +1,1254 @@
+/*
+ * Native SMTP and LMTP client
+ *
+ * libcurl's SMTP client sends MAIL FROM, every RCPT TO and DATA as separate
+ * round trips. This client uses ESMTP extensions PIPELINING (RFC 2920) and
+ * CHUNKING (RFC 3030), when they are advertised by server. Then the whole
+ * envelope is sent at once, and after its replies the body is sent by one
+ * BDAT command without dot-stuffing, so two round trips per mail are
+ * necessary. The body is not uploaded, when all recipients are refused.
+ * The connection is reused by following mails of the backend.
+ *
+ * This client is used for smtp:// and smtps:// urls, when
+ * orafce_mail.smtp_engine is "native", and for lmtp:// urls always (libcurl
+ * doesn't support LMTP (RFC 2033)). The connection can be established over
+ * unix domain socket (orafce_mail.smtp_server_unix_socket) or over TCP.
+ *
+ * The url has format proto://host[:port][/domain]. The domain is used as
+ * argument of EHLO (LHLO) command (local host name is used by default).
+ */
+#include "postgres.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/un.h>
+#endif
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+#define SMTP_TIMEOUT			300000		/* 5 minutes */
+#define SMTP_MAX_LINE			4096
+#define SMTP_FLUSH_SIZE			65536
+#define SMTP_WRITE_CHUNK		(1024 * 1024)
+
+#define SMTP_DEFAULT_PORT		"25"
+#define SMTPS_DEFAULT_PORT		"465"
+#define LMTP_DEFAULT_PORT		"24"
+
+/* ESMTP extensions advertised by server */
+#define SMTP_EXT_PIPELINING		0x01
+#define SMTP_EXT_CHUNKING		0x02
+#define SMTP_EXT_SIZE			0x04
+#define SMTP_EXT_8BITMIME		0x08
+#define SMTP_EXT_AUTH_PLAIN		0x10
+#define SMTP_EXT_AUTH_LOGIN		0x20
+
+#if PG_VERSION_NUM < 120000
+
+#define WL_EXIT_ON_PM_DEATH		WL_POSTMASTER_DEATH
+
+#endif
+
+typedef struct
+{
+	char	   *key;			/* url, socket path and credentials */
+	pgsocket	sock;
+	SSL		   *ssl;
+	bool		lmtp;
+	int			extensions;
+	size_t		max_size;		/* SIZE advertised by server, 0 is unlimited */
+	char		inbuf[8192];
+	int			inlen;
+	int			inpos;
+	StringInfoData outbuf;
+	StringInfoData line;
+	StringInfoData reply;		/* text of last reply, lines are separated by '\n' */
+} SmtpConn;
+
+/*
+ * The connection is reused by next mails, so the connection
+ * setup (greeting, EHLO, TLS handshake, AUTH) is done only once.
+ */
+static SmtpConn *smtp_conn = NULL;
+
+static SSL_CTX *ssl_ctx = NULL;
+
+/*
+ * Waits until socket is ready. The interrupts are processed.
+ */
+static void
+wait_socket(SmtpConn *conn, int event)
+{
+	for (;;)
+	{
+		int			rc;
+
+		rc = WaitLatchOrSocket(MyLatch,
+							   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH | event,
+							   conn->sock,
+							   SMTP_TIMEOUT,
+							   PG_WAIT_EXTENSION);
+
+#if PG_VERSION_NUM < 120000
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+#endif
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (rc & event)
+			return;
+
+		if (rc & WL_TIMEOUT)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("timeout while communicating with mail server")));
+	}
+}
+
+/*
+ * Waits for socket, when the TLS operation cannot be finished now.
+ * Returns false, when the error is not recoverable.
+ */
+static bool
+ssl_wait(SmtpConn *conn, int rc)
+{
+	switch (SSL_get_error(conn->ssl, rc))
+	{
+		case SSL_ERROR_WANT_READ:
+			wait_socket(conn, WL_SOCKET_READABLE);
+			return true;
+
+		case SSL_ERROR_WANT_WRITE:
+			wait_socket(conn, WL_SOCKET_WRITEABLE);
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static const char *
+ssl_errmessage(void)
+{
+	unsigned long err = ERR_get_error();
+	const char *errreason;
+
+	if (err == 0)
+		return "no SSL error reported";
+
+	errreason = ERR_reason_error_string(err);
+
+	return errreason ? errreason : "unknown SSL error";
+}
+
+/*
+ * Non blocking connect. Returns false and preserves errno, when
+ * the connection cannot be established.
+ */
+static bool
+try_connect(SmtpConn *conn, int family, struct sockaddr *addr, socklen_t addrlen)
+{
+	int			save_errno;
+
+	conn->sock = socket(family, SOCK_STREAM, 0);
+	if (conn->sock == PGINVALID_SOCKET)
+		return false;
+
+	if (!pg_set_noblock(conn->sock))
+		goto failed;
+
+	if (connect(conn->sock, addr, addrlen) < 0)
+	{
+		int			so_error = 0;
+		socklen_t	optlen = sizeof(so_error);
+
+		if (errno != EINPROGRESS && errno != EINTR)
+			goto failed;
+
+		wait_socket(conn, WL_SOCKET_WRITEABLE);
+
+		if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR,
+					   (char *) &so_error, &optlen) < 0)
+			goto failed;
+
+		if (so_error != 0)
+		{
+			errno = so_error;
+			goto failed;
+		}
+	}
+
+	return true;
+
+failed:
+	save_errno = errno;
+	closesocket(conn->sock);
+	conn->sock = PGINVALID_SOCKET;
+	errno = save_errno;
+
+	return false;
+}
+
+static void
+connect_unix(SmtpConn *conn, const char *path)
+{
+#ifndef WIN32
+
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unix domain socket path \"%s\" is too long", path)));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (!try_connect(conn, AF_UNIX, (struct sockaddr *) &addr, sizeof(addr)))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not connect to mail server on socket \"%s\": %m", path)));
+
+#else
+
+	(void) conn;
+	(void) path;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("unix domain sockets are not supported on this platform")));
+
+#endif
+}
+
+static void
+connect_tcp(SmtpConn *conn, const char *host, const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *ai;
+	int			rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(host, port, &hints, &addrs);
+	if (rc != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not translate host name \"%s\" to address: %s",
+						host, gai_strerror(rc))));
+
+	for (ai = addrs; ai; ai = ai->ai_next)
+	{
+		if (try_connect(conn, ai->ai_family, ai->ai_addr, ai->ai_addrlen))
+			break;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (conn->sock == PGINVALID_SOCKET)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not connect to mail server \"%s\" on port %s: %m",
+						host, port)));
+}
+
+/*
+ * TLS handshake. The certificate of server is verified against
+ * system's trusted certificates and host name. When the server is
+ * connected by unix domain socket and url has not host, then there is
+ * no name for SNI and for verification of name, and only the certificate
+ * chain is verified. The name is used only in error messages.
+ */
+static void
+start_tls(SmtpConn *conn, const char *host, const char *name)
+{
+	if (!ssl_ctx)
+	{
+		SSL_CTX    *ctx;
+
+		ctx = SSL_CTX_new(TLS_client_method());
+		if (!ctx)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("could not create SSL context: %s", ssl_errmessage())));
+
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+		if (SSL_CTX_set_default_verify_paths(ctx) != 1)
+		{
+			SSL_CTX_free(ctx);
+
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIG_FILE_ERROR),
+					 errmsg("could not load trusted certificates: %s", ssl_errmessage())));
+		}
+
+		ssl_ctx = ctx;
+	}
+
+	conn->ssl = SSL_new(ssl_ctx);
+	if (!conn->ssl ||
+		!SSL_set_fd(conn->ssl, conn->sock) ||
+		(*host && !SSL_set_tlsext_host_name(conn->ssl, host)) ||
+		(*host && !SSL_set1_host(conn->ssl, host)))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not initialize SSL connection: %s", ssl_errmessage())));
+
+	for (;;)
+	{
+		int			rc;
+
+		ERR_clear_error();
+
+		rc = SSL_connect(conn->ssl);
+		if (rc == 1)
+			break;
+
+		if (!ssl_wait(conn, rc))
+		{
+			long		verify_result = SSL_get_verify_result(conn->ssl);
+
+			if (verify_result != X509_V_OK)
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not verify certificate of mail server \"%s\"", name),
+						 errdetail("%s", X509_verify_cert_error_string(verify_result))));
+
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not establish SSL connection to mail server \"%s\": %s",
+							name, ssl_errmessage())));
+		}
+	}
+}
+
+static void
+conn_write(SmtpConn *conn, const char *data, size_t size)
+{
+	size_t		pos = 0;
+
+	while (pos < size)
+	{
+		int			len = (int) Min(size - pos, SMTP_WRITE_CHUNK);
+
+		if (conn->ssl)
+		{
+			int			rc;
+
+			ERR_clear_error();
+
+			rc = SSL_write(conn->ssl, data + pos, len);
+			if (rc <= 0)
+			{
+				if (ssl_wait(conn, rc))
+					continue;
+
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not send data to mail server: %s", ssl_errmessage())));
+			}
+
+			pos += rc;
+		}
+		else
+		{
+			ssize_t		rc;
+
+			rc = send(conn->sock, data + pos, len, 0);
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					wait_socket(conn, WL_SOCKET_WRITEABLE);
+					continue;
+				}
+
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not send data to mail server: %m")));
+			}
+
+			pos += rc;
+		}
+	}
+}
+
+static void
+conn_flush(SmtpConn *conn)
+{
+	conn_write(conn, conn->outbuf.data, conn->outbuf.len);
+
+	resetStringInfo(&conn->outbuf);
+}
+
+/*
+ * Fills input buffer
+ */
+static void
+conn_read(SmtpConn *conn)
+{
+	for (;;)
+	{
+		int			rc;
+
+		if (conn->ssl)
+		{
+			ERR_clear_error();
+
+			rc = SSL_read(conn->ssl, conn->inbuf, sizeof(conn->inbuf));
+			if (rc <= 0)
+			{
+				if (ssl_wait(conn, rc))
+					continue;
+
+				if (SSL_get_error(conn->ssl, rc) == SSL_ERROR_ZERO_RETURN)
+					rc = 0;
+				else
+					ereport(ERROR,
+							(errcode(ERRCODE_CONNECTION_FAILURE),
+							 errmsg("could not receive data from mail server: %s",
+									ssl_errmessage())));
+			}
+		}
+		else
+		{
+			rc = recv(conn->sock, conn->inbuf, sizeof(conn->inbuf), 0);
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					wait_socket(conn, WL_SOCKET_READABLE);
+					continue;
+				}
+
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not receive data from mail server: %m")));
+			}
+		}
+
+		if (rc == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("mail server closed the connection unexpectedly")));
+
+		conn->inlen = rc;
+		conn->inpos = 0;
+
+		return;
+	}
+}
+
+/*
+ * Reads one line of reply to conn->line. The CRLF is removed.
+ */
+static void
+read_line(SmtpConn *conn)
+{
+	resetStringInfo(&conn->line);
+
+	for (;;)
+	{
+		char	   *start;
+		char	   *lf;
+
+		if (conn->inpos >= conn->inlen)
+			conn_read(conn);
+
+		start = conn->inbuf + conn->inpos;
+		lf = memchr(start, '\n', conn->inlen - conn->inpos);
+
+		if (lf)
+		{
+			appendBinaryStringInfo(&conn->line, start, lf - start);
+			conn->inpos += lf - start + 1;
+
+			if (conn->line.len > 0 && conn->line.data[conn->line.len - 1] == '\r')
+				conn->line.data[--conn->line.len] = '\0';
+
+			return;
+		}
+
+		appendBinaryStringInfo(&conn->line, start, conn->inlen - conn->inpos);
+		conn->inpos = conn->inlen;
+
+		if (conn->line.len > SMTP_MAX_LINE)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("reply line of mail server is too long")));
+	}
+}
+
+/*
+ * Reads (multiline) reply and returns reply code. The text of
+ * reply is stored in conn->reply.
+ */
+static int
+read_reply(SmtpConn *conn)
+{
+	resetStringInfo(&conn->reply);
+
+	for (;;)
+	{
+		char	   *line;
+		int			code;
+
+		read_line(conn);
+		line = conn->line.data;
+
+		if (conn->line.len < 3 ||
+			!isdigit((unsigned char) line[0]) ||
+			!isdigit((unsigned char) line[1]) ||
+			!isdigit((unsigned char) line[2]) ||
+			(conn->line.len > 3 && line[3] != ' ' && line[3] != '-'))
+			ereport(ERROR,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("unexpected reply of mail server"),
+					 errdetail("Reply: \"%s\".", line)));
+
+		code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+		if (conn->reply.len > 0)
+			appendStringInfoChar(&conn->reply, '\n');
+
+		if (conn->line.len > 4)
+			appendStringInfoString(&conn->reply, line + 4);
+
+		if (conn->line.len == 3 || line[3] == ' ')
+			return code;
+	}
+}
+
+static void
+send_command(SmtpConn *conn, const char *cmd, const char *arg)
+{
+	appendStringInfoString(&conn->outbuf, cmd);
+
+	if (arg)
+		appendStringInfoString(&conn->outbuf, arg);
+
+	appendBinaryStringInfo(&conn->outbuf, "\r\n", 2);
+
+	conn_flush(conn);
+}
+
+static void
+reply_error(SmtpConn *conn, const char *cmd, int code)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+			 errmsg("cannot send mail"),
+			 errdetail("Mail server replied to %s: %d %s", cmd, code, conn->reply.data)));
+}
+
+static void
+expect_reply(SmtpConn *conn, const char *cmd, int expected)
+{
+	int			code = read_reply(conn);
+
+	if (code / 100 != expected / 100)
+		reply_error(conn, cmd, code);
+}
+
+/*
+ * Appends message data to output buffer. Lines starting with dot are
+ * doubled. The data can be passed in more parts, "line_start" holds
+ * the state between calls.
+ */
+static void
+append_dotstuffed(SmtpConn *conn, const char *data, size_t size, bool *line_start)
+{
+	const char *ptr = data;
+	const char *end = data + size;
+
+	/* every iteration processes one line */
+	while (ptr < end)
+	{
+		const char *start = ptr;
+
+		if (*line_start && *ptr == '.')
+			appendStringInfoChar(&conn->outbuf, '.');
+
+		while (ptr < end && *ptr != '\n')
+			ptr++;
+
+		if (ptr < end)
+			ptr++;
+
+		appendBinaryStringInfo(&conn->outbuf, start, ptr - start);
+
+		*line_start = ptr[-1] == '\n';
+
+		if (conn->outbuf.len >= SMTP_FLUSH_SIZE)
+			conn_flush(conn);
+	}
+}
+
+/*
+ * Finishes data by terminating sequence
+ */
+static void
+finish_dotstuffed(SmtpConn *conn, bool line_start)
+{
+	if (!line_start)
+		appendBinaryStringInfo(&conn->outbuf, "\r\n", 2);
+
+	appendBinaryStringInfo(&conn->outbuf, ".\r\n", 3);
+
+	conn_flush(conn);
+}
+
+/*
+ * Sends message data. Lines starting with dot are doubled, and the
+ * data are finished by terminating sequence.
+ */
+static void
+send_data_dotstuffed(SmtpConn *conn, const char *data, size_t size)
+{
+	bool		line_start = true;
+
+	append_dotstuffed(conn, data, size, &line_start);
+	finish_dotstuffed(conn, line_start);
+}
+
+/*
+ * Parse url in format proto://host[:port][/domain]. The returned strings
+ * are palloc'ed, host can be empty string.
+ */
+static void
+parse_url(const char *url, char **host, char **port, char **domain,
+		  const char *default_port)
+{
+	const char *ptr = strstr(url, "://");
+	const char *host_start;
+	const char *host_end;
+
+	ptr = ptr ? ptr + 3 : url;
+
+	if (*ptr == '[')
+	{
+		/* IPv6 address */
+		host_start = ++ptr;
+		while (*ptr && *ptr != ']')
+			ptr++;
+
+		host_end = ptr;
+
+		if (*ptr == ']')
+			ptr++;
+	}
+	else
+	{
+		host_start = ptr;
+		while (*ptr && *ptr != ':' && *ptr != '/')
+			ptr++;
+
+		host_end = ptr;
+	}
+
+	*host = pnstrdup(host_start, host_end - host_start);
+
+	if (*ptr == ':')
+	{
+		const char *port_start = ++ptr;
+
+		while (*ptr && *ptr != '/')
+			ptr++;
+
+		*port = pnstrdup(port_start, ptr - port_start);
+	}
+	else
+		*port = pstrdup(default_port);
+
+	if (*ptr == '/' && ptr[1])
+		*domain = pstrdup(ptr + 1);
+	else
+	{
+		char		hostname[256];
+
+		if (gethostname(hostname, sizeof(hostname)) != 0)
+			strcpy(hostname, "localhost");
+
+		hostname[sizeof(hostname) - 1] = '\0';
+
+		*domain = pstrdup(hostname);
+	}
+}
+
+static char *
+base64_str(const char *str, size_t len)
+{
+	char	   *result = palloc(4 * ((len + 2) / 3) + 1);
+
+	EVP_EncodeBlock((unsigned char *) result, (const unsigned char *) str, (int) len);
+
+	return result;
+}
+
+/*
+ * Reads the list of extensions from reply to EHLO. The maximal size
+ * of message is returned in "max_size" (0 when it is not limited).
+ */
+static int
+parse_extensions(const char *reply, size_t *max_size)
+{
+	int			extensions = 0;
+	const char *line = strchr(reply, '\n');
+
+	/* first line is greeting */
+	while (line)
+	{
+		const char *end;
+		size_t		len;
+
+		line++;
+		end = strchr(line, '\n');
+		len = end ? (size_t) (end - line) : strlen(line);
+
+#define IS_KEYWORD(kw) \
+	(len >= strlen(kw) && pg_strncasecmp(line, kw, strlen(kw)) == 0 && \
+	 (len == strlen(kw) || line[strlen(kw)] == ' '))
+
+		if (IS_KEYWORD("PIPELINING"))
+			extensions |= SMTP_EXT_PIPELINING;
+		else if (IS_KEYWORD("CHUNKING"))
+			extensions |= SMTP_EXT_CHUNKING;
+		else if (IS_KEYWORD("SIZE"))
+		{
+			extensions |= SMTP_EXT_SIZE;
+
+			/* "SIZE" without number or "SIZE 0" means no fixed limit */
+			if (len > 5)
+			{
+				char	   *value = pnstrdup(line + 5, len - 5);
+
+				*max_size = (size_t) strtoull(value, NULL, 10);
+				pfree(value);
+			}
+		}
+		else if (IS_KEYWORD("8BITMIME"))
+			extensions |= SMTP_EXT_8BITMIME;
+		else if (IS_KEYWORD("AUTH"))
+		{
+			char	   *mechanisms = pnstrdup(line + 4, len - 4);
+			char	   *tok;
+
+			for (tok = strtok(mechanisms, " "); tok; tok = strtok(NULL, " "))
+			{
+				if (pg_strcasecmp(tok, "PLAIN") == 0)
+					extensions |= SMTP_EXT_AUTH_PLAIN;
+				else if (pg_strcasecmp(tok, "LOGIN") == 0)
+					extensions |= SMTP_EXT_AUTH_LOGIN;
+			}
+
+			pfree(mechanisms);
+		}
+
+#undef IS_KEYWORD
+
+		line = end;
+	}
+
+	return extensions;
+}
+
+/*
+ * Authentication by user name and password in format username:password
+ */
+static void
+authenticate(SmtpConn *conn, const char *userpwd)
+{
+	const char *colon = strchr(userpwd, ':');
+	char	   *user;
+	char	   *password;
+	char	   *encoded;
+
+	user = colon ? pnstrdup(userpwd, colon - userpwd) : pstrdup(userpwd);
+	password = colon ? pstrdup(colon + 1) : pstrdup("");
+
+	if (conn->extensions & SMTP_EXT_AUTH_PLAIN)
+	{
+		StringInfoData str;
+
+		initStringInfo(&str);
+		appendStringInfoChar(&str, '\0');
+		appendStringInfoString(&str, user);
+		appendStringInfoChar(&str, '\0');
+		appendStringInfoString(&str, password);
+
+		encoded = base64_str(str.data, str.len);
+		send_command(conn, "AUTH PLAIN ", encoded);
+
+		pfree(str.data);
+	}
+	else if (conn->extensions & SMTP_EXT_AUTH_LOGIN)
+	{
+		send_command(conn, "AUTH LOGIN", NULL);
+		expect_reply(conn, "AUTH LOGIN", 334);
+
+		encoded = base64_str(user, strlen(user));
+		send_command(conn, encoded, NULL);
+		expect_reply(conn, "AUTH LOGIN", 334);
+		pfree(encoded);
+
+		encoded = base64_str(password, strlen(password));
+		send_command(conn, encoded, NULL);
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("mail server doesn't support authentication methods PLAIN or LOGIN")));
+
+	pfree(encoded);
+	pfree(user);
+	pfree(password);
+
+	expect_reply(conn, "AUTH", 235);
+}
+
+static void
+close_connection(SmtpConn *conn)
+{
+	if (conn->ssl)
+		SSL_free(conn->ssl);
+
+	if (conn->sock != PGINVALID_SOCKET)
+		closesocket(conn->sock);
+
+	pfree(conn->key);
+	pfree(conn->outbuf.data);
+	pfree(conn->line.data);
+	pfree(conn->reply.data);
+	pfree(conn);
+}
+
+/*
+ * Returns true, when the reused connection looks usable. The server
+ * should not send anything between mail transactions, so any data
+ * (usually 421 reply before timeout) or EOF means closed connection.
+ */
+static bool
+connection_is_alive(SmtpConn *conn)
+{
+	char		c;
+	ssize_t		rc;
+
+	if (conn->inpos < conn->inlen ||
+		(conn->ssl && SSL_pending(conn->ssl) > 0))
+		return false;
+
+	rc = recv(conn->sock, &c, 1, MSG_PEEK);
+	if (rc >= 0)
+		return false;
+
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * Opens the connection, and does EHLO and authentication
+ */
+static SmtpConn *
+open_connection(const char *key)
+{
+	SmtpConn   *conn;
+	MemoryContext oldcxt;
+	const char *default_port;
+	char	   *host;
+	char	   *port;
+	char	   *domain;
+	bool		use_ssl = false;
+	bool		lmtp = false;
+	int			code;
+
+	if (strncmp(orafce_smtp_url, "smtp://", 7) == 0)
+		default_port = SMTP_DEFAULT_PORT;
+	else if (strncmp(orafce_smtp_url, "smtps://", 8) == 0)
+	{
+		default_port = SMTPS_DEFAULT_PORT;
+		use_ssl = true;
+	}
+	else if (strncmp(orafce_smtp_url, "lmtp://", 7) == 0)
+	{
+		default_port = LMTP_DEFAULT_PORT;
+		lmtp = true;
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("protocol of url \"%s\" is not supported by native smtp engine",
+						orafce_smtp_url),
+				 errhint("Use protocol smtp://, smtps:// or lmtp://.")));
+
+	parse_url(orafce_smtp_url, &host, &port, &domain, default_port);
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+	conn = palloc0(sizeof(SmtpConn));
+	conn->key = pstrdup(key);
+	conn->sock = PGINVALID_SOCKET;
+	conn->lmtp = lmtp;
+
+	initStringInfo(&conn->outbuf);
+	initStringInfo(&conn->line);
+	initStringInfo(&conn->reply);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_TRY();
+	{
+		if (orafce_smtp_unix_socket)
+			connect_unix(conn, orafce_smtp_unix_socket);
+		else if (*host)
+			connect_tcp(conn, host, port);
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("host of mail server is not specified"),
+					 errhint("Specify host in url, or set orafce_mail.smtp_server_unix_socket.")));
+
+		if (use_ssl)
+			start_tls(conn, host, *host ? host : orafce_smtp_unix_socket);
+
+		expect_reply(conn, "connect", 220);
+
+		send_command(conn, lmtp ? "LHLO " : "EHLO ", domain);
+		code = read_reply(conn);
+
+		if (code / 100 == 2)
+			conn->extensions = parse_extensions(conn->reply.data, &conn->max_size);
+		else if (!lmtp)
+		{
+			/* very old server without ESMTP */
+			send_command(conn, "HELO ", domain);
+			expect_reply(conn, "HELO", 250);
+		}
+		else
+			reply_error(conn, "LHLO", code);
+
+		if (orafce_smtp_userpwd)
+			authenticate(conn, orafce_smtp_userpwd);
+	}
+	PG_CATCH();
+	{
+		close_connection(conn);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(host);
+	pfree(port);
+	pfree(domain);
+
+	return conn;
+}
+
+static void
+read_rcpt_reply(SmtpConn *conn, const char *address, int *accepted)
+{
+	int			code = read_reply(conn);
+
+	if (code / 100 == 2)
+		*accepted += 1;
+	else
+		ereport(WARNING,
+				(errmsg("recipient <%s> was rejected", address),
+				 errdetail("Mail server replied: %d %s", code, conn->reply.data)));
+}
+
+/*
+ * Sends streamed message. With CHUNKING every part of message is sent
+ * by one BDAT command, else the parts are sent after DATA command
+ * (the reply to DATA is read by this function).
+ */
+static void
+send_stream(SmtpConn *conn, MessageStream *stream, bool chunking, bool pipelining)
+{
+	char	   *buffer = palloc(SMTP_FLUSH_SIZE);
+	bool		line_start = true;
+	int			pending = 0;
+	size_t		n;
+
+	if (!chunking)
+		expect_reply(conn, "DATA", 354);
+
+	while ((n = read_message_stream(stream, buffer, SMTP_FLUSH_SIZE)) > 0)
+	{
+		if (chunking)
+		{
+			appendStringInfo(&conn->outbuf, "BDAT " UINT64_FORMAT "\r\n", (uint64) n);
+			appendBinaryStringInfo(&conn->outbuf, buffer, (int) n);
+			conn_flush(conn);
+
+			/* without pipelining, every BDAT should be confirmed */
+			if (pipelining)
+				pending += 1;
+			else
+				expect_reply(conn, "BDAT", 250);
+		}
+		else
+			append_dotstuffed(conn, buffer, n, &line_start);
+	}
+
+	if (chunking)
+	{
+		appendBinaryStringInfo(&conn->outbuf, "BDAT 0 LAST\r\n", 14);
+		conn_flush(conn);
+
+		/* replies to pipelined chunks are before reply to last chunk */
+		while (pending-- > 0)
+			expect_reply(conn, "BDAT", 250);
+	}
+	else
+		finish_dotstuffed(conn, line_start);
+
+	pfree(buffer);
+}
+
+/*
+ * Sends mail transaction. When the server supports PIPELINING, then
+ * MAIL FROM, all RCPT TO (and DATA) are sent together, and the replies
+ * are read after that. The message is sent after the replies to MAIL FROM
+ * and RCPT TO are read.
+ */
+static void
+mail_transaction(SmtpConn *conn,
+				 const char *sender,
+				 List *envelope,
+				 const char *data,
+				 size_t size,
+				 MessageStream *stream)
+{
+	bool		pipelining = (conn->extensions & SMTP_EXT_PIPELINING) != 0;
+	bool		chunking = (conn->extensions & SMTP_EXT_CHUNKING) != 0;
+	int			accepted = 0;
+	int			delivered = 0;
+	int			code = 0;
+	ListCell   *lc;
+	int			i;
+
+	if (stream)
+	{
+		/* the size of streamed message is checked while it is sent */
+		if (conn->max_size > 0 &&
+			(stream->max_size == 0 || conn->max_size < stream->max_size))
+			stream->max_size = conn->max_size;
+	}
+	else
+	{
+		/* don't upload the message, that will be refused by server */
+		check_message_size(size, conn->max_size);
+	}
+
+	appendStringInfo(&conn->outbuf, "MAIL FROM:<%s>", sender);
+
+	if ((conn->extensions & SMTP_EXT_SIZE) && !stream)
+		appendStringInfo(&conn->outbuf, " SIZE=" UINT64_FORMAT, (uint64) size);
+
+	if (conn->extensions & SMTP_EXT_8BITMIME)
+		appendStringInfoString(&conn->outbuf, " BODY=8BITMIME");
+
+	appendBinaryStringInfo(&conn->outbuf, "\r\n", 2);
+
+	if (!pipelining)
+	{
+		conn_flush(conn);
+		expect_reply(conn, "MAIL FROM", 250);
+	}
+
+	foreach(lc, envelope)
+	{
+		appendStringInfo(&conn->outbuf, "RCPT TO:<%s>\r\n", (char *) lfirst(lc));
+
+		if (!pipelining)
+		{
+			conn_flush(conn);
+			read_rcpt_reply(conn, (char *) lfirst(lc), &accepted);
+		}
+	}
+
+	/*
+	 * Without pipelining we know, if some recipient was accepted, and
+	 * we can stop before data are sent.
+	 */
+	if (!pipelining && accepted == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+				 errmsg("cannot send mail"),
+				 errdetail("No recipient was accepted by mail server.")));
+
+	/*
+	 * DATA can be the last command of pipelined group (RFC 2920), it is
+	 * refused by server, when no recipient is accepted. BDAT carries the
+	 * data, so it is sent after replies to MAIL FROM and RCPT TO are read,
+	 * and the message refused for all recipients is not uploaded.
+	 */
+	if (!chunking)
+		appendBinaryStringInfo(&conn->outbuf, "DATA\r\n", 6);
+
+	conn_flush(conn);
+
+	if (pipelining)
+	{
+		expect_reply(conn, "MAIL FROM", 250);
+
+		foreach(lc, envelope)
+			read_rcpt_reply(conn, (char *) lfirst(lc), &accepted);
+
+		if (accepted == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					 errmsg("cannot send mail"),
+					 errdetail("No recipient was accepted by mail server.")));
+	}
+
+	if (stream)
+		send_stream(conn, stream, chunking, pipelining);
+	else if (chunking)
+	{
+		appendStringInfo(&conn->outbuf, "BDAT " UINT64_FORMAT " LAST\r\n", (uint64) size);
+
+		/* large data are sent directly from buffer, without copying */
+		if (size < SMTP_FLUSH_SIZE)
+		{
+			appendBinaryStringInfo(&conn->outbuf, data, (int) size);
+			conn_flush(conn);
+		}
+		else
+		{
+			conn_flush(conn);
+			conn_write(conn, data, size);
+		}
+	}
+	else
+	{
+		expect_reply(conn, "DATA", 354);
+		send_data_dotstuffed(conn, data, size);
+	}
+
+	if (conn->lmtp)
+	{
+		/* LMTP server returns one reply for every accepted recipient */
+		for (i = 0; i < accepted; i++)
+		{
+			code = read_reply(conn);
+			if (code / 100 == 2)
+				delivered += 1;
+			else
+				ereport(WARNING,
+						(errmsg("mail was not delivered to some recipient"),
+						 errdetail("Mail server replied: %d %s", code, conn->reply.data)));
+		}
+
+		if (delivered == 0)
+			reply_error(conn, "end of data", code);
+	}
+	else
+		expect_reply(conn, chunking ? "BDAT" : "end of data", 250);
+}
+
+static char *
+connection_key(void)
+{
+	return psprintf("%s %s %s",
+					orafce_smtp_url,
+					orafce_smtp_unix_socket ? orafce_smtp_unix_socket : "",
+					orafce_smtp_userpwd ? orafce_smtp_userpwd : "");
+}
+
+/*
+ * Returns maximal size of message advertised by server in reply
+ * to EHLO, when the connection for current settings is opened already.
+ * Returns 0, when the limit is not known.
+ */
+size_t
+smtp_server_max_size(void)
+{
+	char	   *key;
+	size_t		result = 0;
+
+	if (!smtp_conn || !orafce_smtp_url)
+		return 0;
+
+	key = connection_key();
+
+	if (strcmp(smtp_conn->key, key) == 0)
+		result = smtp_conn->max_size;
+
+	pfree(key);
+
+	return result;
+}
+
+/*
+ * Sends composed message by native smtp (lmtp) client. When stream
+ * is not NULL, then the message is read from stream.
+ */
+void
+smtp_send_mail(const char *sender, List *envelope, const char *data, size_t size,
+			   MessageStream *stream)
+{
+	char	   *key;
+
+	key = connection_key();
+
+	if (smtp_conn &&
+		(strcmp(smtp_conn->key, key) != 0 || !connection_is_alive(smtp_conn)))
+	{
+		close_connection(smtp_conn);
+		smtp_conn = NULL;
+	}
+
+	if (!smtp_conn)
+		smtp_conn = open_connection(key);
+
+	pfree(key);
+
+	PG_TRY();
+	{
+		mail_transaction(smtp_conn, sender, envelope, data, size, stream);
+	}
+	PG_CATCH();
+	{
+		/* don't reuse the connection after an error */
+		close_connection(smtp_conn);
+		smtp_conn = NULL;
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
@@ -0,0 +1,600 @@
+/*
+ * Spool (maildir) transport
+ *
+ * When orafce_mail.smtp_server_url is file:///path, then the composed
+ * message is written to file in path/tmp directory, and at commit time
+ * the file is moved to path/new directory (maildir convention). The
+ * local MTA can pick up these files asynchronously.
+ *
+ * The files sent by the transaction are synced before commit (an error
+ * aborts the transaction). The files are linked to new directory only
+ * after the commit is recorded, so the MTA cannot see the mail of aborted
+ * transaction (the transaction can be aborted in pre-commit after our
+ * callback, for example by serialization failure). The errors after
+ * commit cannot abort the transaction, so they are only reported as
+ * warnings, and the not linked file is left in tmp directory. After
+ * crash between commit and link, the mail of committed transaction is
+ * only in tmp directory too. When the transaction (or subtransaction) is
+ * aborted, the files are removed.
+ *
+ * When the extension is loaded by shared_preload_libraries, the fsyncs
+ * of target directory are shared by concurrent backends (group commit).
+ * The backend takes ticket after its links are created. Only one backend
+ * (leader) syncs the directory, and all backends with ticket taken before
+ * start of this fsync (followers) are done, when the leader finishes. The
+ * slot of group is selected by hash of directory path. When the slot is
+ * used by other directory, the directory is synced by backend alone.
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+#include "orafce_mail.h"
+
+#define SPOOL_STREAM_BUFFER_SIZE	(256 * 1024)
+
+#define SPOOL_SYNC_SLOTS			16
+
+typedef struct SpoolFile
+{
+	char	   *tmp_path;
+	char	   *new_path;
+	char	   *new_dir;
+	SubTransactionId subid;
+	struct SpoolFile *next;
+} SpoolFile;
+
+/*
+ * Group commit of fsync of one directory. The dir is assigned by first
+ * use, and it is not changed later. The completed is written only by
+ * leader (under lock).
+ */
+typedef struct
+{
+	LWLock	   *lock;
+	pg_atomic_uint32 dir_assigned;
+	pg_atomic_uint64 requested;
+	pg_atomic_uint64 completed;
+	char		dir[MAXPGPATH];
+} SpoolSyncSlot;
+
+typedef struct
+{
+	SpoolSyncSlot slots[SPOOL_SYNC_SLOTS];
+} SpoolSyncState;
+
+static SpoolFile *pending_files = NULL;
+static bool callbacks_registered = false;
+
+static SpoolSyncState *spool_sync_state = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+
+#endif
+
+static void
+spool_shmem_request(void)
+{
+
+#if PG_VERSION_NUM >= 150000
+
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SpoolSyncState)));
+	RequestNamedLWLockTranche("orafce_mail spool", SPOOL_SYNC_SLOTS);
+}
+
+static void
+spool_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	spool_sync_state = ShmemInitStruct("orafce_mail spool",
+									   sizeof(SpoolSyncState),
+									   &found);
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("orafce_mail spool");
+		int			i;
+
+		for (i = 0; i < SPOOL_SYNC_SLOTS; i++)
+		{
+			SpoolSyncSlot *slot = &spool_sync_state->slots[i];
+
+			slot->lock = &locks[i].lock;
+			pg_atomic_init_u32(&slot->dir_assigned, 0);
+			pg_atomic_init_u64(&slot->requested, 0);
+			pg_atomic_init_u64(&slot->completed, 0);
+			slot->dir[0] = '\0';
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Shared memory (for group commit) can be used only when extension
+ * is loaded by shared_preload_libraries.
+ */
+void
+spool_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = spool_shmem_request;
+
+#else
+
+	spool_shmem_request();
+
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = spool_shmem_startup;
+}
+
+/*
+ * Unique name of file in maildir format: time.MusecPpidQcounter.host
+ */
+static void
+make_unique_name(char *buffer, size_t size)
+{
+	static uint32 counter = 0;
+	struct timeval tv;
+	char		hostname[256];
+	char	   *ptr;
+
+	gettimeofday(&tv, NULL);
+
+	if (gethostname(hostname, sizeof(hostname)) != 0)
+		strcpy(hostname, "localhost");
+
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	/* chars '/' and ':' are not allowed in maildir file name */
+	for (ptr = hostname; *ptr; ptr++)
+	{
+		if (*ptr == '/' || *ptr == ':')
+			*ptr = '_';
+	}
+
+	snprintf(buffer, size, "%ld.M%06ldP%dQ%u.%s",
+			 (long) tv.tv_sec,
+			 (long) tv.tv_usec,
+			 MyProcPid,
+			 ++counter,
+			 hostname);
+}
+
+static void
+free_spool_file(SpoolFile *f)
+{
+	pfree(f->tmp_path);
+	pfree(f->new_path);
+	pfree(f->new_dir);
+	pfree(f);
+}
+
+/*
+ * We don't use fsync_fname, because it can PANIC when fsync fails,
+ * and failed fsync of spool file should not to stop the server. After
+ * commit the elevel should be WARNING, then false is returned on error.
+ */
+static bool
+fsync_path(const char *path, bool isdir, int elevel)
+{
+	int			fd;
+
+	fd = BasicOpenFile(path, (isdir ? O_RDONLY : O_RDWR) | PG_BINARY);
+	if (fd < 0)
+	{
+		/* some platforms don't allow to open directories */
+		if (isdir && (errno == EISDIR || errno == EACCES))
+			return true;
+
+		ereport(elevel,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+		return false;
+	}
+
+	if (pg_fsync(fd) != 0)
+	{
+		int			save_errno = errno;
+
+		close(fd);
+
+		/* some platforms don't allow fsync of directories */
+		if (isdir && (save_errno == EBADF || save_errno == EINVAL))
+			return true;
+
+		errno = save_errno;
+		ereport(elevel,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", path)));
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+/*
+ * Removes not committed files of subtransaction (or all files, when
+ * subid is InvalidSubTransactionId). It is called in abort, so only
+ * warnings can be raised.
+ */
+static void
+discard_files(SubTransactionId subid)
+{
+	SpoolFile **prev = &pending_files;
+	SpoolFile  *f = pending_files;
+
+	while (f)
+	{
+		SpoolFile  *next = f->next;
+
+		if (subid == InvalidSubTransactionId || f->subid == subid)
+		{
+			if (unlink(f->tmp_path) != 0 && errno != ENOENT)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						 errmsg("could not remove file \"%s\": %m", f->tmp_path)));
+
+			*prev = next;
+			free_spool_file(f);
+		}
+		else
+			prev = &f->next;
+
+		f = next;
+	}
+}
+
+/*
+ * Returns slot of group commit for directory, or NULL, when the directory
+ * should be synced alone.
+ */
+static SpoolSyncSlot *
+get_sync_slot(const char *dir)
+{
+	SpoolSyncSlot *slot;
+	uint32		hash = 5381;
+	const char *ptr;
+
+	if (!spool_sync_state || strlen(dir) >= MAXPGPATH)
+		return NULL;
+
+	for (ptr = dir; *ptr; ptr++)
+		hash = hash * 33 + (unsigned char) *ptr;
+
+	slot = &spool_sync_state->slots[hash % SPOOL_SYNC_SLOTS];
+
+	if (pg_atomic_read_u32(&slot->dir_assigned) == 0)
+	{
+		LWLockAcquire(slot->lock, LW_EXCLUSIVE);
+
+		if (pg_atomic_read_u32(&slot->dir_assigned) == 0)
+		{
+			strlcpy(slot->dir, dir, MAXPGPATH);
+			pg_write_barrier();
+			pg_atomic_write_u32(&slot->dir_assigned, 1);
+		}
+
+		LWLockRelease(slot->lock);
+	}
+
+	pg_read_barrier();
+
+	return strcmp(slot->dir, dir) == 0 ? slot : NULL;
+}
+
+/*
+ * Syncs directory after links are created. When the directory has slot
+ * of group commit, then fsync done by other backend, that started after
+ * our links were created, is enough. It is called after commit, so it
+ * cannot fail (errors are reported as warnings).
+ */
+static void
+sync_new_dir(const char *dir)
+{
+	SpoolSyncSlot *slot = get_sync_slot(dir);
+	uint64		ticket;
+	uint64		target;
+
+	if (!slot)
+	{
+		(void) fsync_path(dir, true, WARNING);
+		return;
+	}
+
+	ticket = pg_atomic_add_fetch_u64(&slot->requested, 1);
+
+	if (pg_atomic_read_u64(&slot->completed) >= ticket)
+		return;
+
+	/* wait for current leader */
+	LWLockAcquire(slot->lock, LW_EXCLUSIVE);
+
+	if (pg_atomic_read_u64(&slot->completed) >= ticket)
+	{
+		LWLockRelease(slot->lock);
+		return;
+	}
+
+	/* we are leader, and the fsync is done for all taken tickets */
+	target = pg_atomic_read_u64(&slot->requested);
+
+	/* after failed fsync the followers try it again as leaders */
+	if (fsync_path(dir, true, WARNING))
+		pg_atomic_write_u64(&slot->completed, target);
+
+	LWLockRelease(slot->lock);
+}
+
+/*
+ * Flushes data of all files before commit. An error aborts the
+ * transaction, and the files are removed.
+ */
+static void
+prepare_files(void)
+{
+	SpoolFile  *f;
+
+	for (f = pending_files; f; f = f->next)
+		(void) fsync_path(f->tmp_path, false, ERROR);
+}
+
+/*
+ * Links all files to target directories after commit, so the MTA can
+ * pick them up. The directories are flushed once after all links, and
+ * the names in tmp directory are removed. It cannot fail, the file, that
+ * cannot be linked, is left in tmp directory.
+ */
+static void
+commit_files(void)
+{
+	SpoolFile  *f;
+	char	   *synced_dir = NULL;
+
+	for (f = pending_files; f; f = f->next)
+	{
+		if (link(f->tmp_path, f->new_path) != 0)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not link file \"%s\" to \"%s\": %m",
+							f->tmp_path, f->new_path),
+					 errdetail("The mail of committed transaction is left in file \"%s\".",
+							   f->tmp_path)));
+
+			/* don't remove the only copy of mail */
+			f->tmp_path[0] = '\0';
+			continue;
+		}
+
+		if (!synced_dir || strcmp(synced_dir, f->new_dir) != 0)
+		{
+			/* all files are usually in one directory */
+			sync_new_dir(f->new_dir);
+			synced_dir = f->new_dir;
+		}
+	}
+
+	while (pending_files)
+	{
+		f = pending_files;
+
+		if (f->tmp_path[0] && unlink(f->tmp_path) != 0 && errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", f->tmp_path)));
+
+		pending_files = f->next;
+		free_spool_file(f);
+	}
+}
+
+static void
+spool_xact_callback(XactEvent event, void *arg)
+{
+	(void) arg;
+
+	if (!pending_files)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+			prepare_files();
+			break;
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			commit_files();
+			break;
+
+		case XACT_EVENT_PRE_PREPARE:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot PREPARE a transaction that has sent mails to spool directory")));
+			break;
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			discard_files(InvalidSubTransactionId);
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void
+spool_subxact_callback(SubXactEvent event,
+					   SubTransactionId mySubid,
+					   SubTransactionId parentSubid,
+					   void *arg)
+{
+	SpoolFile  *f;
+
+	(void) arg;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		discard_files(mySubid);
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		for (f = pending_files; f; f = f->next)
+		{
+			if (f->subid == mySubid)
+				f->subid = parentSubid;
+		}
+	}
+}
+
+static void
+write_data(int fd, const char *path, const char *data, size_t size)
+{
+	size_t		written = 0;
+
+	while (written < size)
+	{
+		ssize_t		rc;
+
+		rc = write(fd, data + written, size - written);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write to file \"%s\": %m", path)));
+		}
+
+		written += rc;
+	}
+}
+
+/*
+ * Writes message to dir/tmp. The file is linked to dir/new at commit.
+ * When stream is not NULL, then the message is read from stream.
+ */
+void
+spool_send_mail(const char *dir, const char *data, size_t size, MessageStream *stream)
+{
+	char		name[MAXPGPATH];
+	SpoolFile  *f;
+	int			fd;
+	MemoryContext oldcxt;
+
+	if (!is_absolute_path(dir))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("spool directory \"%s\" is not an absolute path", dir)));
+
+	if (!callbacks_registered)
+	{
+		RegisterXactCallback(spool_xact_callback, NULL);
+		RegisterSubXactCallback(spool_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+
+	make_unique_name(name, sizeof(name));
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+	f = palloc(sizeof(SpoolFile));
+	f->tmp_path = psprintf("%s/tmp/%s", dir, name);
+	f->new_path = psprintf("%s/new/%s", dir, name);
+	f->new_dir = psprintf("%s/new", dir);
+	f->subid = GetCurrentSubTransactionId();
+
+	MemoryContextSwitchTo(oldcxt);
+
+	fd = BasicOpenFile(f->tmp_path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY);
+	if (fd < 0)
+	{
+		int			save_errno = errno;
+		char	   *path = pstrdup(f->tmp_path);
+
+		free_spool_file(f);
+
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", path)));
+	}
+
+	/* from now, the file is removed on abort */
+	f->next = pending_files;
+	pending_files = f;
+
+#ifndef WIN32
+
+	/* the file should be readable by MTA (umask of postgres is 0077) */
+	(void) fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP);
+
+#endif
+
+	PG_TRY();
+	{
+		if (stream)
+		{
+			char	   *buffer = palloc(SPOOL_STREAM_BUFFER_SIZE);
+			size_t		n;
+
+			while ((n = read_message_stream(stream, buffer, SPOOL_STREAM_BUFFER_SIZE)) > 0)
+				write_data(fd, f->tmp_path, buffer, n);
+
+			pfree(buffer);
+		}
+		else
+			write_data(fd, f->tmp_path, data, size);
+	}
+	PG_CATCH();
+	{
+		close(fd);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* start writeback now, so the fsync at commit is faster */
+	pg_flush_data(fd, 0, 0);
+
+	if (close(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", f->tmp_path)));
+}
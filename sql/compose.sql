@@ -0,0 +1,26 @@
+\set VERBOSITY terse
+-- the attachment is inline by default
+select position(e'\r\nContent-Disposition: inline; filename="a.txt"\r\n' in
+                convert_from(utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                                              attachment => 'abc'::bytea,
+                                              att_filename => 'a.txt'), 'UTF8')) > 0 as inline;
+select position(e'\r\nContent-Disposition: attachment; filename="a.txt"\r\n' in
+                convert_from(utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                                              attachment => 'abc'::bytea,
+                                              att_inline => false,
+                                              att_filename => 'a.txt'), 'UTF8')) > 0 as attachment;
+-- the MIME boundary is random
+select substring(convert_from(utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                                               attachment => 'abc'::bytea), 'UTF8')
+                 from 'boundary="([^"]+)"') <>
+       substring(convert_from(utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                                               attachment => 'abc'::bytea), 'UTF8')
+                 from 'boundary="([^"]+)"') as random_boundary;
+-- non ASCII subject is encoded
+select convert_from(utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                                     subject => 'žluťoučký kůň'), 'UTF8')
+       ~ e'\r\nSubject: =\\?[^?]+\\?B\\?[A-Za-z0-9+/=]+\\?=\r\n' as encoded_subject;
+-- line breaks are not allowed in headers
+select utl_mail.compose('sender@example.com', 'rcpt@example.com',
+                        subject => e'test\r\nBcc: victim@example.com');
+select utl_mail.compose('sender@example.com', e'rcpt@example.com\nBcc: victim@example.com');
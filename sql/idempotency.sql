@@ -0,0 +1,31 @@
+\set VERBOSITY terse
+-- the extension is not loaded by shared_preload_libraries, so the keys
+-- are stored in table utl_mail.idempotency_key
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-1') is not null as queued;
+-- duplicate
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-1') is not null as queued;
+-- the key is released by rollback
+begin;
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-2') is not null as queued;
+rollback;
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-2') is not null as queued;
+-- and by rollback of subtransaction
+begin;
+savepoint s;
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-3') is not null as queued;
+rollback to s;
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        idempotency_key => 'key-3') is not null as queued;
+commit;
+-- the key of directly sent mail cannot be stored in table
+set orafce_mail.smtp_server_url to 'smtp://localhost:1';
+call utl_mail.send(sender => 'sender@example.com',
+                   recipients => 'rcpt@example.com',
+                   message => 'test',
+                   idempotency_key => 'key-4');
+reset orafce_mail.smtp_server_url;
@@ -0,0 +1,51 @@
+\set VERBOSITY terse
+-- valid addresses: dot-atom, quoted local part, host name, domain literal
+select address, utl_mail.is_valid_address(address) as valid
+  from (values ('user@example.com'),
+               ('first.last@example.com'),
+               ('user+tag@sub.example.com'),
+               ('user@localhost'),
+               ('"john doe"@example.com'),
+               ('"a\"b"@example.com'),
+               ('user@[192.0.2.1]'),
+               ('user@[IPv6:2001:db8::1]')) v(address);
+-- invalid addresses: dots at start, end or doubled, bad domain
+select address, utl_mail.is_valid_address(address) as valid
+  from (values ('.user@example.com'),
+               ('user.@example.com'),
+               ('us..er@example.com'),
+               ('"unterminated@example.com'),
+               ('user@'),
+               ('@example.com'),
+               ('user@-example.com'),
+               ('user@example-.com'),
+               ('user@example..com'),
+               ('user@example.com.'),
+               ('user@[192.0.2.1'),
+               ('user name@example.com'),
+               ('user@exa_mple.com'),
+               ('userexample.com')) v(address);
+-- limits of RFC 5321: local part 64, label 63, address 254 chars
+select utl_mail.is_valid_address(repeat('a', 64) || '@example.com') as local_part_64;
+select utl_mail.is_valid_address(repeat('a', 65) || '@example.com') as local_part_65;
+select utl_mail.is_valid_address('user@' || repeat('a', 63) || '.com') as label_63;
+select utl_mail.is_valid_address('user@' || repeat('a', 64) || '.com') as label_64;
+select utl_mail.is_valid_address(repeat('a', 64) || '@' || repeat('b', 63) || '.' || repeat('c', 63) || '.' || repeat('d', 61)) as address_254;
+select utl_mail.is_valid_address(repeat('a', 64) || '@' || repeat('b', 63) || '.' || repeat('c', 63) || '.' || repeat('d', 62)) as address_255;
+-- the addresses are validated before any network work, so the mail is
+-- not sent, when one recipient is invalid, although the other recipients
+-- are valid (the server can refuse some recipients by
+-- CURLOPT_MAIL_RCPT_ALLLOWFAILS, but not invalid addresses). Nothing
+-- listens on the port of url.
+set orafce_mail.smtp_server_url to 'smtp://127.0.0.1:1';
+call utl_mail.send('sender@example.com', 'us..er@example.com');
+call utl_mail.send('sender@example.com', 'ok@example.com, "Name" <bad@@example.com>');
+call utl_mail.send('sender@example.com', array['ok@example.com', 'user@example..com']);
+call utl_mail.send('sender@example.com', 'ok@example.com', bcc => 'user.@example.com');
+call utl_mail.send('bad sender', 'ok@example.com');
+call utl_mail.send('sender@example.com', 'Name <ok@example.com');
+call utl_mail.send('sender@example.com', ' , ');
+-- the empty sender would be null reverse-path
+call utl_mail.send(' ', 'ok@example.com');
+call utl_mail.send('"x" <>', 'ok@example.com');
+reset orafce_mail.smtp_server_url;
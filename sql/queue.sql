@@ -0,0 +1,15 @@
+\set VERBOSITY terse
+-- the attachment has same default MIME type like in utl_mail.send_attach_raw
+select utl_mail.enqueue('sender@example.com', 'rcpt@example.com',
+                        attachment => '\x00'::bytea) as id \gset
+select att_mime_type = 'application/octet' as default_type
+  from utl_mail.mail_queue
+ where id = :id;
+select status = 'p' as pending
+  from utl_mail.mail_queue_state
+ where id = :id;
+-- the state partitions are vacuumed by autovacuum
+select not coalesce('autovacuum_enabled=false' = any(c.reloptions), false) as autovacuum
+  from pg_inherits i join pg_class c on c.oid = i.inhrelid
+ where i.inhparent = 'utl_mail.mail_queue_state'::regclass
+ limit 1;
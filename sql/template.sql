@@ -0,0 +1,34 @@
+\set VERBOSITY terse
+call utl_mail.prepare_template(name => 'broken',
+                               subject => 'Hello {{name',
+                               message => 'test',
+                               sender => 'sender@example.com');
+call utl_mail.prepare_template(name => 'greeting',
+                               subject => 'Hello {{name}}',
+                               message => 'Dear {{ name }}',
+                               sender => 'sender@example.com');
+-- the message is rendered and composed before any network work
+set orafce_mail.smtp_server_url to 'smtp://localhost:1';
+call utl_mail.send_template(name => 'greeting',
+                            recipients => 'rcpt@example.com',
+                            params => '{}');
+-- the value of placeholder cannot inject header
+call utl_mail.send_template(name => 'greeting',
+                            recipients => 'rcpt@example.com',
+                            params => '{"name": "x\r\nBcc: victim@example.com"}');
+call utl_mail.drop_template('greeting');
+call utl_mail.send_template(name => 'greeting',
+                            recipients => 'rcpt@example.com',
+                            params => '{"name": "Pavel"}');
+-- the entry of dropped template is reused by next templates
+call utl_mail.prepare_template(name => 'reused', subject => 'first', message => 'test', sender => 'sender@example.com');
+call utl_mail.drop_template('reused');
+call utl_mail.prepare_template(name => 'reused', subject => 'second {{x}}', message => 'test', sender => 'sender@example.com');
+call utl_mail.prepare_template(name => 'other', subject => 'other {{y}}', message => 'test', sender => 'sender@example.com');
+-- replace of existing template
+call utl_mail.prepare_template(name => 'other', subject => 'replaced {{z}}', message => 'test', sender => 'sender@example.com');
+call utl_mail.send_template(name => 'reused', recipients => 'rcpt@example.com');
+call utl_mail.send_template(name => 'other', recipients => 'rcpt@example.com');
+call utl_mail.drop_template('reused');
+call utl_mail.drop_template('other');
+reset orafce_mail.smtp_server_url;
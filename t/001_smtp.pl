@@ -0,0 +1,581 @@
+# Tests of native smtp client against scripted smtp peer
+
+use strict;
+use warnings;
+
+use IO::Handle;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use Digest::SHA qw(sha256);
+use IO::Uncompress::Gunzip qw(gunzip);
+use IO::Uncompress::Unzip qw(unzip);
+use MIME::Base64;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+#
+# The peer logs every received command to file. When other commands
+# were received together with the command (pipelined), then the line
+# is marked by " +". The recipients with "reject" in address are refused.
+# Every received message is saved to file log.N. In LMTP mode the peer
+# replies to end of data for every accepted recipient (RFC 2033), and
+# refuses there the recipients with "refuse" in address. These replies
+# are logged too.
+#
+sub serve_client
+{
+	my ($client, $log, $extensions, $lmtp) = @_;
+	my $buf = '';
+	my $hello = $lmtp ? 'LHLO' : 'EHLO';
+	my @recipients;
+
+	my $fill = sub {
+		my $n = sysread($client, $buf, 65536, length($buf));
+		return defined($n) && $n > 0;
+	};
+
+	my $read_line = sub {
+		while ($buf !~ /\r\n/)
+		{
+			return undef unless $fill->();
+		}
+		$buf =~ s/^(.*?)\r\n//s;
+		return $1;
+	};
+
+	my $reply = sub { syswrite($client, join('', map { "$_\r\n" } @_)); };
+
+	my $message = '';
+	my $save_message = sub {
+		my $n = 1;
+
+		$n++ while -e "$log.$n";
+		open(my $mfh, '>', "$log.$n") or die "cannot open $log.$n: $!";
+		binmode($mfh);
+		print $mfh $message;
+		close($mfh);
+
+		$message = '';
+	};
+
+	open(my $fh, '>>', $log) or die "cannot open $log: $!";
+	$fh->autoflush(1);
+
+	# reply to end of data (to last BDAT)
+	my $data_reply = sub {
+		return $reply->('250 queued') unless $lmtp;
+
+		for my $rcpt (@recipients)
+		{
+			my $code = $rcpt =~ /refuse/ ? '550' : '250';
+
+			print $fh "REPLY $code\n";
+			$reply->($code eq '250' ? "250 $rcpt delivered" : "550 mailbox of $rcpt is full");
+		}
+		@recipients = ();
+	};
+
+	print $fh "CONNECT\n";
+	$reply->('220 peer ready');
+
+	while (defined(my $line = $read_line->()))
+	{
+		# the chunk of BDAT is logged after its data are read
+		print $fh $line, (length($buf) > 0 ? ' +' : ''), "\n"
+		  unless $line =~ /^BDAT /;
+
+		if ($line =~ /^$hello /)
+		{
+			my @lines = ('peer', @$extensions);
+			$reply->((map { "250-$_" } @lines[0 .. $#lines - 1]), "250 $lines[-1]");
+		}
+		elsif ($line =~ /^AUTH PLAIN /)
+		{
+			$reply->('235 authenticated');
+		}
+		elsif ($line =~ /^MAIL FROM:/)
+		{
+			@recipients = ();
+			$reply->('250 sender ok');
+		}
+		elsif ($line =~ /^RCPT TO:<([^>]*)>/)
+		{
+			if ($line =~ /reject/)
+			{
+				$reply->('550 no such user');
+			}
+			else
+			{
+				push(@recipients, $1);
+				$reply->('250 recipient ok');
+			}
+		}
+		elsif ($line eq 'DATA')
+		{
+			$reply->('354 go ahead');
+			while (defined(my $data = $read_line->()))
+			{
+				last if $data eq '.';
+				$data =~ s/^\.//;
+				$message .= "$data\r\n";
+			}
+			$save_message->();
+			print $fh "END OF DATA\n";
+			$data_reply->();
+		}
+		elsif ($line =~ /^BDAT (\d+)/)
+		{
+			my $size = $1;
+
+			while (length($buf) < $size)
+			{
+				last unless $fill->();
+			}
+			$message .= substr($buf, 0, $size, '');
+			print $fh $line, (length($buf) > 0 ? ' +' : ''), "\n";
+			if ($line =~ / LAST$/)
+			{
+				$save_message->();
+				$data_reply->();
+			}
+			else
+			{
+				$reply->('250 queued');
+			}
+		}
+		elsif ($line eq 'QUIT')
+		{
+			$reply->('221 bye');
+			last;
+		}
+		else
+		{
+			$reply->('250 ok');
+		}
+	}
+
+	close($fh);
+	close($client);
+}
+
+sub fork_peer
+{
+	my ($listen, $log, $extensions, $lmtp) = @_;
+
+	my $pid = fork();
+	die "cannot fork: $!" unless defined $pid;
+
+	if ($pid == 0)
+	{
+		while (my $client = $listen->accept())
+		{
+			serve_client($client, $log, $extensions, $lmtp);
+		}
+		exit(0);
+	}
+
+	return $pid;
+}
+
+sub start_peer
+{
+	my ($name, @extensions) = @_;
+	my $log = "$PostgreSQL::Test::Utils::tmp_check/smtp_$name.log";
+
+	my $listen = IO::Socket::INET->new(
+		LocalAddr => '127.0.0.1',
+		LocalPort => 0,
+		Listen => 5,
+		ReuseAddr => 1) or die "cannot listen: $!";
+
+	my $pid = fork_peer($listen, $log, \@extensions, 0);
+	my $port = $listen->sockport();
+	close($listen);
+
+	return { pid => $pid, port => $port, log => $log };
+}
+
+# LMTP peer listening on unix domain socket
+sub start_lmtp_peer
+{
+	my ($name, $path, @extensions) = @_;
+	my $log = "$PostgreSQL::Test::Utils::tmp_check/lmtp_$name.log";
+
+	my $listen = IO::Socket::UNIX->new(
+		Type => SOCK_STREAM(),
+		Local => $path,
+		Listen => 5) or die "cannot listen on $path: $!";
+
+	my $pid = fork_peer($listen, $log, \@extensions, 1);
+	close($listen);
+
+	return { pid => $pid, path => $path, log => $log };
+}
+
+sub stop_peer
+{
+	my ($peer) = @_;
+
+	kill('TERM', $peer->{pid});
+	waitpid($peer->{pid}, 0);
+}
+
+sub peer_log
+{
+	my ($peer) = @_;
+
+	return -e $peer->{log} ? slurp_file($peer->{log}) : '';
+}
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION orafce_mail CASCADE');
+
+sub peer_settings
+{
+	my ($peer) = @_;
+
+	return "set orafce_mail.smtp_engine to native;\n"
+	  . "set orafce_mail.smtp_server_url to 'smtp://127.0.0.1:$peer->{port}';\n"
+	  . "set orafce_mail.smtp_server_userpwd to 'user:secret';\n";
+}
+
+sub send_mails
+{
+	my ($peer, $recipients, $count) = @_;
+	my $sql = peer_settings($peer);
+
+	$sql .= "call utl_mail.send('sender\@example.com', '$recipients', subject => 'test', message => 'Hello');\n"
+	  for (1 .. $count);
+
+	return $node->psql('postgres', $sql);
+}
+
+# returns content type, file name and decoded content of attachment
+sub received_attachment
+{
+	my ($peer, $n) = @_;
+	my $message = slurp_file("$peer->{log}.$n");
+
+	$message =~ /boundary="([^"]+)"/ or return;
+	my $boundary = $1;
+
+	for my $part (split(/--\Q$boundary\E/, $message))
+	{
+		next unless $part =~ /Content-Disposition: \w+; filename="([^"]+)"/;
+		my $filename = $1;
+
+		$part =~ /Content-Type: ([^;\r\n]+)/;
+		my $type = $1;
+
+		$part =~ /\r\n\r\n(.*)/s;
+		return ($type, $filename, decode_base64($1));
+	}
+
+	return;
+}
+
+# relaxed header canonicalization (RFC 6376, 3.4.2)
+sub relaxed_header
+{
+	my ($field) = @_;
+	my ($name, $value) = split(/:/, $field, 2);
+
+	$name =~ s/[ \t]+//g;
+	$value =~ s/\r\n//g;
+	$value =~ s/[ \t]+/ /g;
+	$value =~ s/^ //;
+	$value =~ s/ $//;
+
+	return lc($name) . ':' . $value;
+}
+
+# relaxed body canonicalization (RFC 6376, 3.4.4)
+sub relaxed_body
+{
+	my ($body) = @_;
+
+	$body =~ s/[ \t]+/ /g;
+	$body =~ s/ (?=\r\n|\z)//g;
+	$body =~ s/(\r\n)*\z//;
+	$body .= "\r\n" if $body ne '';
+
+	return $body;
+}
+
+#
+# Returns tags of DKIM-Signature header, the canonicalized body, and the data
+# signed by b= (the signed headers and the signature header with empty b=).
+#
+sub dkim_parse
+{
+	my ($message) = @_;
+	my ($head, $body) = split(/\r\n\r\n/, $message, 2);
+	my @fields = split(/\r\n(?![ \t])/, $head);
+	my ($signature) = grep { /^DKIM-Signature:/i } @fields;
+	my %tags;
+	my $signed = '';
+
+	return unless $signature;
+
+	for my $tag (split(/;/, (split(/:/, $signature, 2))[1]))
+	{
+		$tag =~ s/\s+//g;
+		$tags{$1} = $2 if $tag =~ /^(\w+)=(.*)$/;
+	}
+
+	# the last instance of header is signed, the missing headers are skipped
+	for my $name (split(/:/, $tags{h}))
+	{
+		my ($field) = reverse grep { /^\Q$name\E[ \t]*:/i } @fields;
+
+		$signed .= relaxed_header($field) . "\r\n" if defined $field;
+	}
+
+	(my $unsigned = $signature) =~ s/([;\s]b=)[^;]*/$1/;
+	$signed .= relaxed_header($unsigned);
+
+	return (\%tags, relaxed_body($body // ''), $signed);
+}
+
+# verifies signature of sha256 digest of signed data by openssl
+sub dkim_verify
+{
+	my ($tags, $signed, $pubkey) = @_;
+	my $digest = "$PostgreSQL::Test::Utils::tmp_check/dkim_digest.bin";
+	my $sig = "$PostgreSQL::Test::Utils::tmp_check/dkim_sig.bin";
+
+	for ([ $digest, sha256($signed) ], [ $sig, decode_base64($tags->{b}) ])
+	{
+		open(my $fh, '>', $_->[0]) or die "cannot open $_->[0]: $!";
+		binmode($fh);
+		print $fh $_->[1];
+		close($fh);
+	}
+
+	# ed25519-sha256 is PureEdDSA of the digest (RFC 8463)
+	return run_log(
+		[
+			'openssl', 'pkeyutl', '-verify', '-pubin', '-inkey', $pubkey,
+			($tags->{a} eq 'ed25519-sha256' ? ('-rawin') : ('-pkeyopt', 'digest:sha256')),
+			'-in', $digest, '-sigfile', $sig
+		]);
+}
+
+my ($peer, $log, $ret, $stdout, $stderr);
+
+# PIPELINING and CHUNKING: envelope at once, the body by BDAT LAST
+$peer = start_peer('chunking', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN LOGIN', '8BITMIME');
+$ret = send_mails($peer, 'a@example.com,b@example.com', 2);
+is($ret, 0, 'mails are sent with PIPELINING and CHUNKING');
+stop_peer($peer);
+
+$log = peer_log($peer);
+like($log, qr/^AUTH PLAIN \S+$/m, 'AUTH PLAIN is used');
+like($log, qr/^MAIL FROM:<sender\@example\.com> BODY=8BITMIME \+$/m, 'MAIL FROM is pipelined');
+like($log, qr/^RCPT TO:<a\@example\.com> \+\nRCPT TO:<b\@example\.com>\nBDAT \d+ LAST$/m,
+	'BDAT is sent after replies to RCPT TO');
+unlike($log, qr/^DATA/m, 'DATA is not used with CHUNKING');
+is(() = $log =~ /^CONNECT$/mg, 1, 'connection is reused');
+is(() = $log =~ /^BDAT \d+ LAST$/mg, 2, 'both mails are sent');
+
+# the body is not uploaded, when all recipients are refused
+$peer = start_peer('rejected', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN');
+($ret, $stdout, $stderr) = send_mails($peer, 'reject@example.com', 1);
+isnt($ret, 0, 'mail refused for all recipients is not sent');
+like($stderr, qr/No recipient was accepted by mail server/, 'error of refused recipients');
+stop_peer($peer);
+
+$log = peer_log($peer);
+like($log, qr/^RCPT TO:<reject\@example\.com>$/m, 'recipient was sent');
+unlike($log, qr/^BDAT/m, 'body was not uploaded');
+
+# some recipients refused, the mail is sent to others
+$peer = start_peer('partial', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN');
+($ret, $stdout, $stderr) = send_mails($peer, 'reject@example.com,c@example.com', 1);
+is($ret, 0, 'mail is sent when some recipient is accepted');
+like($stderr, qr/recipient <reject\@example\.com> was rejected/, 'warning of refused recipient');
+stop_peer($peer);
+
+like(peer_log($peer), qr/^BDAT \d+ LAST$/m, 'body was uploaded');
+
+# without CHUNKING the DATA command is pipelined with envelope
+$peer = start_peer('data', 'PIPELINING', 'AUTH PLAIN');
+$ret = send_mails($peer, 'a@example.com', 1);
+is($ret, 0, 'mail is sent by DATA');
+stop_peer($peer);
+
+$log = peer_log($peer);
+like($log, qr/^RCPT TO:<a\@example\.com> \+\nDATA\n/m, 'DATA is pipelined');
+like($log, qr/^END OF DATA$/m, 'body is sent after DATA');
+unlike($log, qr/^BDAT/m, 'BDAT is not used without CHUNKING');
+
+# without PIPELINING every command waits for reply
+$peer = start_peer('nopipelining', 'CHUNKING', 'AUTH PLAIN');
+$ret = send_mails($peer, 'a@example.com,b@example.com', 1);
+is($ret, 0, 'mail is sent without PIPELINING');
+stop_peer($peer);
+
+$log = peer_log($peer);
+unlike($log, qr/ \+$/m, 'no command is pipelined');
+like($log, qr/^BDAT \d+ LAST$/m, 'body is sent by BDAT');
+
+# the compressed attachment is streamed (the size is not known in advance)
+my $source = join('', map { "$_,row $_\n" } (1 .. 200000));
+my ($type, $filename, $content, $uncompressed);
+
+$peer = start_peer('compress', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN', 'SIZE 10000000');
+$ret = $node->psql('postgres', peer_settings($peer)
+	  . "call utl_mail.send_attach_varchar2('sender\@example.com', 'a\@example.com',\n"
+	  . "  attachment => (select string_agg(i || ',row ' || i, e'\\n') || e'\\n' from generate_series(1, 200000) i),\n"
+	  . "  att_filename => 'rows.csv', att_compress => 'gzip');\n"
+	  . "call utl_mail.send_attach_raw('sender\@example.com', 'a\@example.com',\n"
+	  . "  attachment => convert_to((select string_agg(i || ',row ' || i, e'\\n') || e'\\n' from generate_series(1, 200000) i), 'UTF8'),\n"
+	  . "  att_filename => 'rows.csv', att_compress => 'zip');\n");
+is($ret, 0, 'compressed attachments are sent');
+stop_peer($peer);
+
+$log = peer_log($peer);
+like($log, qr/^MAIL FROM:<sender\@example\.com> \+$/m, 'SIZE is not sent for streamed message');
+
+($type, $filename, $content) = received_attachment($peer, 1);
+is($type, 'application/gzip', 'gzip attachment type');
+is($filename, 'rows.csv.gz', 'gzip attachment name');
+gunzip(\$content => \$uncompressed);
+ok($uncompressed eq $source, 'gzip attachment is decompressed to source data');
+
+($type, $filename, $content) = received_attachment($peer, 2);
+is($type, 'application/zip', 'zip attachment type');
+is($filename, 'rows.csv.zip', 'zip attachment name');
+unzip(\$content => \$uncompressed, Name => 'rows.csv');
+ok($uncompressed eq $source, 'zip attachment is decompressed to source data');
+
+# the file is read by chunks while the message is sent
+my $path = "$PostgreSQL::Test::Utils::tmp_check/attachment.bin";
+my $file_content = join('', map { chr($_ % 251) x 7 } (1 .. 300000));
+
+open(my $afh, '>', $path) or die "cannot open $path: $!";
+binmode($afh);
+print $afh $file_content;
+close($afh);
+
+$peer = start_peer('file', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN');
+$ret = $node->psql('postgres', peer_settings($peer)
+	  . "call utl_mail.send_attach_file('sender\@example.com', 'a\@example.com', path => '$path');\n"
+	  . "call utl_mail.send_attach_file('sender\@example.com', 'a\@example.com', path => '$path', att_compress => 'gzip');\n");
+is($ret, 0, 'file attachments are sent');
+stop_peer($peer);
+
+($type, $filename, $content) = received_attachment($peer, 1);
+is($filename, 'attachment.bin', 'file attachment name');
+ok($content eq $file_content, 'file attachment is same as file');
+
+($type, $filename, $content) = received_attachment($peer, 2);
+is($filename, 'attachment.bin.gz', 'compressed file attachment name');
+gunzip(\$content => \$uncompressed);
+ok($uncompressed eq $file_content, 'compressed file attachment is decompressed to file');
+
+# the copies of arguments are in memory context of send, so they are counted
+$peer = start_peer('memory', 'PIPELINING', 'CHUNKING', 'AUTH PLAIN');
+($ret, $stdout, $stderr) = $node->psql('postgres', peer_settings($peer)
+	  . "call utl_mail.send_attach_varchar2('sender\@example.com', 'a\@example.com', attachment => repeat('x', 3000000));\n"
+	  . "select sends, last_send_bytes > 3000000, peak_send_bytes = last_send_bytes from utl_mail.memory_stats();\n"
+	  . "call utl_mail.send_attach_query('sender\@example.com', 'a\@example.com', query => 'select i from generate_series(1, 10000) i');\n"
+	  . "select sends, last_send_bytes > 0, last_send_bytes < peak_send_bytes from utl_mail.memory_stats();\n");
+is($ret, 0, 'mails are sent');
+is($stdout, "1|t|t\n2|t|t", 'memory of sends is counted');
+stop_peer($peer);
+
+# LMTP over unix domain socket, the server replies for every accepted
+# recipient after data. When some reply is not read, then the connection
+# has unread data, and it is not reused for next mail.
+my $socket_dir = PostgreSQL::Test::Utils::tempdir_short();
+
+for my $mode ('data', 'chunking')
+{
+	my @extensions = ('PIPELINING');
+	my $socket = "$socket_dir/lmtp_$mode.sock";
+
+	push(@extensions, 'CHUNKING') if $mode eq 'chunking';
+
+	$peer = start_lmtp_peer($mode, $socket, @extensions);
+	($ret, $stdout, $stderr) = $node->psql('postgres',
+		    "set orafce_mail.smtp_server_url to 'lmtp://localhost';\n"
+		  . "set orafce_mail.smtp_server_unix_socket to '$socket';\n"
+		  . "call utl_mail.send('sender\@example.com', 'a\@example.com,reject\@example.com,refuse\@example.com', message => 'Hello');\n"
+		  . "call utl_mail.send('sender\@example.com', 'b\@example.com', message => 'Hello');\n"
+		  . "call utl_mail.send('sender\@example.com', 'refuse\@example.com', message => 'Hello');\n");
+	isnt($ret, 0, "LMTP ($mode): mail refused for all recipients after data is not sent");
+	like($stderr, qr/recipient <reject\@example\.com> was rejected/,
+		"LMTP ($mode): warning of recipient refused by RCPT TO");
+	like($stderr, qr/mail was not delivered to some recipient.*\n.*550 mailbox of refuse\@example\.com is full/,
+		"LMTP ($mode): warning of recipient refused after data");
+	like($stderr, qr/Mail server replied to end of data: 550 mailbox of refuse\@example\.com is full/,
+		"LMTP ($mode): error of mail refused after data");
+	stop_peer($peer);
+
+	$log = peer_log($peer);
+	like($log, qr/^LHLO /m, "LMTP ($mode): LHLO is used");
+	is(() = $log =~ /^REPLY /mg, 4, "LMTP ($mode): replies only for accepted recipients");
+	is(() = $log =~ /^CONNECT$/mg, 1, "LMTP ($mode): all replies are read, connection is reused");
+	is(() = $log =~ /^MAIL FROM:/mg, 3, "LMTP ($mode): all mails are sent");
+}
+
+# DKIM signature is verified independently by openssl
+for my $algorithm ('RSA', 'ED25519')
+{
+	my $key = "$PostgreSQL::Test::Utils::tmp_check/dkim_$algorithm.pem";
+	my $pubkey = "$PostgreSQL::Test::Utils::tmp_check/dkim_$algorithm.pub";
+	my ($tags, $body, $signed, $now);
+
+	run_log([ 'openssl', 'genpkey', '-algorithm', $algorithm, '-out', $key ])
+	  or die "cannot generate $algorithm key";
+	run_log([ 'openssl', 'pkey', '-in', $key, '-pubout', '-out', $pubkey ])
+	  or die "cannot export $algorithm public key";
+
+	$now = time();
+
+	$peer = start_peer("dkim_$algorithm", 'PIPELINING', 'CHUNKING');
+	$ret = $node->psql('postgres', peer_settings($peer)
+		  . "set orafce_mail.dkim_domain to 'example.com';\n"
+		  . "set orafce_mail.dkim_selector to 'pg2024';\n"
+		  . "set orafce_mail.dkim_private_key to '$key';\n"
+		  . "call utl_mail.send('sender\@example.com', 'a\@example.com', subject => 'dkim   test ',\n"
+		  . "  message => e'Hello  \\t world \\t\\n\\n  indented   text\\n \\t\\n\\n\\n\\n');\n"
+		  . "call utl_mail.send('sender\@example.com', 'a\@example.com', message => 'last line  ');\n"
+		  . "call utl_mail.send_attach_query('sender\@example.com', 'a\@example.com', message => 'Hello', query => 'select i from generate_series(1, 1000) i');\n");
+	is($ret, 0, "$algorithm: signed mails are sent");
+	stop_peer($peer);
+
+	($tags, $body, $signed) = dkim_parse(slurp_file("$peer->{log}.1"));
+	ok(defined $tags, "$algorithm: message has DKIM-Signature header");
+	is($tags->{v}, '1', "$algorithm: tag v");
+	is($tags->{a}, $algorithm eq 'RSA' ? 'rsa-sha256' : 'ed25519-sha256', "$algorithm: tag a");
+	is($tags->{c}, 'relaxed/relaxed', "$algorithm: tag c");
+	is($tags->{d}, 'example.com', "$algorithm: tag d");
+	is($tags->{s}, 'pg2024', "$algorithm: tag s");
+	like($tags->{h}, qr/^from:to:.*subject/, "$algorithm: tag h");
+	ok($tags->{t} >= $now && $tags->{t} <= time(), "$algorithm: tag t");
+
+	# the whitespaces are reduced, and the trailing empty lines are removed
+	is($body, "Hello world\r\n\r\n indented text\r\n", "$algorithm: canonicalized body");
+	is($tags->{bh}, encode_base64(sha256($body), ''), "$algorithm: body hash");
+	ok(dkim_verify($tags, $signed, $pubkey), "$algorithm: signature is verified");
+	ok(!dkim_verify($tags, $signed =~ s/dkim test/dkim tests/r, $pubkey),
+		"$algorithm: signature of changed header is not verified");
+
+	# the body without CRLF at end, and the body with materialized attachment
+	for my $n (2, 3)
+	{
+		($tags, $body, $signed) = dkim_parse(slurp_file("$peer->{log}.$n"));
+		is($tags->{bh}, encode_base64(sha256($body), ''), "$algorithm: body hash of mail $n");
+		ok(dkim_verify($tags, $signed, $pubkey), "$algorithm: signature of mail $n is verified");
+	}
+}
+
+$node->stop;
+
+done_testing();
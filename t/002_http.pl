@@ -0,0 +1,298 @@
+# Tests of HTTP transport against local HTTP server
+
+use strict;
+use warnings;
+
+use Fcntl qw(O_WRONLY O_CREAT O_EXCL);
+use IO::Handle;
+use IO::Socket::INET;
+use JSON::PP;
+use MIME::Base64;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+#
+# The server logs every connection and request line to file, and saves
+# headers and body of every request to file log.N. The request with
+# path /fail, or the message for recipient with "refuse" in address gets
+# status 500. The response to request with path /slow is delayed. Every
+# connection is served by own process, so the requests sent by parallel
+# connections are processed concurrently.
+#
+sub serve_client
+{
+	my ($client, $log) = @_;
+	my $buf = '';
+
+	my $fill = sub {
+		my $n = sysread($client, $buf, 65536, length($buf));
+		return defined($n) && $n > 0;
+	};
+
+	my $read_line = sub {
+		while ($buf !~ /\r\n/)
+		{
+			return undef unless $fill->();
+		}
+		$buf =~ s/^(.*?)\r\n//s;
+		return $1;
+	};
+
+	my $read_bytes = sub {
+		my ($size) = @_;
+
+		while (length($buf) < $size)
+		{
+			return undef unless $fill->();
+		}
+		return substr($buf, 0, $size, '');
+	};
+
+	open(my $fh, '>>', $log) or die "cannot open $log: $!";
+	$fh->autoflush(1);
+
+	print $fh "CONNECT\n";
+
+	while (defined(my $request = $read_line->()))
+	{
+		my %headers;
+		my $head = '';
+		my $body = '';
+
+		while (defined(my $line = $read_line->()))
+		{
+			last if $line eq '';
+			$head .= "$line\n";
+			$headers{ lc($1) } = $2 if $line =~ /^([^:]+):\s*(.*)$/;
+		}
+
+		if (($headers{'transfer-encoding'} // '') eq 'chunked')
+		{
+			while (defined(my $line = $read_line->()))
+			{
+				my $size = hex($line);
+
+				if ($size == 0)
+				{
+					$read_line->();
+					last;
+				}
+				$body .= $read_bytes->($size);
+				$read_line->();
+			}
+			print $fh "$request chunked\n";
+		}
+		else
+		{
+			$body = $read_bytes->($headers{'content-length'} // 0);
+			print $fh "$request\n";
+		}
+
+		my $n = 1;
+		my $rfh;
+
+		$n++ until sysopen($rfh, "$log.$n", O_WRONLY | O_CREAT | O_EXCL);
+		binmode($rfh);
+		print $rfh $head, "\n", $body;
+		close($rfh);
+
+		select(undef, undef, undef, 0.5) if $request =~ m{^POST /slow };
+
+		if ($request =~ m{^POST /fail } || $body =~ /refuse\@/)
+		{
+			syswrite($client,
+				"HTTP/1.1 500 Internal Server Error\r\nContent-Length: 13\r\n\r\nmailbox full\n");
+		}
+		else
+		{
+			syswrite($client, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nok\n");
+		}
+	}
+
+	close($fh);
+	close($client);
+}
+
+sub start_server
+{
+	my ($name) = @_;
+	my $log = "$PostgreSQL::Test::Utils::tmp_check/http_$name.log";
+
+	my $listen = IO::Socket::INET->new(
+		LocalAddr => '127.0.0.1',
+		LocalPort => 0,
+		Listen => 5,
+		ReuseAddr => 1) or die "cannot listen: $!";
+
+	my $pid = fork();
+	die "cannot fork: $!" unless defined $pid;
+
+	if ($pid == 0)
+	{
+		my %children;
+
+		$SIG{TERM} = sub { kill('TERM', keys %children); exit(0); };
+
+		while (my $client = $listen->accept())
+		{
+			my $child = fork();
+			die "cannot fork: $!" unless defined $child;
+
+			if ($child == 0)
+			{
+				$SIG{TERM} = 'DEFAULT';
+				close($listen);
+				serve_client($client, $log);
+				exit(0);
+			}
+
+			$children{$child} = 1;
+			close($client);
+		}
+		exit(0);
+	}
+
+	my $port = $listen->sockport();
+	close($listen);
+
+	return { pid => $pid, port => $port, log => $log };
+}
+
+sub stop_server
+{
+	my ($server) = @_;
+
+	kill('TERM', $server->{pid});
+	waitpid($server->{pid}, 0);
+}
+
+sub server_log
+{
+	my ($server) = @_;
+
+	return -e $server->{log} ? slurp_file($server->{log}) : '';
+}
+
+# returns headers and body of received request
+sub received_request
+{
+	my ($server, $n) = @_;
+	my $request = slurp_file("$server->{log}.$n");
+
+	return split(/\n\n/, $request, 2);
+}
+
+sub server_settings
+{
+	my ($server, $path, $format) = @_;
+
+	return "set orafce_mail.smtp_server_url to 'http://127.0.0.1:$server->{port}$path';\n"
+	  . "set orafce_mail.smtp_server_userpwd to 'apiuser:apikey';\n"
+	  . "set orafce_mail.http_payload_format to '$format';\n";
+}
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION orafce_mail CASCADE');
+
+my ($server, $log, $ret, $stdout, $stderr, $headers, $body);
+
+# raw message, the connection is reused by next mail
+$server = start_server('raw');
+$ret = $node->psql('postgres', server_settings($server, '/send', 'raw')
+	  . "call utl_mail.send('sender\@example.com', 'a\@example.com', bcc => 'b\@example.com', subject => 'first', message => 'Hello');\n"
+	  . "call utl_mail.send('sender\@example.com', 'a\@example.com', subject => 'second', message => 'Hello');\n");
+is($ret, 0, 'mails are sent by POST');
+stop_server($server);
+
+$log = server_log($server);
+is(() = $log =~ /^CONNECT$/mg, 1, 'connection is reused');
+is(() = $log =~ m{^POST /send HTTP/1\.1$}mg, 2, 'both mails are posted');
+
+($headers, $body) = received_request($server, 1);
+like($headers, qr/^Content-Type: message\/rfc822$/mi, 'content type of raw message');
+my $credentials = encode_base64('apiuser:apikey', '');
+like($headers, qr/^Authorization: Basic \Q$credentials\E$/mi, 'basic authentication');
+like($body, qr/^Subject: first\r$/m, 'body is the message');
+like($body, qr/^Bcc: b\@example\.com\r$/m, 'raw message has Bcc header');
+
+# JSON payload with envelope
+$server = start_server('json');
+$ret = $node->psql('postgres', server_settings($server, '/send', 'json')
+	  . "call utl_mail.send('sender\@example.com', 'a\@example.com', bcc => 'b\@example.com', subject => 'json', message => 'Hello');\n");
+is($ret, 0, 'mail is sent as JSON');
+stop_server($server);
+
+($headers, $body) = received_request($server, 1);
+like($headers, qr/^Content-Type: application\/json$/mi, 'content type of JSON payload');
+
+my $payload = decode_json($body);
+is($payload->{from}, 'sender@example.com', 'envelope sender');
+is_deeply($payload->{to}, [ 'a@example.com', 'b@example.com' ], 'envelope recipients');
+
+my $message = decode_base64($payload->{raw});
+like($message, qr/^Subject: json\r$/m, 'raw message is base64 encoded');
+unlike($message, qr/^Bcc:/m, 'Bcc header is not sent with envelope');
+
+# the message with query attachment is streamed by chunked encoding
+$server = start_server('stream');
+$ret = $node->psql('postgres', server_settings($server, '/send', 'json')
+	  . "call utl_mail.send_attach_query('sender\@example.com', 'a\@example.com', query => 'select i from generate_series(1, 100000) i');\n");
+is($ret, 0, 'streamed mail is sent');
+stop_server($server);
+
+like(server_log($server), qr{^POST /send HTTP/1\.1 chunked$}m, 'chunked encoding is used');
+
+($headers, $body) = received_request($server, 1);
+$message = decode_base64(decode_json($body)->{raw});
+like($message, qr/filename="query\.csv"/, 'message has query attachment');
+
+# the status other than 2xx is an error
+$server = start_server('fail');
+($ret, $stdout, $stderr) = $node->psql('postgres', server_settings($server, '/fail', 'raw')
+	  . "call utl_mail.send('sender\@example.com', 'a\@example.com', message => 'Hello');\n");
+isnt($ret, 0, 'mail refused by server is not sent');
+like($stderr, qr/HTTP server returned status 500: mailbox full/, 'error with start of response');
+stop_server($server);
+
+# the mails of batch of send_merge are sent by concurrent requests (the
+# plain http:// uses HTTP/1.1, so the requests are sent by parallel
+# connections, the multiplexing over HTTP/2 cannot be tested there)
+$server = start_server('batch');
+($ret, $stdout, $stderr) = $node->psql('postgres', server_settings($server, '/slow', 'raw')
+	  . "call utl_mail.prepare_template(name => 'batch', subject => 'batch {{n}}', message => 'Hello', sender => 'sender\@example.com');\n"
+	  . "select utl_mail.send_merge('batch', 'select ''r'' || i || ''\@example.com'' as recipients, i as n from generate_series(1, 8) i', batch_size => 4);\n");
+is($ret, 0, 'mails of batches are sent');
+is($stdout, '8', 'all rows are processed');
+stop_server($server);
+
+$log = server_log($server);
+is(() = $log =~ m{^POST /slow HTTP/1\.1$}mg, 8, 'all mails are posted');
+cmp_ok(() = $log =~ /^CONNECT$/mg, '>', 1, 'requests of batch are sent by parallel connections');
+
+my %subjects;
+for my $n (1 .. 8)
+{
+	($headers, $body) = received_request($server, $n);
+	$subjects{$1} = 1 if $body =~ /^Subject: (batch \d+)\r$/m;
+}
+is_deeply([ sort keys %subjects ], [ map { "batch $_" } (1 .. 8) ], 'every mail of batches is received');
+
+# all mails of batch are sent, and then the error is raised
+$server = start_server('batch_fail');
+($ret, $stdout, $stderr) = $node->psql('postgres', server_settings($server, '/send', 'raw')
+	  . "call utl_mail.prepare_template(name => 'batch', subject => 'batch {{n}}', message => 'Hello', sender => 'sender\@example.com');\n"
+	  . "select utl_mail.send_merge('batch', 'select case when i = 2 then ''refuse'' else ''r'' || i end || ''\@example.com'' as recipients, i as n from generate_series(1, 4) i');\n");
+isnt($ret, 0, 'batch with refused mail fails');
+like($stderr, qr/cannot send 1 of 4 mails of batch/, 'error of batch');
+like($stderr, qr/HTTP server returned status 500: mailbox full/, 'error of refused mail');
+stop_server($server);
+
+is(() = server_log($server) =~ m{^POST /send HTTP/1\.1$}mg, 4, 'other mails of batch are posted');
+
+$node->stop;
+
+done_testing();
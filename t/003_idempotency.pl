@@ -0,0 +1,48 @@
+# Tests of idempotency keys stored in shared memory
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'orafce_mail'");
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE DATABASE db1');
+$node->safe_psql('postgres', 'CREATE DATABASE db2');
+
+for my $db ('db1', 'db2')
+{
+	$node->safe_psql($db, 'CREATE EXTENSION orafce_mail CASCADE');
+}
+
+sub claim
+{
+	my ($db, $key) = @_;
+
+	return $node->safe_psql($db, "select utl_mail.claim_idempotency_key('$key')");
+}
+
+is(claim('db1', 'invoice-1'), 't', 'key is claimed in first database');
+is(claim('db1', 'invoice-1'), 'f', 'duplicate key in same database');
+is(claim('db2', 'invoice-1'), 't', 'same key is claimed in other database');
+is(claim('db2', 'invoice-1'), 'f', 'duplicate key in other database');
+
+# the keys longer than hash key are stored as digest
+my $long_key = 'x' x 100;
+
+is(claim('db1', $long_key), 't', 'long key is claimed in first database');
+is(claim('db2', $long_key), 't', 'long key is claimed in other database');
+is(claim('db2', $long_key), 'f', 'duplicate long key');
+
+# the keys are not stored in table, when shared memory is used
+is($node->safe_psql('db1', 'select count(*) from utl_mail.idempotency_key'),
+	'0', 'keys are stored in shared memory');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,78 @@
+# Tests of spool directory transport
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $spool = "$PostgreSQL::Test::Utils::tmp_check/spool";
+
+mkdir($spool) or die "cannot create $spool: $!";
+mkdir("$spool/tmp") or die "cannot create $spool/tmp: $!";
+mkdir("$spool/new") or die "cannot create $spool/new: $!";
+
+sub spool_files
+{
+	my ($subdir) = @_;
+
+	opendir(my $dh, "$spool/$subdir") or die "cannot open $spool/$subdir: $!";
+	my @files = grep { !/^\./ } readdir($dh);
+	closedir($dh);
+
+	return scalar(@files);
+}
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION orafce_mail CASCADE');
+$node->safe_psql('postgres', 'CREATE TABLE t(k int)');
+
+my $url = "set orafce_mail.smtp_server_url to 'file://$spool'";
+my $send = "call utl_mail.send('sender\@example.com', 'a\@example.com', message => 'Hello')";
+
+# the mail of committed transaction is delivered
+$node->safe_psql('postgres', "$url; $send;");
+is(spool_files('new'), 1, 'mail is delivered after commit');
+is(spool_files('tmp'), 0, 'name in tmp is removed after commit');
+
+# the mail of aborted transaction is removed
+$node->safe_psql('postgres', "$url; begin; $send; rollback;");
+is(spool_files('new'), 1, 'mail of aborted transaction is not delivered');
+is(spool_files('tmp'), 0, 'file of aborted transaction is removed');
+
+#
+# The serialization failure is raised in commit after pre-commit callbacks,
+# so the files can be linked only after the commit is recorded.
+#
+my $s1 = $node->background_psql('postgres');
+my $s2 = $node->background_psql('postgres');
+
+$s1->query_safe($url);
+$s1->query_safe('begin isolation level serializable');
+$s1->query_safe('select count(*) from t');
+$s2->query_safe('begin isolation level serializable');
+$s2->query_safe('select count(*) from t');
+
+$s1->query_safe('insert into t values(1)');
+$s1->query_safe($send);
+is(spool_files('tmp'), 1, 'mail is written to tmp before commit');
+
+$s2->query_safe('insert into t values(2)');
+$s2->query_safe('commit');
+
+my ($stdout, $ret) = $s1->query('commit');
+isnt($ret, 0, 'transaction is aborted by serialization failure in commit');
+
+is(spool_files('new'), 1, 'mail of transaction aborted in commit is not delivered');
+is(spool_files('tmp'), 0, 'file of transaction aborted in commit is removed');
+
+$s1->quit;
+$s2->quit;
+
+$node->stop;
+
+done_testing();
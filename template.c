@@ -0,0 +1,706 @@
+/*
+ * Compiled message templates
+ *
+ * The subject and the message are parsed only once (when the template is
+ * prepared) to list of literal and placeholder segments. The placeholders
+ * has format {{name}}. The templates are cached in backend's memory.
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/jsonb.h"
+#include "utils/memutils.h"
+#include "utils/numeric.h"
+
+#include "orafce_mail.h"
+
+PG_FUNCTION_INFO_V1(orafce_mail_prepare_template);
+PG_FUNCTION_INFO_V1(orafce_mail_drop_template);
+PG_FUNCTION_INFO_V1(orafce_mail_send_template);
+PG_FUNCTION_INFO_V1(orafce_mail_send_merge);
+
+typedef struct
+{
+	HeapTuple	tuple;
+	TupleDesc	tupdesc;
+} MergeRow;
+
+static HTAB *templates = NULL;
+
+static void
+add_segment(CompiledText *ct, bool is_param, const char *str, size_t len)
+{
+	TemplateSegment *seg;
+
+	if (len == 0)
+		return;
+
+	seg = &ct->segments[ct->nsegments++];
+
+	seg->is_param = is_param;
+	seg->len = len;
+
+	if (is_param)
+		seg->str = pnstrdup(str, len);
+	else
+	{
+		seg->str = str;
+		ct->literal_size += len;
+	}
+}
+
+/*
+ * Parse string to list of segments. Literal segments points to
+ * the copy of source string, so the source string can be released.
+ */
+static void
+compile_text(CompiledText *ct, const char *source)
+{
+	const char *str;
+	const char *ptr;
+	const char *literal_start;
+	int			nplaceholders = 0;
+
+	memset(ct, 0, sizeof(CompiledText));
+
+	if (!source)
+	{
+		ct->is_null = true;
+		return;
+	}
+
+	str = pstrdup(source);
+
+	for (ptr = strstr(str, "{{"); ptr; ptr = strstr(ptr + 2, "{{"))
+		nplaceholders += 1;
+
+	ct->segments = palloc(sizeof(TemplateSegment) * (2 * nplaceholders + 1));
+
+	ptr = literal_start = str;
+
+	while (*ptr)
+	{
+		if (ptr[0] == '{' && ptr[1] == '{')
+		{
+			const char *start = ptr + 2;
+			const char *end = strstr(start, "}}");
+			const char *name_end;
+
+			if (!end)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("unterminated placeholder"),
+						 errdetail("Missing \"}}\" after \"%.20s\".", ptr)));
+
+			add_segment(ct, false, literal_start, ptr - literal_start);
+
+			name_end = end;
+			while (start < name_end && isspace((unsigned char) *start))
+				start++;
+			while (name_end > start && isspace((unsigned char) name_end[-1]))
+				name_end--;
+
+			if (start == name_end)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("placeholder without name")));
+
+			add_segment(ct, true, start, name_end - start);
+
+			ptr = literal_start = end + 2;
+		}
+		else
+			ptr++;
+	}
+
+	add_segment(ct, false, literal_start, ptr - literal_start);
+}
+
+/*
+ * Returns rendered string. The values of all placeholders are
+ * searched first, so the result can be written to one buffer
+ * of exact size.
+ */
+char *
+render_compiled_text(CompiledText *ct, TemplateParamGetter getter, void *arg)
+{
+	const char **values;
+	size_t	   *lens;
+	size_t		size;
+	char	   *result;
+	char	   *wptr;
+	int			i;
+
+	if (ct->is_null)
+		return NULL;
+
+	values = palloc(ct->nsegments * sizeof(char *));
+	lens = palloc(ct->nsegments * sizeof(size_t));
+
+	size = ct->literal_size;
+
+	for (i = 0; i < ct->nsegments; i++)
+	{
+		TemplateSegment *seg = &ct->segments[i];
+
+		if (seg->is_param)
+		{
+			values[i] = getter(arg, seg->str, &lens[i]);
+			size += lens[i];
+		}
+		else
+		{
+			values[i] = seg->str;
+			lens[i] = seg->len;
+		}
+	}
+
+	wptr = result = palloc(size + 1);
+
+	for (i = 0; i < ct->nsegments; i++)
+	{
+		memcpy(wptr, values[i], lens[i]);
+		wptr += lens[i];
+	}
+
+	*wptr = '\0';
+
+	pfree(values);
+	pfree(lens);
+
+	return result;
+}
+
+static const char *
+jsonb_param_getter(void *arg, const char *name, size_t *len)
+{
+	Jsonb	   *params = (Jsonb *) arg;
+	JsonbValue	key;
+	JsonbValue *v = NULL;
+
+	if (params)
+	{
+		key.type = jbvString;
+		key.val.string.val = (char *) name;
+		key.val.string.len = strlen(name);
+
+		v = findJsonbValueFromContainer(&params->root, JB_FOBJECT, &key);
+	}
+
+	if (!v)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("missing value of placeholder \"%s\"", name)));
+
+	switch (v->type)
+	{
+		case jbvNull:
+			*len = 0;
+			return "";
+
+		case jbvString:
+			*len = v->val.string.len;
+			return v->val.string.val;
+
+		case jbvBool:
+			*len = v->val.boolean ? 4 : 5;
+			return v->val.boolean ? "true" : "false";
+
+		case jbvNumeric:
+			{
+				char	   *str;
+
+				str = DatumGetCString(DirectFunctionCall1(numeric_out,
+														  NumericGetDatum(v->val.numeric)));
+				*len = strlen(str);
+				return str;
+			}
+
+		default:
+			{
+				char	   *str;
+
+				str = JsonbToCString(NULL, v->val.binary.data, v->val.binary.len);
+				*len = strlen(str);
+				return str;
+			}
+	}
+}
+
+static MailTemplate *
+find_template(const char *name, bool missing_ok)
+{
+	MailTemplate *template = NULL;
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("template name \"%s\" is too long", name)));
+
+	if (templates)
+		template = (MailTemplate *) hash_search(templates, name, HASH_FIND, NULL);
+
+	if (!template && !missing_ok)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("template \"%s\" does not exist", name)));
+
+	return template;
+}
+
+MailTemplate *
+get_template(const char *name)
+{
+	return find_template(name, false);
+}
+
+/*
+ * PROCEDURE utl_mail.prepare_template(
+ * 		name varchar2,
+ * 		subject varchar2,
+ * 		message varchar2,
+ * 		mime_type varchar2 DEFAULT NULL,
+ * 		sender varchar2 DEFAULT NULL,
+ * 		priority integer DEFAULT NULL,
+ * 		replyto varchar2 DEFAULT NULL)
+ *
+ */
+Datum
+orafce_mail_prepare_template(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	char	   *subject;
+	char	   *message;
+	char	   *mime_type;
+	char	   *sender;
+	char	   *replyto;
+	MailTemplate tmpl;
+	MailTemplate *entry;
+	MemoryContext oldcxt;
+	bool		found;
+
+	name = not_null_not_empty_arg(fcinfo, 0, "utl_mail.prepare_template", "name");
+	subject = null_or_empty_arg(fcinfo, 1);
+	message = null_or_empty_arg(fcinfo, 2);
+	mime_type = null_or_empty_arg(fcinfo, 3);
+	sender = null_or_empty_arg(fcinfo, 4);
+	replyto = null_or_empty_arg(fcinfo, 6);
+
+	/* check length of name */
+	(void) find_template(name, true);
+
+	memset(&tmpl, 0, sizeof(MailTemplate));
+	strcpy(tmpl.name, name);
+
+	if (!PG_ARGISNULL(5))
+		tmpl.priority = PG_GETARG_INT32(5);
+	else
+		tmpl.priority_is_null = true;
+
+	/*
+	 * The compiled template is stored in own context, so it can be
+	 * released when the template is replaced or dropped.
+	 */
+	tmpl.mcxt = AllocSetContextCreate(TopMemoryContext,
+									  "orafce_mail template",
+									  ALLOCSET_SMALL_SIZES);
+
+	oldcxt = MemoryContextSwitchTo(tmpl.mcxt);
+
+	PG_TRY();
+	{
+		compile_text(&tmpl.subject, subject);
+		compile_text(&tmpl.message, message);
+
+		tmpl.sender = sender ? pstrdup(sender) : NULL;
+		tmpl.replyto = replyto ? pstrdup(replyto) : NULL;
+
+		/*
+		 * The default Content-Type is formatted only once
+		 */
+		if (mime_type)
+			tmpl.mime_type = pstrdup(mime_type);
+		else
+			tmpl.mime_type = psprintf("text/plain; charset=\"%s\"",
+									  get_encoding_name_for_icu(pg_get_client_encoding()));
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextDelete(tmpl.mcxt);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+
+	if (!templates)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = NAMEDATALEN;
+		ctl.entrysize = sizeof(MailTemplate);
+		ctl.hcxt = TopMemoryContext;
+
+		templates = hash_create("orafce_mail templates",
+								16,
+								&ctl,
+#if PG_VERSION_NUM >= 140000
+								HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+#else
+								HASH_ELEM | HASH_CONTEXT);
+#endif
+	}
+
+	entry = (MailTemplate *) hash_search(templates, tmpl.name, HASH_ENTER, &found);
+
+	/*
+	 * Release previous version of template. The fields of new entry are
+	 * not initialized (the entry can be reused element of dropped template).
+	 */
+	if (found)
+		MemoryContextDelete(entry->mcxt);
+
+	memcpy(entry, &tmpl, sizeof(MailTemplate));
+
+	return (Datum) 0;
+}
+
+/*
+ * PROCEDURE utl_mail.drop_template(name varchar2)
+ *
+ */
+Datum
+orafce_mail_drop_template(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	MailTemplate *template;
+
+	name = not_null_not_empty_arg(fcinfo, 0, "utl_mail.drop_template", "name");
+
+	template = find_template(name, false);
+
+	MemoryContextDelete(template->mcxt);
+	(void) hash_search(templates, name, HASH_REMOVE, NULL);
+
+	return (Datum) 0;
+}
+
+/*
+ * PROCEDURE utl_mail.send_template(
+ * 		name varchar2,
+ * 		recipients varchar2,
+ * 		params jsonb DEFAULT NULL,
+ * 		cc varchar2 DEFAULT NULL,
+ * 		bcc varchar2 DEFAULT NULL,
+ * 		sender varchar2 DEFAULT NULL,
+ * 		idempotency_key varchar2 DEFAULT NULL)
+ *
+ */
+static Datum
+mail_send_template(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	char	   *recipients;
+	Jsonb	   *params = NULL;
+	char	   *cc;
+	char	   *bcc;
+	char	   *sender;
+	char	   *idempotency_key;
+	MailTemplate *template;
+
+	name = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_template", "name");
+	recipients = not_null_not_empty_arg(fcinfo, 1, "utl_mail.send_template", "recipients");
+
+	if (!PG_ARGISNULL(2))
+	{
+		params = PG_GETARG_JSONB_P(2);
+
+		if (!JB_ROOT_IS_OBJECT(params))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("params must be a jsonb object")));
+	}
+
+	cc = null_or_empty_arg(fcinfo, 3);
+	bcc = null_or_empty_arg(fcinfo, 4);
+	sender = null_or_empty_arg(fcinfo, 5);
+	idempotency_key = null_or_empty_arg(fcinfo, 6);
+
+	template = get_template(name);
+
+	send_template(template,
+				  sender,
+				  recipients,
+				  cc,
+				  bcc,
+				  jsonb_param_getter,
+				  params,
+				  idempotency_key);
+
+	return (Datum) 0;
+}
+
+Datum
+orafce_mail_send_template(PG_FUNCTION_ARGS)
+{
+	return call_in_send_context(mail_send_template, fcinfo);
+}
+
+/*
+ * Render template and send mail
+ */
+void
+send_template(MailTemplate *template,
+			  char *sender,
+			  char *recipients,
+			  char *cc,
+			  char *bcc,
+			  TemplateParamGetter getter,
+			  void *arg,
+			  char *idempotency_key)
+{
+	if (!sender)
+		sender = template->sender;
+
+	if (!sender)
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("sender is not specified"),
+				 errdetail("The sender is not specified by template \"%s\" or by argument \"sender\".",
+						   template->name)));
+
+	orafce_send_mail(sender,
+					 recipients,
+					 cc,
+					 bcc,
+					 render_compiled_text(&template->subject, getter, arg),
+					 template->replyto,
+					 template->priority,
+					 template->priority_is_null,
+					 render_compiled_text(&template->message, getter, arg),
+					 template->mime_type,
+					 NULL,
+					 0,
+					 NULL,
+					 NULL,
+					 false,
+					 false,
+					 NULL,
+					 idempotency_key);
+}
+
+static const char *
+row_param_getter(void *arg, const char *name, size_t *len)
+{
+	MergeRow   *row = (MergeRow *) arg;
+	int			fnum;
+	char	   *str;
+
+	fnum = SPI_fnumber(row->tupdesc, name);
+	if (fnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("missing value of placeholder \"%s\"", name),
+				 errdetail("The query has not column \"%s\".", name)));
+
+	str = SPI_getvalue(row->tuple, row->tupdesc, fnum);
+	if (!str)
+	{
+		*len = 0;
+		return "";
+	}
+
+	*len = strlen(str);
+
+	return str;
+}
+
+static char *
+row_value(MergeRow *row, int fnum)
+{
+	char	   *str;
+
+	if (fnum <= 0)
+		return NULL;
+
+	str = SPI_getvalue(row->tuple, row->tupdesc, fnum);
+
+	return str && *str ? str : NULL;
+}
+
+/*
+ * FUNCTION utl_mail.send_merge(
+ * 		template varchar2,
+ * 		query text,
+ * 		batch_size integer DEFAULT 1000)
+ * RETURNS bigint
+ *
+ * Sends one mail for every row of query's result. The query should to
+ * return column "recipients", and can return columns "sender", "cc", "bcc"
+ * and "idempotency_key". All columns can be used as placeholders of
+ * template. The rows are fetched by cursor in batches, and every message
+ * is rendered and sent in own memory context of send, that is deleted
+ * after send. The mails of one batch sent by HTTP transport are collected,
+ * and they are sent together by concurrent requests. Returns number of
+ * processed rows.
+ */
+Datum
+orafce_mail_send_merge(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	char	   *query;
+	int			batch_size;
+	MailTemplate *template;
+	MemoryContext send_cxt;
+	MemoryContext oldcxt;
+	SPIPlanPtr	plan;
+	Portal		portal;
+	int64		processed = 0;
+	int			recipients_fnum = 0;
+	int			sender_fnum = 0;
+	int			cc_fnum = 0;
+	int			bcc_fnum = 0;
+	int			idempotency_key_fnum = 0;
+	bool		first_batch = true;
+	bool		own_batch;
+	MemoryContext merge_cxt;
+
+	name = not_null_not_empty_arg(fcinfo, 0, "utl_mail.send_merge", "template");
+	query = not_null_not_empty_arg(fcinfo, 1, "utl_mail.send_merge", "query");
+	batch_size = DatumGetInt32(not_null_arg(fcinfo, 2, "utl_mail.send_merge", "batch_size"));
+
+	if (batch_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("batch_size should be positive number")));
+
+	template = get_template(name);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	plan = SPI_prepare(query, 0, NULL);
+	if (!plan)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+	portal = SPI_cursor_open(NULL, plan, NULL, NULL, false);
+
+	/*
+	 * The mails sent by HTTP are collected, and the mails of every batch
+	 * of rows are sent concurrently.
+	 */
+	own_batch = mail_batch_begin();
+	merge_cxt = CurrentMemoryContext;
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			uint64		i;
+
+			SPI_cursor_fetch(portal, true, batch_size);
+
+			if (SPI_processed == 0)
+				break;
+
+			if (first_batch)
+			{
+				TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+
+				recipients_fnum = SPI_fnumber(tupdesc, "recipients");
+				if (recipients_fnum <= 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_OBJECT),
+							 errmsg("query has not column \"recipients\"")));
+
+				sender_fnum = SPI_fnumber(tupdesc, "sender");
+				cc_fnum = SPI_fnumber(tupdesc, "cc");
+				bcc_fnum = SPI_fnumber(tupdesc, "bcc");
+				idempotency_key_fnum = SPI_fnumber(tupdesc, "idempotency_key");
+
+				first_batch = false;
+			}
+
+			for (i = 0; i < SPI_processed; i++)
+			{
+				MergeRow	row;
+				char	   *recipients;
+
+				/* every mail is rendered and sent in own memory context */
+				send_cxt = send_memory_begin();
+				oldcxt = MemoryContextSwitchTo(send_cxt);
+
+				PG_TRY();
+				{
+					row.tuple = SPI_tuptable->vals[i];
+					row.tupdesc = SPI_tuptable->tupdesc;
+
+					recipients = row_value(&row, recipients_fnum);
+					if (!recipients)
+						ereport(ERROR,
+								(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+								 errmsg("NULL or empty string is not allowed"),
+								 errhint("The value of column \"recipients\" of row %lld is NULL or empty string.",
+										 (long long) (processed + 1))));
+
+					send_template(template,
+								  row_value(&row, sender_fnum),
+								  recipients,
+								  row_value(&row, cc_fnum),
+								  row_value(&row, bcc_fnum),
+								  row_param_getter,
+								  &row,
+								  row_value(&row, idempotency_key_fnum));
+				}
+				PG_CATCH();
+				{
+					MemoryContextSwitchTo(oldcxt);
+					send_memory_abort(send_cxt);
+
+					PG_RE_THROW();
+				}
+				PG_END_TRY();
+
+				MemoryContextSwitchTo(oldcxt);
+				send_memory_end(send_cxt);
+
+				processed += 1;
+
+				CHECK_FOR_INTERRUPTS();
+			}
+
+			/* the mails of fetched rows are sent together */
+			if (own_batch)
+				mail_batch_flush();
+
+			SPI_freetuptable(SPI_tuptable);
+		}
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(merge_cxt);
+
+		if (own_batch)
+			mail_batch_end();
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (own_batch)
+		mail_batch_end();
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	PG_RETURN_INT64(processed);
+}